@@ -10,10 +10,17 @@
 //#include "aesctr/wy.h"
 #include "lsh.h"
 #include "sdq.h"
+#include "metric.h"
+#include "quantize.h"
 #include <map>
 #include <cmath>
 #include <set>
 #include <queue>
+#include <numeric>
+#include <mutex>
+#include <shared_mutex>
+#include <future>
+#include <atomic>
 #include "blaze/Math.h"
 
 #ifndef RESTRICT
@@ -78,6 +85,18 @@ INLINE auto perform_lbound(const T &x, ItemType item) {
 
 static_assert(has_lower_bound_mf<std::set<int>>::value, "std::set must have lb mf");
 
+// Contiguous sorted containers, whose underlying arrays can be filled directly.
+template<typename T>
+struct is_flat_sorted: std::false_type {};
+template<template<typename...> class Container, typename T, typename All, typename Cmp, typename...Args>
+struct is_flat_sorted<sorted::container<Container, T, All, Cmp, Args...>>: std::true_type {};
+
+// Projectors exposing their dense projection matrix (MatrixLSHasher), which allows projecting a batch with one GEMM.
+template<typename P, typename=void>
+struct has_matrix_mf: std::false_type {};
+template<typename P>
+struct has_matrix_mf<P, std::void_t<decltype(std::declval<const P &>().matrix())>>: std::true_type {};
+
 template<typename float_type, typename SizeType>
 struct ProjID: public std::pair<float_type, SizeType> {
     static_assert(std::is_integral<SizeType>::value, "must be integral");
@@ -139,22 +158,74 @@ double cossim(const T &x, const T &y) {
     return sim / std::sqrt(xs + ys);
 }
 
+/*
+ * Visit counts of the (level, id) pairs touched by one query, in an open-addressing table whose slots are tagged
+ * with the query's epoch. reset() is O(1), and time and memory scale with the number of pairs visited rather than l * n.
+ */
+template<typename CountType=std::uint16_t>
+class SparseCounter {
+    struct Slot {
+        uint64_t key;
+        uint32_t epoch;
+        CountType count;
+    };
+    std::vector<Slot> slots_;
+    uint32_t epoch_ = 1;
+    unsigned shift_;
+    size_t size_ = 0;
+    size_t index(uint64_t key) const {return (key * 0x9E3779B97F4A7C15ull) >> shift_;}
+    Slot *find_slot(uint64_t key) {
+        for(size_t i = index(key);; i = (i + 1) & (slots_.size() - 1))
+            if(slots_[i].epoch != epoch_ || slots_[i].key == key) return &slots_[i];
+    }
+    void resize(size_t n) {
+        std::vector<Slot> old(std::move(slots_));
+        slots_.assign(n, Slot{0, 0, 0});
+        shift_ = 64 - log2_64(n);
+        for(const auto &s: old)
+            if(s.epoch == epoch_) *find_slot(s.key) = s;
+    }
+public:
+    SparseCounter(size_t capacity=1024) {resize(roundup(std::max(capacity, size_t(16))));}
+    void reset() {
+        if(++epoch_ == 0) { // Wrapped: clear stale tags once every 2^32 queries.
+            for(auto &s: slots_) s.epoch = 0;
+            epoch_ = 1;
+        }
+        size_ = 0;
+    }
+    // Increments the count of key and returns the new count.
+    CountType increment(uint64_t key) {
+        if(2 * (size_ + 1) > slots_.size()) resize(slots_.size() * 2);
+        Slot *s = find_slot(key);
+        if(s->epoch != epoch_) {
+            *s = Slot{key, epoch_, 1};
+            ++size_;
+            return 1;
+        }
+        return ++s->count;
+    }
+    size_t size() const {return size_;}
+    size_t capacity() const {return slots_.size();}
+};
+
+enum class MetricSpace {
+    Euclidean,
+    CosineDistance
+};
+
 template<typename FType,
          typename IdType=std::uint32_t,
          template <typename...> class SortedContainerTemplate=std::set,
          template <typename...> class SetTemplate=ska::flat_hash_set,
          bool SO=blaze::rowMajor,
          typename Projector=MatrixLSHasher<FType, SO>,
-         typename CMatType=std::uint16_t>
+         typename CMatType=std::uint16_t,
+         MetricSpace Metric=MetricSpace::Euclidean>
 class DCI;
 
 // TODO: DCI without storing values, only store hashes
 
-enum class MetricSpace {
-    Euclidean,
-    CosineDistance
-};
-
 template<typename FT>
 struct Spanner {
     FT *p_;
@@ -196,6 +267,25 @@ struct ConstSpanner {
     auto end() const {return p_ + n_;}
 };
 
+/*
+ * Synchronization between a DCI's queries, writers and background compaction.
+ * Queries hold rw shared. add/build/update and the final swap of a compaction hold it exclusively.
+ * writer serializes writers with compaction, which rebuilds the maps while queries continue.
+ * Copying or moving waits for a running compaction; the copy starts unlocked.
+ */
+struct SyncState {
+    mutable std::shared_mutex rw;
+    mutable std::mutex writer, launch;
+    std::atomic<bool> compacting{false};
+    std::future<void> compaction;
+    SyncState() {}
+    SyncState(const SyncState &o) {o.wait();}
+    SyncState(SyncState &&o) {o.wait();}
+    void wait() const {
+        std::lock_guard<std::mutex> lock(launch);
+        if(compaction.valid()) compaction.wait();
+    }
+};
 
 template<typename ArithType,
          typename IdType,
@@ -203,10 +293,11 @@ template<typename ArithType,
          template <typename...> class SetTemplate,
          bool SO,
          typename Projector,
-         typename CMatType>
+         typename CMatType,
+         MetricSpace Metric>
 class DCI {
     static constexpr size_t ALIGNMENT = sizeof(vec::SIMDTypes<uint64_t>::Type);
-    using this_type = DCI<ArithType, IdType, SortedContainerTemplate, SetTemplate, SO, Projector, CMatType>;
+    using this_type = DCI<ArithType, IdType, SortedContainerTemplate, SetTemplate, SO, Projector, CMatType, Metric>;
     using const_this_type = const this_type;
     /*
      To use this: Hold values in their own container. (This is non-owning.)
@@ -220,11 +311,13 @@ class DCI {
     using matrix_type = blaze::DynamicMatrix<float_type, SO>;
     using value_type = const ArithType * /*RESTRICT*/;
     using bin_tree_iterator = typename map_type::const_iterator;
-    static constexpr MetricSpace distance_metric = MetricSpace::Euclidean;
+    // CosineDistance indexes and stores unit vectors (always owned), re-ranks by 1 - x . q and reports cosine distances.
+    static constexpr MetricSpace distance_metric = Metric;
     static constexpr bool is_cos = distance_metric == MetricSpace::CosineDistance;
 
     // Members
 
+    SyncState sync_; // First, so that copies and moves wait for compaction before reading anything else.
     std::vector<map_type> map_;
     std::vector<value_type> val_ptrs_;
 
@@ -237,6 +330,24 @@ private:
     double gamma_ = 1.;
     int orthonormalize_:1;
     int data_dependent_:1;
+    // Index-owned copies of the points, 64-byte-aligned rows stride_ apart, when owns_points_.
+    std::vector<float_type, AlignedAllocator<float_type>> points_;
+    std::vector<float_type> sqnorms_;
+    size_t stride_ = 0;
+    bool owns_points_ = false, keep_norms_ = false;
+    // Compressed codes for approximate re-ranking, and how many of the best to re-rank exactly, when quantized().
+    quant::QuantizedStore<float_type> codes_;
+    unsigned exact_rerank_ = 0;
+    // Bit i marks point i deleted. ncompacted_ of the ndeleted_ deletions have been purged from the maps.
+    // Updated with atomic builtins, as removals run concurrently with queries.
+    std::vector<uint64_t> tombstones_;
+    size_t ndeleted_ = 0, ncompacted_ = 0;
+    double compaction_threshold_ = .1;
+    struct WriteLock {
+        std::lock_guard<std::mutex> writer;
+        std::unique_lock<std::shared_mutex> rw;
+        WriteLock(SyncState &s): writer(s.writer), rw(s.rw) {}
+    };
 #ifdef TIME_ADDITIONS
     uint64_t clock = 0;
 #endif
@@ -244,10 +355,35 @@ private:
 
 public:
     size_t total() const {return m_ * l_;}
+    // true fits data-dependent directions to the indexed points (see fit_projections) and re-indexes them.
+    // On an empty index, they are fitted to the first build() instead. Random directions are not kept, so this can't be undone.
     void set_data_dependence(bool val) {
-        if(val) throw std::runtime_error("Not implemented: data_dependent version");
+        WriteLock lock(sync_);
+        if(!val && data_dependent_ && n_inserted_) throw std::runtime_error("Random projections are not retained after fitting data-dependent ones");
+        if(val && n_inserted_) {
+            const std::vector<IdType> live = live_ids();
+            if(live.empty()) throw std::runtime_error("Cannot fit projections: every point is deleted");
+            fit_projections(live.size(), [this,&live](size_t i) {return val_ptrs_[live[i]];});
+        }
         data_dependent_ = val;
     }
+    static constexpr size_t MAX_FIT_SAMPLE = 1 << 16;
+    // Replaces the random directions with directions fitted to the rows of sample, so they resolve the data where it varies.
+    // linalg::PCAAggregator finds the top ncomp principal directions: by default, the fewest explaining `explained` of the
+    // variance, but at least m. Each level then applies its own random rotation to that subspace and keeps the first m rows,
+    // so the levels remain independent. The directions are stored in the projector, which add, build and query use unchanged.
+    // Indexed points are re-projected. Requires a matrix projector; at most MAX_FIT_SAMPLE evenly spaced rows are used.
+    template<typename MT>
+    void fit_projections(const blaze::DenseMatrix<MT, blaze::rowMajor> &sample, size_t ncomp=0, double explained=.9, uint64_t seed=13) {
+        const auto &X = ~sample;
+        if(X.columns() != d_) {
+            char buf[256];
+            std::sprintf(buf, "[%s]: Expected %u columns, got %zu", __PRETTY_FUNCTION__, d_, X.columns());
+            throw std::runtime_error(buf);
+        }
+        WriteLock lock(sync_);
+        fit_projections(X.rows(), [&X](size_t i) {return &X(i, 0);}, ncomp, explained, seed);
+    }
     auto &gamma() {return gamma_;}
     auto gamma() const {return gamma_;}
     auto data_dependent() const {return data_dependent_;}
@@ -260,27 +396,33 @@ public:
     const auto &proj() const {return proj_;}
     template<template<typename...> class NewSortedContainerTemplate=sorted::vector>
     auto cvt() const & {
-        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType>(*this);
+        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType, Metric>(*this);
     }
     template<template<typename...> class NewSortedContainerTemplate=sorted::vector>
     auto cvt() const && {
-        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType>(std::move(const_cast<this_type &&>(*this)));
+        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType, Metric>(std::move(const_cast<this_type &&>(*this)));
     }
     template<template<typename...> class NewSortedContainerTemplate=sorted::vector>
     auto cvt() && {
-        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType>(std::move(*this));
+        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType, Metric>(std::move(*this));
     }
     template<template<typename...> class NewSortedContainerTemplate=sorted::vector>
     auto cvt() & {
-        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType>(*this);
+        return DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType, Metric>(*this);
     }
     template<template <typename...> class NewSortedContainerTemplate>
-    DCI(DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType> &&o):
+    DCI(DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType, Metric> &&o):
+        sync_(o.sync()),
         val_ptrs_(std::move(o.vps())),
         m_(o.m_), l_(o.l_), d_(o.d_), proj_(std::move(o.proj())), n_inserted_(o.n_inserted()),
         eps_(o.eps()), gamma_(o.gamma()),
         orthonormalize_(o.orthonormalize()),
-        data_dependent_(o.data_dependent())
+        data_dependent_(o.data_dependent()),
+        points_(std::move(o.points())), sqnorms_(std::move(o.sqnorms())), stride_(o.stride()),
+        owns_points_(o.owns_points()), keep_norms_(o.keep_norms()),
+        codes_(std::move(o.codes())), exact_rerank_(o.exact_rerank()),
+        tombstones_(o.tombstones()), ndeleted_(o.ndeleted()), ncompacted_(o.ncompacted()),
+        compaction_threshold_(o.compaction_threshold())
     {
         map().reserve(o.map().size());
         for(const auto &p: o.map()) {
@@ -288,17 +430,38 @@ public:
         }
     }
     template<template <typename...> class NewSortedContainerTemplate>
-    DCI(const DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType> &o):
+    DCI(const DCI<float_type, IdType, NewSortedContainerTemplate, SetTemplate, SO, Projector, CMatType, Metric> &o):
+        sync_(o.sync()),
         val_ptrs_(o.vps()),
         m_(o.m_), l_(o.l_), d_(o.d_), proj_(o.proj()), n_inserted_(o.n_inserted()),
         eps_(o.eps()), gamma_(o.gamma()),
         orthonormalize_(o.orthonormalize()),
-        data_dependent_(o.data_dependent())
+        data_dependent_(o.data_dependent()),
+        points_(o.points()), sqnorms_(o.sqnorms()), stride_(o.stride()),
+        owns_points_(o.owns_points()), keep_norms_(o.keep_norms()),
+        codes_(o.codes()), exact_rerank_(o.exact_rerank()),
+        tombstones_(o.tombstones()), ndeleted_(o.ndeleted()), ncompacted_(o.ncompacted()),
+        compaction_threshold_(o.compaction_threshold())
     {
         map().reserve(o.map().size());
         for(const auto &p: o.map())
             map_.emplace_back(p.begin(), p.end());
+        if(owns_points_) rebind_owned();
     }
+    DCI(const DCI &o):
+        sync_(o.sync_), map_(o.map_), val_ptrs_(o.val_ptrs_),
+        m_(o.m_), l_(o.l_), d_(o.d_), proj_(o.proj_), n_inserted_(o.n_inserted_),
+        eps_(o.eps_), gamma_(o.gamma_),
+        orthonormalize_(o.orthonormalize_), data_dependent_(o.data_dependent_),
+        points_(o.points_), sqnorms_(o.sqnorms_), stride_(o.stride_),
+        owns_points_(o.owns_points_), keep_norms_(o.keep_norms_),
+        codes_(o.codes_), exact_rerank_(o.exact_rerank_),
+        tombstones_(o.tombstones_), ndeleted_(o.ndeleted()), ncompacted_(o.ncompacted()),
+        compaction_threshold_(o.compaction_threshold_)
+    {
+        if(owns_points_) rebind_owned();
+    }
+    DCI(DCI &&o) = default;
     DCI(size_t m, size_t l, size_t d, double eps=1e-5,
         bool orthonormalize=true, float param=1., bool dd=false, uint64_t seed=1337):
         map_(m * l),
@@ -306,24 +469,291 @@ public:
         proj_(m * l, d, orthonormalize, seed),
         n_inserted_(0), eps_(eps), gamma_(param),
         orthonormalize_(orthonormalize),
-        data_dependent_(dd)
+        data_dependent_(dd),
+        stride_(is_cos ? padded_stride(d): 0),
+        owns_points_(is_cos)
+    {
+    }
+    // Points are not owned, so only the projector and the sorted projections are stored.
+    // After loading, call rebind() with the data in insertion order before querying.
+    // Members are read in declaration order.
+    explicit DCI(serial::Reader &r):
+        m_(r.expect(serial::DCI_INDEX, sizeof(float_type)).template read<uint32_t>()),
+        l_(r.read<uint32_t>()), d_(r.read<uint32_t>()),
+        proj_(r),
+        n_inserted_(r.read<uint64_t>()), eps_(r.read<double>()), gamma_(r.read<double>()),
+        orthonormalize_(r.read<uint8_t>()), data_dependent_(r.read<uint8_t>()),
+        stride_(is_cos ? padded_stride(d_): 0),
+        owns_points_(is_cos)
     {
+        map_.reserve(total());
+        std::vector<ProjI> tmp;
+        for(size_t i = 0; i < total(); ++i) {
+            const auto vals = r.read_array<float_type>();
+            const auto ids = r.read_array<IdType>();
+            if(vals.second != ids.second) {
+                char buf[256];
+                std::sprintf(buf, "[%s]: Projection %zu has %zu values but %zu ids.", __PRETTY_FUNCTION__, i, vals.second, ids.second);
+                throw std::runtime_error(buf);
+            }
+            tmp.resize(vals.second);
+            for(size_t j = 0; j < tmp.size(); ++j) tmp[j] = ProjI(vals.first[j], ids.first[j]);
+            map_.emplace_back(tmp.begin(), tmp.end());
+        }
+        if(r.version() >= 2) {
+            // Deleted entries were dropped from the maps when written.
+            tombstones_ = r.read_vector<uint64_t>();
+            for(const auto w: tombstones_) ndeleted_ += __builtin_popcountll(w);
+            ncompacted_ = ndeleted_;
+        }
+        tombstones_.resize((n_inserted_ + 63) / 64);
+        val_ptrs_.assign(n_inserted_, nullptr);
     }
+    void write(serial::Writer &w) const {
+        std::shared_lock<std::shared_mutex> lock(sync_.rw);
+        w.write_header(serial::DCI_INDEX, sizeof(float_type));
+        w.write<uint32_t>(m_); w.write<uint32_t>(l_); w.write<uint32_t>(d_);
+        proj_.write(w);
+        w.write<uint64_t>(n_inserted_); w.write<double>(eps_); w.write<double>(gamma_);
+        w.write<uint8_t>(orthonormalize_ != 0); w.write<uint8_t>(data_dependent_ != 0);
+        std::vector<float_type> vals;
+        std::vector<IdType> ids;
+        for(const auto &map: map_) {
+            vals.clear(); ids.clear();
+            for(const auto &p: map)
+                if(!is_deleted(p.id())) vals.push_back(p.f()), ids.push_back(p.id());
+            w.write_array(vals);
+            w.write_array(ids);
+        }
+        w.write_array(tombstones_);
+    }
+    // Point the index at its data: point i is at base + i * stride. A cosine index copies normalized points instead.
+    void rebind(const float_type *base, size_t stride) {
+        val_ptrs_.resize(n_inserted_);
+        for(size_t i = 0; i < n_inserted_; ++i) val_ptrs_[i] = base + i * stride;
+        CONST_IF(is_cos) own_normalized();
+    }
+    void rebind(std::vector<value_type> ptrs) {
+        if(ptrs.size() != n_inserted_) throw std::runtime_error("Wrong number of points for rebind.");
+        val_ptrs_ = std::move(ptrs);
+        CONST_IF(is_cos) own_normalized();
+    }
+    bool owns_points() const {return owns_points_;}
+    bool keep_norms() const {return keep_norms_;}
+    size_t stride() const {return stride_;}
+    auto &points() {return points_;}
+    const auto &points() const {return points_;}
+    auto &sqnorms() {return sqnorms_;}
+    const auto &sqnorms() const {return sqnorms_;}
+    // Bytes held by the index itself: map entries, point pointers, owned points and norms, codes and tombstones.
+    // Container overhead, the projection directions and caller-owned points are not counted.
+    size_t memory_bytes() const {
+        size_t entries = 0;
+        for(const auto &map: map_) entries += map.size();
+        return entries * sizeof(ProjI) + val_ptrs_.size() * sizeof(value_type)
+             + points_.size() * sizeof(float_type) + sqnorms_.size() * sizeof(float_type)
+             + codes_.bytes() + tombstones_.size() * sizeof(uint64_t);
+    }
+    // Copies the points into index-owned, 64-byte-aligned rows zero-padded to a multiple of 64 bytes, and copies every
+    // later insertion, so the caller's data need not outlive the index. keep_norms stores squared norms, so re-ranking
+    // computes ||x||^2 + ||q||^2 - 2 x . q with a single dot product per candidate.
+    void own_points(bool keep_norms=false) {
+        WriteLock lock(sync_);
+        if(!needs_points()) throw std::runtime_error("Points were released by quantize(store, 0) and cannot be owned.");
+        const size_t stride = padded_stride(d_);
+        std::vector<float_type, AlignedAllocator<float_type>> tmp(val_ptrs_.size() * stride);
+        for(size_t i = 0; i < val_ptrs_.size(); ++i)
+            std::copy(val_ptrs_[i], val_ptrs_[i] + d_, &tmp[i * stride]);
+        points_ = std::move(tmp);
+        stride_ = stride;
+        owns_points_ = true;
+        keep_norms_ = keep_norms;
+        sqnorms_.resize(keep_norms ? val_ptrs_.size(): size_t(0));
+        for(size_t i = 0; i < sqnorms_.size(); ++i) sqnorms_[i] = metric::sqrnorm(&points_[i * stride_], stride_);
+        rebind_owned();
+    }
+    auto &codes() {return codes_;}
+    const auto &codes() const {return codes_;}
+    unsigned exact_rerank() const {return exact_rerank_;}
+    bool quantized() const {return codes_.type() != quant::NO_QUANTIZATION;}
+    bool needs_points() const {return !quantized() || exact_rerank_;}
+    // Encodes every point with a trained store, whose codes then re-rank candidates. The best max(k, exact_rerank)
+    // by approximate distance are re-ranked on the full vectors. With exact_rerank == 0, points are never read again:
+    // owned copies are released and borrowed ones need not outlive the index. Codes are not serialized.
+    void quantize(quant::QuantizedStore<float_type> store, unsigned exact_rerank=0) {
+        WriteLock lock(sync_);
+        if(!store.trained()) throw std::runtime_error("DCI::quantize requires a trained QuantizedStore");
+        if(!needs_points()) throw std::runtime_error("DCI points were already released by quantize(store, 0)");
+        store.clear();
+        store.reserve(val_ptrs_.size());
+        for(const auto p: val_ptrs_) store.add(p);
+        codes_ = std::move(store);
+        exact_rerank_ = exact_rerank;
+        if(!exact_rerank) {
+            decltype(points_)().swap(points_);
+            std::vector<float_type>().swap(sqnorms_);
+            owns_points_ = keep_norms_ = false;
+            std::fill(val_ptrs_.begin(), val_ptrs_.end(), nullptr);
+        }
+    }
+private:
+    template<typename RowFunc>
+    void fit_projections(size_t n, const RowFunc &rowp, size_t ncomp=0, double explained=.9, uint64_t seed=13) {
+        CONST_IF(!has_matrix_mf<Projector>::value) {
+            throw std::runtime_error("Data-dependent projections require a matrix projector");
+        } else {
+            if(n == 0) throw std::runtime_error("Cannot fit projections to an empty sample");
+            if(n_inserted_ && !needs_points()) throw std::runtime_error("Points released by quantize(store, 0) cannot be re-projected");
+            for(size_t i = 0; i < n_inserted_; ++i) {
+                if(!val_ptrs_[i] && !is_deleted(i)) {
+                    char buf[256];
+                    std::sprintf(buf, "[%s]: point %zu is unbound; rebind() a loaded index before re-projecting it", __PRETTY_FUNCTION__, i);
+                    throw std::runtime_error(buf);
+                }
+            }
+            linalg::PCAAggregator<float_type> pca(d_);
+            const size_t step = std::max(size_t(1), n / MAX_FIT_SAMPLE);
+            for(size_t i = 0; i < n; i += step)
+                pca.add(blaze::CustomVector<const float_type, blaze::unaligned, blaze::unpadded, blaze::rowVector>(rowp(i), d_));
+            pca.finalize();
+            const auto &pcs = pca.components();
+            const auto &var = pca.variances();
+            if(!ncomp) {
+                double tot = 0., acc = 0.;
+                for(const auto v: var) tot += std::max(0., double(v));
+                while(ncomp < var.size() && acc < explained * tot) acc += std::max(0., double(var[ncomp++]));
+                ncomp = std::max(ncomp, size_t(std::min(m_, d_)));
+            }
+            ncomp = std::min(ncomp, size_t(d_));
+            typename Projector::CType dirs(total(), d_);
+            blaze::DynamicMatrix<float_type> g(ncomp, ncomp), coef(m_, ncomp);
+            for(size_t l = 0; l < l_; ++l) {
+                // Rows of Q form a random rotation of the top-ncomp subspace; levels with m > ncomp add random unit combinations.
+                unit_gaussian_fill(g, seed + l);
+                const blaze::DynamicMatrix<float_type> q = linalg::qr_gram_schmidt(g);
+                if(m_ <= ncomp) {
+                    coef = submatrix(q, 0, 0, m_, ncomp);
+                } else {
+                    unit_gaussian_fill(coef, ~(seed + l));
+                    submatrix(coef, 0, 0, ncomp, ncomp) = q;
+                    for(size_t j = ncomp; j < m_; ++j) row(coef, j) /= blaze::norm(row(coef, j));
+                }
+                submatrix(dirs, l * m_, 0, m_, d_) = coef * submatrix(pcs, 0, 0, ncomp, d_);
+            }
+            proj_ = Projector(std::move(dirs));
+            if(n_inserted_) reindex();
+        }
+    }
+    std::vector<IdType> live_ids() const {
+        std::vector<IdType> ret;
+        ret.reserve(live_size());
+        for(size_t i = 0; i < n_inserted_; ++i)
+            if(!is_deleted(i)) ret.push_back(i);
+        return ret;
+    }
+    // Projects every live point again, in chunks, after the directions change. Deleted points are not read (their rows
+    // may be gone) and stay out of the rebuilt maps, so every deletion counts as compacted.
+    void reindex() {
+        static constexpr size_t CHUNK = 1 << 16;
+        for(auto &map: map_) map = map_type();
+        blaze::DynamicMatrix<float_type> chunk;
+        std::vector<IdType> ids;
+        for(size_t next = 0; next < n_inserted_;) {
+            ids.clear();
+            for(; next < n_inserted_ && ids.size() < CHUNK; ++next)
+                if(!is_deleted(next)) ids.push_back(next);
+            if(ids.empty()) break;
+            chunk.resize(ids.size(), d_);
+            for(size_t i = 0; i < ids.size(); ++i) std::copy(val_ptrs_[ids[i]], val_ptrs_[ids[i]] + d_, &chunk(i, 0));
+            index_projections(project_batch(chunk), 0, ids.data());
+        }
+        __atomic_store_n(&ncompacted_, ndeleted(), __ATOMIC_RELAXED);
+    }
+    // Merges a sorted run into map. With a sorted::vector map, the run is written straight into its array.
+    static void append_sorted(map_type &map, const std::vector<ProjI> &run) {
+        CONST_IF(is_flat_sorted<map_type>::value) {
+            auto &c = map.con();
+            if(c.empty()) {
+                c.assign(run.begin(), run.end());
+            } else {
+                const size_t oldsize = c.size();
+                c.insert(c.end(), run.begin(), run.end());
+                std::inplace_merge(c.begin(), c.begin() + oldsize, c.end());
+            }
+        } else {
+            for(const auto &p: run) map.emplace_hint(map.end(), p);
+        }
+    }
+    // Sorts projections(i, :) (for points ids[0], ids[1], ..., or start, start + 1, ... without ids) and merges each into map i.
+    void index_projections(const blaze::DynamicMatrix<float_type> &projections, size_t start, const IdType *ids=nullptr) {
+        const size_t n = projections.columns();
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(size_t i = 0; i < total(); ++i) {
+            std::vector<ProjI> run(n);
+            for(size_t j = 0; j < n; ++j) run[j] = ProjI(projections(i, j), ids ? ids[j]: IdType(start + j));
+            std::sort(run.begin(), run.end());
+            append_sorted(map_[i], run);
+        }
+    }
+    // Erases id's entry from map, searching near *v when the projection is known and scanning otherwise.
+    // Projections computed by GEMM and by matrix-vector products can differ in the last bits, hence the window.
+    static void erase_entry(map_type &map, IdType id, const float_type *v) {
+        const map_type &cmap = map;
+        auto it = cmap.end();
+        if(v) {
+            const float_type tol = 1e-4 * (1 + std::abs(*v));
+            for(auto lb = perform_lbound(cmap, *v - tol); lb != cmap.end() && lb->first <= *v + tol; ++lb)
+                if(lb->second == id) {it = lb; break;}
+        }
+        if(it == cmap.end()) it = std::find_if(cmap.begin(), cmap.end(), [id](const ProjI &p) {return p.second == id;});
+        if(it == cmap.end()) return;
+        CONST_IF(is_flat_sorted<map_type>::value) {
+            auto &c = map.con();
+            c.erase(c.begin() + std::distance(cmap.begin(), it));
+        } else {
+            map.erase(it);
+        }
+    }
+    // Records a new point: a pointer to it (or to an owned copy) and its code.
+    value_type record(const float_type *p) {
+        if(quantized()) codes_.add(p);
+        return !needs_points() ? nullptr: owns_points_ ? store(p): p;
+    }
+    void rebind_owned() {
+        for(size_t i = 0; i < val_ptrs_.size(); ++i) val_ptrs_[i] = &points_[i * stride_];
+    }
+    static size_t padded_stride(size_t d) {return (d * sizeof(float_type) + 63) / 64 * 64 / sizeof(float_type);}
+    // Writes x / ||x|| to out[0:d_) (x itself if its norm is 0). out may alias x.
+    void normalize(const float_type *x, float_type *out) const {
+        const float_type n = std::sqrt(metric::sqrnorm(x, d_));
+        const float_type inv = n > 0 ? 1 / n: float_type(1);
+        for(size_t i = 0; i < d_; ++i) out[i] = x[i] * inv;
+    }
+    // Copies the points behind val_ptrs_ into owned storage, normalized.
+    void own_normalized() {
+        std::vector<float_type, AlignedAllocator<float_type>> tmp(val_ptrs_.size() * stride_);
+        for(size_t i = 0; i < val_ptrs_.size(); ++i) normalize(val_ptrs_[i], &tmp[i * stride_]);
+        points_ = std::move(tmp);
+        owns_points_ = true;
+        rebind_owned();
+    }
+    // Appends an owned copy of p and returns it. Rebinds existing points if the storage moved.
+    const float_type *store(const float_type *p) {
+        const float_type *old = points_.data();
+        points_.resize(points_.size() + stride_);
+        float_type *dst = &points_[points_.size() - stride_];
+        std::copy(p, p + d_, dst);
+        if(keep_norms_) sqnorms_.push_back(metric::sqrnorm(dst, stride_));
+        if(points_.data() != old) rebind_owned();
+        return dst;
+    }
+public:
     template<typename I>
     void insert(I i1, I i2) {
         while(i1 != i2)
             add(*i1++);
     }
     template<typename T>
-    void add(T &val) {
-        auto vn = norm(val);
-        CONST_IF(is_cos) {
-            if(std::abs(vn - 1.) > 1e-6)
-                val /= vn;
-        }
-        add(static_cast<std::add_const_t<T> &>(val));
-    }
-    template<typename T>
     void add(const T &val) {
         if(&val[1] - &val[0] != 1) {
             char buf[256];
@@ -333,13 +763,22 @@ public:
 #ifdef TIME_ADDITIONS
         auto t = std::chrono::high_resolution_clock::now();
 #endif
-        auto p = &val[0];
+        const float_type *p = &val[0];
+        blaze::DynamicVector<float_type> unit;
+        CONST_IF(is_cos) {
+            unit.resize(d_);
+            normalize(p, unit.data());
+            p = unit.data();
+        }
+        // Queries continue while the point is projected, and are excluded only while the maps change.
+        std::lock_guard<std::mutex> writer(sync_.writer);
         blaze::DynamicVector<float_type> tmp = reinterpret_cast<uint64_t>(p) % ALIGNMENT
             ? proj_.project(blaze::CustomVector<const float_type, blaze::unaligned, blaze::unpadded>(p, d_))
             : proj_.project(blaze::CustomVector<const float_type, blaze::aligned, blaze::unpadded>(p, d_));
-        ProjI to_insert;
+        std::unique_lock<std::shared_mutex> rw(sync_.rw);
         const auto id = n_inserted_++;
-        val_ptrs_.emplace_back(static_cast<const float_type *RESTRICT>(p));
+        val_ptrs_.emplace_back(record(p));
+        tombstones_.resize((n_inserted_ + 63) / 64);
         #pragma omp parallel for
         for(size_t i = 0; i < m_ * l_; ++i) {
             map_[i].emplace(ProjI(tmp[i], id));
@@ -349,16 +788,175 @@ public:
         clock += (t2 - t).count();
 #endif
     }
+    uint64_t key(size_t l, IdType id) const {return uint64_t(id) * l_ + l;}
+    // Projections of every row of mat: total() x mat.rows(), one row per projection direction.
+    template<typename MT>
+    blaze::DynamicMatrix<float_type> project_batch(const MT &mat) const {
+        blaze::DynamicMatrix<float_type> ret;
+        CONST_IF(has_matrix_mf<Projector>::value) {
+            ret = proj_.matrix() * trans(mat);
+        } else {
+            ret.resize(total(), mat.rows());
+            OMP_PRAGMA("omp parallel for")
+            for(size_t i = 0; i < mat.rows(); ++i) {
+                const auto p = proj_.project(blaze::CustomVector<const float_type, blaze::unaligned, blaze::unpadded>(&mat(i, 0), d_));
+                for(size_t j = 0; j < total(); ++j) ret(j, i) = p[j];
+            }
+        }
+        return ret;
+    }
+    // Bulk insertion of every row of X, which must outlive the index unless points are owned (they are referenced, not copied).
+    // Projects all rows at once, then sorts each of the m * l projections in parallel and merges it into its map.
+    // A data-dependent index which is still empty first fits its directions to X.
+    template<typename MT>
+    void build(const blaze::DenseMatrix<MT, blaze::rowMajor> &X) {
+        const auto &mat = ~X;
+        if(mat.columns() != d_) {
+            char buf[256];
+            std::sprintf(buf, "[%s]: Expected %u columns, got %zu", __PRETTY_FUNCTION__, d_, mat.columns());
+            throw std::runtime_error(buf);
+        }
+        if(mat.rows() == 0) return;
+        CONST_IF(is_cos) {
+            // record() copies the unit rows into owned storage, so this copy is only needed until then.
+            blaze::DynamicMatrix<float_type> unit(mat.rows(), d_);
+            OMP_PRAGMA("omp parallel for")
+            for(size_t i = 0; i < mat.rows(); ++i) normalize(&mat(i, 0), &unit(i, 0));
+            insert_rows(unit);
+        } else {
+            insert_rows(mat);
+        }
+    }
+private:
+    template<typename MT>
+    void insert_rows(const MT &mat) {
+        const size_t n = mat.rows();
+        std::lock_guard<std::mutex> writer(sync_.writer);
+        const size_t start = n_inserted_;
+        if(data_dependent_ && start == 0) {
+            std::unique_lock<std::shared_mutex> rw(sync_.rw);
+            fit_projections(n, [&mat](size_t i) {return &mat(i, 0);});
+        }
+        const blaze::DynamicMatrix<float_type> projections = project_batch(mat);
+        std::unique_lock<std::shared_mutex> rw(sync_.rw);
+        val_ptrs_.reserve(start + n);
+        if(owns_points_) points_.reserve((start + n) * stride_);
+        if(quantized()) codes_.reserve(start + n);
+        for(size_t i = 0; i < n; ++i) val_ptrs_.emplace_back(record(&mat(i, 0)));
+        n_inserted_ += n;
+        tombstones_.resize((n_inserted_ + 63) / 64);
+        index_projections(projections, start);
+    }
+public:
+    size_t ndeleted() const {return __atomic_load_n(&ndeleted_, __ATOMIC_RELAXED);}
+    size_t ncompacted() const {return __atomic_load_n(&ncompacted_, __ATOMIC_RELAXED);}
+    size_t live_size() const {return n_inserted_ - ndeleted();}
+    const auto &tombstones() const {return tombstones_;}
+    const SyncState &sync() const {return sync_;}
+    bool is_deleted(IdType id) const {
+        return size_t(id) / 64 < tombstones_.size() && (__atomic_load_n(&tombstones_[id / 64], __ATOMIC_RELAXED) >> (id % 64) & 1);
+    }
+    // Deletes point id: queries skip it from now on, and the next compaction purges its entries.
+    // Safe concurrently with queries, other removals and compaction. Starts a background compaction once deleted entries
+    // still in the maps exceed compaction_threshold() of all points. Returns false if id was already deleted.
+    bool remove(IdType id) {
+        bool compact_now;
+        {
+            std::shared_lock<std::shared_mutex> lock(sync_.rw);
+            if(size_t(id) >= n_inserted_) {
+                char buf[256];
+                std::sprintf(buf, "[%s]: id %zu out of range for %zu points", __PRETTY_FUNCTION__, size_t(id), n_inserted_);
+                throw std::runtime_error(buf);
+            }
+            const uint64_t bit = uint64_t(1) << (id % 64);
+            if(__atomic_fetch_or(&tombstones_[id / 64], bit, __ATOMIC_RELAXED) & bit) return false;
+            const size_t pending = __atomic_add_fetch(&ndeleted_, 1, __ATOMIC_RELAXED) - ncompacted();
+            compact_now = compaction_threshold_ > 0. && pending > compaction_threshold_ * n_inserted_;
+        }
+        if(compact_now) compact_async();
+        return true;
+    }
+    // Moves point id to x. Its entries are found near their old projections (or by a scan, if the old point was overwritten
+    // in place), erased and re-inserted at the new ones. Owned points and codes are overwritten; a borrowed point is
+    // rebound to x, which must then outlive the index.
+    template<typename T>
+    void update(IdType id, const T &val) {update(id, static_cast<const float_type *>(&val[0]));}
+    void update(IdType id, const float_type *p) {
+        std::lock_guard<std::mutex> writer(sync_.writer);
+        if(size_t(id) >= n_inserted_ || is_deleted(id)) {
+            char buf[256];
+            std::sprintf(buf, "[%s]: id %zu is out of range or deleted", __PRETTY_FUNCTION__, size_t(id));
+            throw std::runtime_error(buf);
+        }
+        blaze::DynamicVector<float_type> unit;
+        CONST_IF(is_cos) {
+            unit.resize(d_);
+            normalize(p, unit.data());
+            p = unit.data();
+        }
+        using CV = blaze::CustomVector<const float_type, blaze::unaligned, blaze::unpadded>;
+        blaze::DynamicVector<float_type> oldproj;
+        if(val_ptrs_[id]) oldproj = proj_.project(CV(val_ptrs_[id], d_));
+        const blaze::DynamicVector<float_type> newproj = proj_.project(CV(p, d_));
+        std::unique_lock<std::shared_mutex> rw(sync_.rw);
+        OMP_PRAGMA("omp parallel for")
+        for(size_t i = 0; i < total(); ++i) {
+            erase_entry(map_[i], id, oldproj.size() ? &oldproj[i]: nullptr);
+            map_[i].emplace(ProjI(newproj[i], id));
+        }
+        if(quantized()) codes_.replace(id, p);
+        if(owns_points_) {
+            float_type *dst = &points_[size_t(id) * stride_];
+            std::copy(p, p + d_, dst);
+            if(keep_norms_) sqnorms_[id] = metric::sqrnorm(dst, stride_);
+        } else if(needs_points()) {
+            val_ptrs_[id] = p;
+        }
+    }
+    double compaction_threshold() const {return compaction_threshold_;}
+    // <= 0 disables automatic compaction.
+    void set_compaction_threshold(double threshold) {compaction_threshold_ = threshold;}
+    // Rebuilds every map without deleted entries. Queries continue during the rebuild and are excluded only for the swap;
+    // writers wait until it finishes.
+    void compact() {
+        std::lock_guard<std::mutex> writer(sync_.writer);
+        const size_t ndel = ndeleted();
+        std::vector<map_type> fresh(total());
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(size_t i = 0; i < total(); ++i) {
+            std::vector<ProjI> run;
+            run.reserve(map_[i].size());
+            for(const auto &p: map_[i])
+                if(!is_deleted(p.id())) run.push_back(p);
+            append_sorted(fresh[i], run);
+        }
+        std::unique_lock<std::shared_mutex> rw(sync_.rw);
+        map_.swap(fresh);
+        __atomic_store_n(&ncompacted_, ndel, __ATOMIC_RELAXED);
+    }
+    // Runs compact() on a background thread unless one is already running. The destructor, copies and moves wait for it.
+    void compact_async() {
+        std::lock_guard<std::mutex> lock(sync_.launch);
+        if(sync_.compacting.exchange(true)) return;
+        sync_.compaction = std::async(std::launch::async, [this]() {
+            struct Reset {std::atomic<bool> &flag; ~Reset() {flag = false;}} reset{sync_.compacting};
+            compact();
+        });
+    }
+    void wait_for_compaction() const {sync_.wait();}
     bool should_stop(size_t candidateset_size, unsigned k) const {
-        // Warning: this currently
-        const double rat = double(val_ptrs_.size()) / k;
-        auto exp = 1. - std::log2(gamma_);
+        const size_t live = live_size();
+        if(k == 0 || live == 0) return true;
+        const double rat = double(live) / k;
+        // log2(gamma) plays the role of m / d' for intrinsic dimension d' (estimated by d). Unit vectors lie on a sphere,
+        // one dimension lower: m / (d - 1) shrinks the exponent, and the cosine index stops with fewer candidates.
+        auto exp = 1. - std::log2(gamma_) * (is_cos && d_ > 1 ? double(d_) / (d_ - 1): 1.);
         const size_t ktilde = k * std::max(
             std::ceil(std::log(rat)),
             gamma_ == 1. ? rat: std::pow(rat, exp)
         );
         //const size_t ktilde = std::ceil(k * std::max(std::log(rat), std::pow(rat, 1 - std::log2(gamma_))));
-        return candidateset_size >= std::min(ktilde, val_ptrs_.size());
+        return candidateset_size >= std::min(ktilde, live);
     }
     static const ProjI *next_best(const map_type &s,
             std::pair<bin_tree_iterator, bin_tree_iterator> &its, float_type v) {
@@ -389,80 +987,55 @@ public:
         }
         return nullptr;
     }
+    // Prioritized DCI (Li and Malik, 2017). At each level, a priority queue over the m simple indices always advances
+    // the one whose next point is nearest in projection; a point becomes a candidate once all m indices of the level
+    // have reached it, and each level stops after k1 candidates.
     std::vector<ProjI> prioritized_query(const float_type *ptr, unsigned k, unsigned k1) const {
-        const blaze::CustomVector<const float_type, blaze::aligned, blaze::unpadded> val(ptr, d_);
-        using ProjIM = std::pair<ProjI, IdType>; // To track 'm', as well, as that's necessary for prioritized query.
-        if(k <= val_ptrs_.size())
+        if(k == 0) return {};
+        if(k > live_size())
             return query(ptr, k);
-        if(k1 < 2) throw std::runtime_error("Expected k1 > 1");
-        std::fprintf(stderr, "k: %u. k1: %u\n", k, k1);
-        using PQT = consumable_priority_queue<ProjIM, std::vector<ProjIM>, std::greater<ProjIM>>;
-        // Get a pair of iterators
-        std::vector<std::pair<bin_tree_iterator, bin_tree_iterator>> bounds(l_ * m_);
-        std::vector<PQT> pqs(l_);
-        std::vector<set_type> candidates(l_);
-        auto projections = proj_.project(val);
-        blaze::DynamicMatrix<CMatType> countsvec(l_, size(), 0);
-
-        // Initialize queues
-        OMP_PRAGMA("omp parallel for")
-        for(unsigned i = 0; i < l_; ++i) {
-            // Parallelize over l, avoid conflicts because there are only l
-            auto &pq = pqs[i];
-            for(size_t j = 0; j < m_; ++j) {
-                auto index = ind(j, i);
-                const map_type &pos = map_[i];
-                const auto pv = projections[index];
-                bin_tree_iterator it = perform_lbound(pos, projections[index]);
-                bounds[i] = get_iterator_pair(pos, it, pv);
-                auto getv = [pv,e=pos.end()](auto x) {return x != e ? std::abs(x->first - pv): std::numeric_limits<double>::max();};
-                auto lv = getv(bounds[i].first), rv = getv(bounds[i].second);
-                if(lv < rv) {
-                    pq.push(ProjIM(ProjI(lv, bounds[i].first->second), j));
-                } else {
-                    pq.push(ProjIM(ProjI(rv, bounds[i].second->second), j));
+        if(k1 < 1) throw std::runtime_error("Expected k1 > 0");
+        std::shared_lock<std::shared_mutex> lock(sync_.rw);
+        auto &sc = scratch();
+        float_type inv;
+        ptr = unit_query(ptr, sc, inv);
+        const blaze::DynamicVector<float_type> projections =
+            proj_.project(blaze::CustomVector<const float_type, blaze::unaligned, blaze::unpadded>(ptr, d_));
+        auto &bounds = sc.bounds;
+        bounds.resize(total());
+        for(size_t i = 0; i < total(); ++i)
+            bounds[i] = get_iterator_pair(map_[i], perform_lbound(map_[i], projections[i]), projections[i]);
+        auto &counts = sc.counts;
+        counts.reset();
+        auto &candidates = sc.candidates;
+        candidates.clear();
+        using Entry = std::tuple<float_type, IdType, uint32_t>; // (projected distance, id, simple index)
+        std::vector<Entry> pq;
+        const std::greater<Entry> cmp;
+        for(size_t l = 0; l < l_; ++l) {
+            pq.clear();
+            auto advance = [&](uint32_t j) {
+                const size_t index = ind(j, l);
+                if(const ProjI *p = next_best(map_[index], bounds[index], projections[index])) {
+                    pq.emplace_back(std::abs(p->first - projections[index]), p->second, j);
+                    std::push_heap(pq.begin(), pq.end(), cmp);
                 }
-            }
-        }
-        for(uint32_t k1i = 1; k1i < k1; ++k1i) {
-            for(uint32_t l = 0; l < l_; ++l) {
-                auto &canset = candidates[l];
-                if(canset.size() >= k) continue;
-                auto C = row(countsvec, l);
-                auto &pq = pqs[l];
-
-                // Top of the pops
-                auto top = pq.top();
-                pq.pop();
-                auto j = top.second;
-                auto index = ind(j, l);
-                // Get next best
-                auto pair = next_best(map_[index], bounds[index], projections[index]);
-                if(unlikely(!pair)) throw std::runtime_error("Failure in navigating tree");
-                pq.push(ProjIM(ProjI(*pair), j));
-                if(++C[top.first.second] == m_) {
-                    canset.insert(top.first.second);
+            };
+            for(uint32_t j = 0; j < m_; ++j) advance(j);
+            for(unsigned found = 0; found < k1 && !pq.empty();) {
+                std::pop_heap(pq.begin(), pq.end(), cmp);
+                const IdType id = std::get<1>(pq.back());
+                const uint32_t j = std::get<2>(pq.back());
+                pq.pop_back();
+                if(counts.increment(key(l, id)) == m_ && !is_deleted(id)) {
+                    candidates.insert(id);
+                    ++found;
                 }
+                advance(j);
             }
         }
-        auto it = candidates.begin();
-        set_type u = std::move(*it);
-        while(++it != candidates.end()) {
-            u.insert(it->begin(), it->end());
-        }
-        //std::vector<ProjI> vs(k);
-        consumable_priority_queue<ProjI> pq;
-        for(auto it = u.begin(); it != u.end(); ++it) {
-            auto p = val_ptrs_[*it];
-            float_type tmp = blaze::norm(*p - val);
-            if(pq.size() < k)
-                pq.push(ProjI(tmp, *it));
-            else if(tmp < pq.top().first) {
-                pq.pop();
-                pq.push(ProjI(tmp, *it));
-            }
-        }
-        return pq.sorted_release();
+        sc.ids.assign(candidates.begin(), candidates.end());
+        return rerank(ptr, sc.ids.data(), sc.ids.size(), k, sc);
     }
     auto vec_at_pos(size_t ind) const {
         return blaze::CustomVector<const ArithType, blaze::aligned, blaze::unpadded>(
@@ -477,34 +1050,169 @@ public:
         return query(&x[0], k);
     }
     std::vector<ProjI> query(const float_type *x, unsigned k) const {
-        blaze::CustomVector<const float_type, blaze::aligned, blaze::unpadded> val(x, d_);
-        bool klt = k <= val_ptrs_.size();
-        std::vector<ProjI> vs(klt ? k: unsigned(val_ptrs_.size()));
-        if(!klt) {
-            k = val_ptrs_.size();
-            blaze::DynamicVector<float_type> dists(k);
-            OMP_PRAGMA("omp parallel for")
-            for(size_t i = 0; i < k; ++i)
-                dists[i] = norm(val - vec_at_pos(i));
-            consumable_priority_queue<ProjI, std::vector<ProjI>> pq;
-            for(size_t i = 0; i < dists.size(); ++i) {
-                const float_type tmp = dists[i];
-                if(pq.size() < k) {
-                    pq.push(ProjI(tmp, i));
-                } else if(pq.size() == k && pq.top().fabs() > tmp) {
-                    pq.pop();
-                    pq.push(ProjI(tmp, i));
+        std::shared_lock<std::shared_mutex> lock(sync_.rw);
+        auto &sc = scratch();
+        float_type inv;
+        const float_type *q = unit_query(x, sc, inv);
+        blaze::DynamicVector<float_type> projections = proj_.project(blaze::CustomVector<const float_type, blaze::unaligned, blaze::unpadded>(q, d_));
+        return query_projected(q, &projections[0], k, sc);
+    }
+    // Row i holds the neighbors of query i, nearest first; rows with fewer than k are padded with id -1 and infinite distance.
+    struct KNNResult {
+        blaze::DynamicMatrix<IdType> ids;
+        blaze::DynamicMatrix<float_type> distances;
+    };
+    // k-NN of every row of queries. All queries are projected at once; threads each reuse one QueryScratch.
+    template<typename MT>
+    KNNResult query_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &queries, unsigned k) const {
+        const auto &q = ~queries;
+        if(q.columns() != d_) {
+            char buf[256];
+            std::sprintf(buf, "[%s]: Expected %u columns, got %zu", __PRETTY_FUNCTION__, d_, q.columns());
+            throw std::runtime_error(buf);
+        }
+        KNNResult ret{blaze::DynamicMatrix<IdType>(q.rows(), k, IdType(-1)),
+                      blaze::DynamicMatrix<float_type>(q.rows(), k, std::numeric_limits<float_type>::infinity())};
+        if(k == 0) return ret;
+        std::shared_lock<std::shared_mutex> lock(sync_.rw);
+        const blaze::DynamicMatrix<float_type> projections = trans(project_batch(q));
+        OMP_PRAGMA("omp parallel")
+        {
+            QueryScratch sc;
+            OMP_PRAGMA("omp for schedule(dynamic, 16)")
+            for(size_t i = 0; i < q.rows(); ++i) {
+                float_type inv;
+                const float_type *x = unit_query(&q(i, 0), sc, inv), *p = &projections(i, 0);
+                CONST_IF(is_cos) {
+                    // Projections are linear, so those of the unit query are a rescaling.
+                    sc.proj.resize(total());
+                    for(size_t j = 0; j < total(); ++j) sc.proj[j] = p[j] * inv;
+                    p = sc.proj.data();
                 }
+                const auto &res = query_projected(x, p, k, sc);
+                for(size_t j = 0; j < res.size(); ++j)
+                    ret.ids(i, j) = res[j].id(), ret.distances(i, j) = res[j].f();
             }
-            return pq.sorted_release();
+        }
+        return ret;
+    }
+    // State reused across queries: tree bounds, visit counts, candidates and the result heap.
+    struct QueryScratch {
+        std::vector<std::pair<bin_tree_iterator, bin_tree_iterator>> bounds;
+        SparseCounter<CMatType> counts;
+        set_type candidates;
+        std::vector<IdType> ids;
+        std::vector<float_type, AlignedAllocator<float_type>> query;
+        std::vector<ProjI> heap;
+        std::vector<float> table;
+        std::vector<IdType> shortlist;
+        std::vector<float_type, AlignedAllocator<float_type>> unit;
+        std::vector<float_type> proj;
+    };
+    // In cosine mode, writes x / ||x||, zero-padded to stride_, to sc.unit and returns it; otherwise returns x.
+    // inv receives 1 / ||x|| (1 for a zero query), which maps projections of x to those of the unit query.
+    const float_type *unit_query(const float_type *x, QueryScratch &sc, float_type &inv) const {
+        inv = 1;
+        CONST_IF(is_cos) {
+            const float_type n = std::sqrt(metric::sqrnorm(x, d_));
+            if(n > 0) inv = 1 / n;
+            sc.unit.assign(stride_, float_type(0));
+            for(size_t i = 0; i < d_; ++i) sc.unit[i] = x[i] * inv;
+            return sc.unit.data();
+        }
+        return x;
+    }
+    static QueryScratch &scratch() {
+        static thread_local QueryScratch ret;
+        return ret;
+    }
+    static constexpr size_t PREFETCH_DISTANCE = 4;
+    static void push(std::vector<ProjI> &heap, size_t k, float_type dist, IdType id) {
+        if(heap.size() < k) {
+            heap.emplace_back(dist, id);
+            std::push_heap(heap.begin(), heap.end());
+        } else if(k && dist < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = ProjI(dist, id);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+    // The k of ids[0:n) nearest to x, into sc.heap sorted by distance. When quantized, candidates are first ranked
+    // by their codes, and only the best max(k, exact_rerank_) reach the full vectors (if kept).
+    const std::vector<ProjI> &rerank(const float_type *x, const IdType *ids, size_t n, unsigned k, QueryScratch &sc) const {
+        if(!quantized()) return rerank_exact(x, ids, n, k, sc);
+        const size_t kk = std::max<size_t>(k, exact_rerank_);
+        sc.table.resize(codes_.table_size());
+        codes_.prepare(x, sc.table.data());
+        auto &heap = sc.heap;
+        heap.clear();
+        for(size_t i = 0; i < n; ++i) {
+            if(i + PREFETCH_DISTANCE < n) codes_.prefetch(ids[i + PREFETCH_DISTANCE]);
+            push(heap, kk, codes_.distance(sc.table.data(), ids[i]), ids[i]);
+        }
+        std::sort_heap(heap.begin(), heap.end());
+        if(!exact_rerank_) {
+            // Codes hold unit vectors in cosine mode, where ||x - q||^2 = 2 (1 - x . q).
+            for(auto &h: heap) h.first = is_cos ? h.first / 2: std::sqrt(std::max(float_type(0), h.first));
+            return heap;
+        }
+        sc.shortlist.resize(heap.size());
+        for(size_t i = 0; i < heap.size(); ++i) sc.shortlist[i] = heap[i].second;
+        return rerank_exact(x, sc.shortlist.data(), sc.shortlist.size(), k, sc);
+    }
+    // Exact re-ranking. Rows are streamed through fused SIMD kernels, prefetching the rows of the candidates
+    // PREFETCH_DISTANCE ahead.
+    const std::vector<ProjI> &rerank_exact(const float_type *x, const IdType *ids, size_t n, unsigned k, QueryScratch &sc) const {
+        CONST_IF(is_cos) {
+            // Unit rows and a unit query from unit_query(), all zero-padded to stride_: one dot product per candidate.
+            auto &heap = sc.heap;
+            heap.clear();
+            for(size_t i = 0; i < n; ++i) {
+                if(i + PREFETCH_DISTANCE < n) metric::prefetch(val_ptrs_[ids[i + PREFETCH_DISTANCE]], stride_);
+                push(heap, k, 1 - metric::dot(val_ptrs_[ids[i]], x, stride_), ids[i]);
+            }
+            std::sort_heap(heap.begin(), heap.end());
+            return heap;
+        }
+        const float_type *q = x;
+        size_t len = d_;
+        float_type qn = 0;
+        if(owns_points_) {
+            // Pad the query like the stored rows, so the kernels run over whole vectors.
+            sc.query.assign(stride_, float_type(0));
+            std::copy(x, x + d_, sc.query.begin());
+            q = sc.query.data(), len = stride_;
+            if(keep_norms_) qn = metric::sqrnorm(q, len);
+        }
+        auto &heap = sc.heap;
+        heap.clear();
+        for(size_t i = 0; i < n; ++i) {
+            if(i + PREFETCH_DISTANCE < n) metric::prefetch(val_ptrs_[ids[i + PREFETCH_DISTANCE]], len);
+            const float_type *p = val_ptrs_[ids[i]];
+            const float_type dist = std::sqrt(keep_norms_ ? std::max(float_type(0), sqnorms_[ids[i]] + qn - 2 * metric::dot(p, q, len))
+                                                          : metric::sqrl2(p, q, len));
+            push(heap, k, dist, ids[i]);
+        }
+        std::sort_heap(heap.begin(), heap.end());
+        return heap;
+    }
+    // k-NN of x, given its total() projections. The result is sc.heap, sorted by distance.
+    const std::vector<ProjI> &query_projected(const float_type *x, const float_type *projections, unsigned k, QueryScratch &sc) const {
+        if(k == 0) {
+            sc.heap.clear();
+            return sc.heap;
+        }
+        if(k > live_size()) {
+            sc.ids.clear();
+            for(size_t i = 0; i < n_inserted_; ++i)
+                if(!is_deleted(i)) sc.ids.push_back(i);
+            return rerank(x, sc.ids.data(), sc.ids.size(), k, sc);
         }
 
         // First step: dot product the query with all reference positions
-        std::vector<std::pair<bin_tree_iterator, bin_tree_iterator>> bounds(l_ * m_);
-        set_type candidates;
         // Get a pair of iterators
-        blaze::DynamicVector<float_type> projections = proj_.project(val);
-        OMP_PRAGMA("omp parallel for")
+        auto &bounds = sc.bounds;
+        bounds.resize(l_ * m_);
         for(size_t i = 0; i < l_ * m_; ++i) {
             const map_type &pos = map_[i];
             static_assert(std::is_same<bin_tree_iterator, typename map_type::const_iterator>::value, "must be");
@@ -514,17 +1222,16 @@ public:
             bounds[i] = get_iterator_pair(pos, perform_lbound(pos, pv), pv);
         }
 
-
-        // TODO: consider sparse representation. I don't expect dense to be best.
-        // Allocate counts
-        blaze::DynamicMatrix<CMatType> countsvec(l_, size(), 0);
+        auto &counts = sc.counts;
+        counts.reset();
+        auto &candidates = sc.candidates;
+        candidates.clear();
 
         // Iterate through ith closest along each projection direction.
-        // TODO: parallelize
-        for(size_t i = 0; i < size(); ++i) {
+        // Maps hold deleted points until compaction, so their size, not size(), bounds the walk.
+        const size_t nentries = map_.empty() ? 0: map_[0].size();
+        for(size_t i = 0; i < nentries; ++i) {
             for(size_t l = 0; l < l_; ++l) {
-                //auto &candidates = candidatesvec[l];
-                auto C = row(countsvec, l);
                 /* 1. Get `ith` closest to q_{jl} [the `dist` above]
                  * 2.
                  */
@@ -532,31 +1239,19 @@ public:
                     auto index = ind(j, l);
                     auto pair = next_best(map_[index], bounds[index], projections[index]);
                     if(!pair) throw std::runtime_error("Failure in navigating tree");
-                    if(++C[pair->second] == m_) {
+                    const auto count = counts.increment(key(l, pair->second));
+                    if(count == m_ && !is_deleted(pair->second)) {
                         candidates.insert(pair->second);
                     }
-                    assert(C[pair->second] ||
+                    assert(count ||
                             !std::fprintf(stderr, "Note: we may have overflowed CMatType limit, as this should not be zero.")
                     ); // Ensure that we haven't overflowed
                 }
             }
             if(should_stop(candidates.size(), k)) break;
         }
-        auto &u = candidates;
-#if !NDEBUG
-        std::fprintf(stderr, "Candidates size: %zu\n", u.size());
-#endif
-        consumable_priority_queue<ProjI> pq;
-        for(auto it = u.begin(); it != u.end(); ++it) {
-            float_type tmp = blaze::norm(vec_at_pos(*it) - val);
-            if(pq.size() < k)
-                pq.push(ProjI(tmp, *it));
-            else if(tmp < pq.top().first) {
-                pq.pop();
-                pq.push(ProjI(tmp, *it));
-            }
-        }
-        return vs = pq.sorted_release();
+        sc.ids.assign(candidates.begin(), candidates.end());
+        return rerank(x, sc.ids.data(), sc.ids.size(), k, sc);
     }
     size_t size() const {return n_inserted_;}
     size_t ind(size_t m, size_t l) const {
@@ -597,11 +1292,12 @@ public:
     const auto & vps() const && {return val_ptrs_;}
     auto &vps()  & {return val_ptrs_;}
     const auto & vps() const & {return val_ptrs_;}
-#ifdef TIME_ADDITIONS
     ~DCI() {
+        sync_.wait();
+#ifdef TIME_ADDITIONS
         std::fprintf(stderr, "[%s] total time spent adding: %zu/%le/%p\n", __PRETTY_FUNCTION__, size_t(clock) / 1000, clock / 1000., (void *)this);
-    }
 #endif
+    }
     // TODO: version which stores its own spans,
     //       which maens that when the items moving the spans change, it's
     //       not a problem
@@ -32,6 +32,20 @@ void sample_fill(blaze::DynamicMatrix<FloatType, SO> &con, uint64_t seed, DistAr
 }
 
 
+// Fill rows [row_offset, row_offset + con.rows()) of the matrix sample_fill would have produced with this seed.
+// This lets tiles of a large random matrix be regenerated on demand instead of stored.
+template<typename MatrixType, template<typename> typename Distribution, typename RNG=aes::AesCtr<uint64_t>, typename... DistArgs>
+void sample_fill_rows(MatrixType &con, uint64_t seed, size_t row_offset, DistArgs &&... args) {
+    using FloatType = typename MatrixType::ElementType;
+    Distribution<FloatType> dist(std::forward<DistArgs>(args)...);
+    for(size_t i = 0; i < con.rows(); ++i) {
+        RNG gen(seed);
+        gen.seed(gen() + i + row_offset);
+        for(size_t j(0); j < con.columns(); ++j)
+            con(i, j) = dist(gen);
+    }
+}
+
 template<typename RNG=aes::AesCtr<uint64_t>>
 void random_fill(uint64_t *data, uint64_t len, uint64_t seed=0) {
     for(RNG gen(seed); len; data[--len] = gen());
@@ -46,6 +60,10 @@ void random_fill(uint64_t *data, uint64_t len, uint64_t seed=0) {
     void name##_fill(blaze::DynamicMatrix<FloatType, SO> &con, uint64_t seed, Args &&... args) { \
         sample_fill<FloatType, SO, type, RNG, Args...>(con, seed, std::forward<Args>(args)...); \
     }\
+    template<typename MatrixType, typename RNG=aes::AesCtr<uint64_t>, typename...Args> \
+    void name##_fill_rows(MatrixType &con, uint64_t seed, size_t row_offset, Args &&... args) { \
+        sample_fill_rows<MatrixType, type, RNG, Args...>(con, seed, row_offset, std::forward<Args>(args)...); \
+    }\
     struct name##_fill_struct {\
         template<typename Container, typename RNG=aes::AesCtr<uint64_t>, typename...Args>\
         void operator()(Container &con, uint64_t seed, Args &&... args) const {\
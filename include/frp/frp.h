@@ -7,6 +7,7 @@
 #include "frp/fhtgpu.h"
 #include "frp/frp.h"
 #include "frp/gpu.h"
+#include "frp/half.h"
 #include "frp/ifc.h"
 #include "frp/jl.h"
 #include "frp/kernel.h"
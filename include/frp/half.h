@@ -0,0 +1,151 @@
+#ifndef _GFRP_HALF_H__
+#define _GFRP_HALF_H__
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <type_traits>
+#if (defined(__x86_64__) || defined(__i386__))
+#  include <x86intrin.h>
+#endif
+
+namespace frp {
+
+namespace half {
+
+/*
+ * 16-bit storage formats for dense matrices.
+ * Values are stored as uint16_t and widened on the fly into float (or double) buffers,
+ * which halves memory and bandwidth relative to float storage.
+ *
+ * Float16:  IEEE-754 binary16. Uses F16C (vcvtph2ps/vcvtps2ph) when available.
+ * BFloat16: upper 16 bits of a binary32. Conversion is a shift, so no special instructions are needed.
+ */
+
+static inline float f16_to_float_scalar(uint16_t h) {
+    const uint32_t sign = uint32_t(h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1Fu, mant = h & 0x3FFu, bits;
+    if(exp == 0x1F) {
+        bits = sign | 0x7F800000u | (mant << 13); // inf/nan
+    } else if(exp) {
+        bits = sign | ((exp + (127 - 15)) << 23) | (mant << 13);
+    } else if(mant) {
+        // subnormal: renormalize
+        exp = 127 - 15 + 1;
+        while(!(mant & 0x400u)) mant <<= 1, --exp;
+        bits = sign | (exp << 23) | ((mant & 0x3FFu) << 13);
+    } else bits = sign;
+    float ret;
+    std::memcpy(&ret, &bits, sizeof(ret));
+    return ret;
+}
+
+static inline uint16_t float_to_f16_scalar(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000u;
+    const int32_t exp = int32_t((x >> 23) & 0xFFu) - 127 + 15;
+    uint32_t mant = x & 0x7FFFFFu;
+    if(((x >> 23) & 0xFFu) == 0xFFu) // inf/nan
+        return sign | 0x7C00u | (mant ? 0x200u: 0u);
+    if(exp >= 0x1F) return sign | 0x7C00u; // overflow
+    if(exp <= 0) {
+        if(exp < -10) return sign;
+        mant |= 0x800000u;
+        const unsigned shift = 14 - exp;
+        uint32_t ret = mant >> shift;
+        const uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+        ret += (rem > half) || (rem == half && (ret & 1));
+        return sign | ret;
+    }
+    uint32_t ret = sign | (uint32_t(exp) << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1FFFu;
+    ret += (rem > 0x1000u) || (rem == 0x1000u && (ret & 1)); // round to nearest even, carry may bump exponent
+    return ret;
+}
+
+static inline float bf16_to_float_scalar(uint16_t h) {
+    const uint32_t bits = uint32_t(h) << 16;
+    float ret;
+    std::memcpy(&ret, &bits, sizeof(ret));
+    return ret;
+}
+
+static inline uint16_t float_to_bf16_scalar(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    if((x & 0x7FFFFFFFu) > 0x7F800000u) return (x >> 16) | 0x40u; // keep nans quiet
+    x += 0x7FFFu + ((x >> 16) & 1); // round to nearest even
+    return x >> 16;
+}
+
+struct Float16 {
+    static const char *name() {return "f16";}
+    static void encode(const float *in, uint16_t *out, size_t n) {
+        size_t i = 0;
+#if __F16C__ && __AVX__
+        for(; i + 8 <= n; i += 8)
+            _mm_storeu_si128((__m128i *)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+        for(; i < n; ++i) out[i] = float_to_f16_scalar(in[i]);
+    }
+    static void decode(const uint16_t *in, float *out, size_t n) {
+        size_t i = 0;
+#if __F16C__ && __AVX__
+        for(; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + i))));
+#endif
+        for(; i < n; ++i) out[i] = f16_to_float_scalar(in[i]);
+    }
+};
+
+struct BFloat16 {
+    static const char *name() {return "bf16";}
+    static void encode(const float *in, uint16_t *out, size_t n) {
+        for(size_t i = 0; i < n; ++i) out[i] = float_to_bf16_scalar(in[i]);
+    }
+    static void decode(const uint16_t *in, float *out, size_t n) {
+        size_t i = 0;
+#if __AVX2__
+        for(; i + 8 <= n; i += 8) {
+            __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+            _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(v, 16)));
+        }
+#endif
+        for(; i < n; ++i) out[i] = bf16_to_float_scalar(in[i]);
+    }
+};
+
+// Widen into double by way of a small float staging buffer.
+template<typename Format, typename FT>
+static inline void decode(const uint16_t *in, FT *out, size_t n) {
+    if(std::is_same<FT, float>::value) {
+        Format::decode(in, reinterpret_cast<float *>(out), n);
+    } else {
+        float buf[256];
+        for(size_t i = 0; i < n; i += 256) {
+            const size_t nel = std::min(size_t(256), n - i);
+            Format::decode(in + i, buf, nel);
+            for(size_t j = 0; j < nel; ++j) out[i + j] = buf[j];
+        }
+    }
+}
+template<typename Format, typename FT>
+static inline void encode(const FT *in, uint16_t *out, size_t n) {
+    if(std::is_same<FT, float>::value) {
+        Format::encode(reinterpret_cast<const float *>(in), out, n);
+    } else {
+        float buf[256];
+        for(size_t i = 0; i < n; i += 256) {
+            const size_t nel = std::min(size_t(256), n - i);
+            for(size_t j = 0; j < nel; ++j) buf[j] = in[i + j];
+            Format::encode(buf, out + i, nel);
+        }
+    }
+}
+
+} // namespace half
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_HALF_H__
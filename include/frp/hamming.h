@@ -0,0 +1,219 @@
+#ifndef _GFRP_HAMMING_H__
+#define _GFRP_HAMMING_H__
+#include <queue>
+#include <immintrin.h>
+#include "frp/util.h"
+#include "flat_hash_map/flat_hash_map.hpp"
+
+namespace frp {
+
+namespace hamming {
+
+#if __AVX2__
+// Per-64-bit-lane popcount via nibble lookup (Mula et al.).
+static INLINE __m256i popcount_epi64(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+                                        _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+#endif
+
+// Hamming distance between packed codes a[0:nw) and b[0:nw).
+static INLINE uint32_t distance(const uint64_t *a, const uint64_t *b, size_t nw) {
+    uint64_t ret = 0;
+    size_t i = 0;
+#if __AVX512VPOPCNTDQ__
+    if(nw >= 8) {
+        __m512i acc = _mm512_setzero_si512();
+        for(; i + 8 <= nw; i += 8)
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i))));
+        ret = _mm512_reduce_add_epi64(acc);
+    }
+#elif __AVX2__
+    if(nw >= 4) {
+        __m256i acc = _mm256_setzero_si256();
+        for(; i + 4 <= nw; i += 4)
+            acc = _mm256_add_epi64(acc, popcount_epi64(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                                        _mm256_loadu_si256((const __m256i *)(b + i)))));
+        ret = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+    }
+#endif
+    for(; i < nw; ++i) ret += __builtin_popcountll(a[i] ^ b[i]);
+    return ret;
+}
+
+// Bits [start, start + len) of a packed code (bit i at bit i % 64 of word i / 64), len <= 64.
+static INLINE uint64_t extract_bits(const uint64_t *code, size_t start, unsigned len) {
+    const size_t w = start / 64, s = start % 64;
+    uint64_t ret = code[w] >> s;
+    if(s + len > 64) ret |= code[w + 1] << (64 - s);
+    return len == 64 ? ret: ret & ((uint64_t(1) << len) - 1);
+}
+
+/*
+ * HammingIndex: packed binary codes of nbits bits (e.g., FHTLSHasher::sketch output), stored contiguously.
+ * query/query_batch: exact k-NN by brute force with SIMD popcount, parallelized with per-thread top-k heaps.
+ * query_mih: multi-index hashing (Norouzi et al., 2012) after build_multi_index(m).
+ *     Codes are split into m substrings, each indexed in its own table. Probing every table at substring radius s
+ *     finds every code within full distance m * (s + 1) - 1 (pigeonhole), so the search grows s until k codes
+ *     within that bound are verified. Exact, and sublinear for near neighbors.
+ */
+template<typename IDType=uint32_t>
+class HammingIndex {
+public:
+    using result_type = std::pair<uint32_t, IDType>; // (distance, id)
+private:
+    using Heap = std::priority_queue<result_type>; // Max-heap: top is the current k'th nearest.
+    struct SubTable {
+        size_t start_;
+        unsigned len_;
+        ska::flat_hash_map<uint64_t, uint32_t> buckets_;
+        std::vector<size_t> offsets_;
+        std::vector<IDType> ids_;
+    };
+    size_t nbits_, nwords_, n_;
+    std::vector<uint64_t> codes_;
+    std::vector<SubTable> subtables_;
+
+    static void push(Heap &heap, unsigned k, uint32_t d, IDType id) {
+        if(heap.size() < k) heap.emplace(d, id);
+        else if(k && d < heap.top().first) heap.pop(), heap.emplace(d, id);
+    }
+    static std::vector<result_type> to_sorted(Heap &heap) {
+        std::vector<result_type> ret(heap.size());
+        for(size_t i = ret.size(); i--; heap.pop()) ret[i] = heap.top();
+        return ret;
+    }
+    void scan(const uint64_t *q, size_t begin, size_t end, unsigned k, Heap &heap) const {
+        for(size_t i = begin; i < end; ++i)
+            push(heap, k, distance(q, code(i), nwords_), IDType(i));
+    }
+public:
+    HammingIndex(size_t nbits): nbits_(nbits), nwords_((nbits + 63) / 64), n_(0) {}
+    size_t size() const {return n_;}
+    size_t nbits() const {return nbits_;}
+    size_t nwords() const {return nwords_;}
+    const uint64_t *code(size_t id) const {return &codes_[id * nwords_];}
+    const std::vector<uint64_t> &codes() const {return codes_;}
+
+    IDType add(const uint64_t *code) {return add_batch(code, 1);}
+    // Appends n codes laid out contiguously; returns the id of the first. Invalidates the multi-index.
+    IDType add_batch(const uint64_t *codes, size_t n) {
+        const IDType start = n_;
+        codes_.insert(codes_.end(), codes, codes + n * nwords_);
+        n_ += n;
+        subtables_.clear();
+        return start;
+    }
+    // Exact brute-force k-NN in increasing distance, splitting the scan across threads.
+    std::vector<result_type> query(const uint64_t *q, unsigned k) const {
+        if(k == 0 || n_ == 0) return {};
+        Heap heap;
+        static constexpr size_t CHUNK = 16384;
+        OMP_PRAGMA("omp parallel if(n_ > 4 * CHUNK)")
+        {
+            Heap local;
+            OMP_PRAGMA("omp for schedule(dynamic) nowait")
+            for(size_t start = 0; start < n_; start += CHUNK)
+                scan(q, start, std::min(start + CHUNK, n_), k, local);
+            OMP_PRAGMA("omp critical")
+            for(; local.size(); local.pop()) push(heap, k, local.top().first, local.top().second);
+        }
+        return to_sorted(heap);
+    }
+    // Brute-force k-NN for nq contiguous queries, one query per thread at a time.
+    std::vector<std::vector<result_type>> query_batch(const uint64_t *qs, size_t nq, unsigned k) const {
+        std::vector<std::vector<result_type>> ret(nq);
+        if(k == 0 || n_ == 0) return ret;
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(size_t i = 0; i < nq; ++i) {
+            Heap heap;
+            scan(qs + i * nwords_, 0, n_, k, heap);
+            ret[i] = to_sorted(heap);
+        }
+        return ret;
+    }
+
+    unsigned nsubstrings() const {return subtables_.size();}
+    // Indexes m substrings of (nearly) equal length, each at most 64 bits.
+    void build_multi_index(unsigned m) {
+        if(m == 0 || (nbits_ + m - 1) / m > 64 || m > nbits_) {
+            char buf[256];
+            std::sprintf(buf, "Cannot split %zu-bit codes into %u substrings of at most 64 bits", nbits_, m);
+            throw std::runtime_error(buf);
+        }
+        subtables_.assign(m, SubTable());
+        for(unsigned j = 0; j < m; ++j) {
+            subtables_[j].start_ = nbits_ * j / m;
+            subtables_[j].len_ = nbits_ * (j + 1) / m - subtables_[j].start_;
+        }
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(unsigned j = 0; j < m; ++j) {
+            auto &t = subtables_[j];
+            std::vector<std::pair<uint64_t, IDType>> keys(n_);
+            for(size_t i = 0; i < n_; ++i) keys[i] = {extract_bits(code(i), t.start_, t.len_), IDType(i)};
+            std::sort(keys.begin(), keys.end());
+            t.ids_.resize(n_);
+            for(size_t i = 0; i < n_; ++i) {
+                if(i == 0 || keys[i].first != keys[i - 1].first) {
+                    t.buckets_.emplace(keys[i].first, uint32_t(t.offsets_.size()));
+                    t.offsets_.push_back(i);
+                }
+                t.ids_[i] = keys[i].second;
+            }
+            t.offsets_.push_back(n_);
+        }
+    }
+    // Exact k-NN through the multi-index. Falls back to brute force after max_probes bucket lookups.
+    std::vector<result_type> query_mih(const uint64_t *q, unsigned k, size_t max_probes=size_t(1) << 20) const {
+        if(subtables_.empty()) throw std::runtime_error("build_multi_index must be called before query_mih");
+        const unsigned m = subtables_.size();
+        k = std::min<size_t>(k, n_);
+        if(k == 0) return {};
+        Heap heap;
+        ska::flat_hash_set<IDType> seen;
+        std::vector<uint64_t> qsub(m);
+        unsigned maxlen = 0;
+        for(unsigned j = 0; j < m; ++j) {
+            qsub[j] = extract_bits(q, subtables_[j].start_, subtables_[j].len_);
+            maxlen = std::max(maxlen, subtables_[j].len_);
+        }
+        size_t nprobes = 0;
+        for(unsigned s = 0; s <= maxlen; ++s) {
+            for(unsigned j = 0; j < m; ++j) {
+                const auto &t = subtables_[j];
+                if(s > t.len_) continue;
+                // Every len_-bit mask with s bits set, in increasing order (Gosper's hack).
+                const uint64_t limit = t.len_ == 64 ? 0: uint64_t(1) << t.len_;
+                for(uint64_t mask = s == 64 ? ~uint64_t(0): (uint64_t(1) << s) - 1;;) {
+                    if(++nprobes > max_probes) return query(q, k);
+                    auto it = t.buckets_.find(qsub[j] ^ mask);
+                    if(it != t.buckets_.end()) {
+                        for(size_t i = t.offsets_[it->second]; i < t.offsets_[it->second + 1]; ++i) {
+                            const IDType id = t.ids_[i];
+                            if(seen.insert(id).second) push(heap, k, distance(q, code(id), nwords_), id);
+                        }
+                    }
+                    if(mask == 0) break;
+                    const uint64_t c = mask & -mask, r = mask + c;
+                    if(r == 0 || (limit && r >= limit)) break;
+                    mask = (((r ^ mask) >> 2) / c) | r;
+                    if(limit && mask >= limit) break;
+                }
+            }
+            if(heap.size() == k && heap.top().first < uint64_t(m) * (s + 1)) break;
+        }
+        return to_sorted(heap);
+    }
+};
+
+} // namespace hamming
+
+using hamming::HammingIndex;
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_HAMMING_H__
@@ -0,0 +1,338 @@
+#ifndef _GFRP_IGAMMA_H__
+#define _GFRP_IGAMMA_H__
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+#include "frp/util.h"
+#include "boost/math/special_functions/gamma.hpp"
+#if (defined(__x86_64__) || defined(__i386__))
+#  include <x86intrin.h>
+#endif
+#if (__AVX512F__ || __AVX2__) && !defined(FRP_NO_SLEEF)
+#  include "sleef.h"
+#  define FRP_IGAMMA_SLEEF 1
+#endif
+
+namespace frp {
+
+namespace special {
+
+/*
+ * Inverse of the regularized lower incomplete gamma function, P^{-1}(a, u), for many u at once.
+ *
+ * Fast path (a >= FAST_MIN_SHAPE):
+ *   1. Wilson-Hilferty initial guess: x0 = a (1 - 1/(9a) + z sqrt(1/(9a)))^3, z = Phi^{-1}(u).
+ *   2. Newton refinement on log P (or log Q above the mode). The smaller tail is evaluated with
+ *      Temme's uniform asymptotic expansion, or the power series/continued fraction far from the mode.
+ *      Everything runs in double-precision SIMD lanes using SLEEF.
+ *   Relative error is ~5e-8 at a = 8, ~1e-12 at a = 64 and near machine precision beyond.
+ * High-precision path: boost::math::gamma_p_inv per element, parallelized with OpenMP.
+ * Shapes below FAST_MIN_SHAPE always use the high-precision path.
+ */
+
+static constexpr double FAST_MIN_SHAPE = 8.;
+static constexpr unsigned NEWTON_STEPS = 6; // Maximum; lanes stop once all steps are below 1e-14 x.
+static constexpr unsigned SERIES_TERMS = 40;
+// Temme's expansion is used for SERIES_CUTOFF * a <= x <= CF_CUTOFF * a.
+static constexpr double SERIES_CUTOFF = .4, CF_CUTOFF = 2.5;
+
+namespace detail {
+
+// Temme coefficients (DiDonato & Morris, 1986), as polynomials in z.
+static constexpr double TEMME_C0[] {
+    -0.333333333333333333333, 0.0833333333333333333333, -0.0148148148148148148148,
+    0.00115740740740740740741, 0.000352733686067019400353, -0.0001787551440329218107,
+    0.39192631785224377817e-4, -0.218544851067999216147e-5, -0.18540622107151599607e-5,
+    0.829671134095308600502e-6, -0.176659527368260793044e-6, 0.670785354340149858037e-8,
+    0.102618097842403080426e-7, -0.438203601845335318655e-8, 0.914769958223679023418e-9,
+    -0.255141939949462497669e-10, -0.583077213255042506746e-10, 0.243619480206674162437e-10,
+    -0.502766928011417558909e-11,
+};
+static constexpr double TEMME_C1[] {
+    -0.00185185185185185185185, -0.00347222222222222222222, 0.00264550264550264550265,
+    -0.000990226337448559670782, 0.000205761316872427983539, -0.40187757201646090535e-6,
+    -0.18098550334489977837e-4, 0.764916091608111008464e-5, -0.161209008945634460038e-5,
+    0.464712780280743434226e-8, 0.137863344691572095931e-6, -0.575254560351770496402e-7,
+    0.119516285997781473243e-7, -0.175432417197476476238e-10, -0.100915437106004126275e-8,
+    0.416279299184258263623e-9, -0.856390702649298063807e-10,
+};
+static constexpr double TEMME_C2[] {
+    0.00413359788359788359788, -0.00268132716049382716049, 0.000771604938271604938272,
+    0.200938786008230452675e-5, -0.000107366532263651605215, 0.529234488291201254164e-4,
+    -0.127606351886187277134e-4, 0.342357873409613807419e-7, 0.137219573090629332056e-5,
+    -0.629899213838005502291e-6, 0.142806142060642417916e-6, -0.204770984219908660149e-9,
+    -0.140925299108675210533e-7, 0.622897408492202203356e-8, -0.136704883966171134993e-8,
+};
+static constexpr double TEMME_C3[] {
+    0.000649434156378600823045, 0.000229472093621399176955, -0.000469189494395255712128,
+    0.000267720632062838852962, -0.756180167188397641073e-4, -0.239650511386729665193e-6,
+    0.110826541153473023615e-4, -0.56749528269915965675e-5, 0.142309007324358839146e-5,
+    -0.278610802915281422406e-10, -0.169584040919302772899e-6, 0.809946490538808236335e-7,
+    -0.191111684859736540607e-7,
+};
+
+// Acklam's rational approximation to the standard normal quantile (relative error < 1.2e-9).
+// Coefficients are stored lowest order first, denominators including their constant term.
+static constexpr double ACKLAM_A[] {2.506628277459239e+00, -3.066479806614716e+01, 1.383577518672690e+02, -2.759285104469687e+02, 2.209460984245205e+02, -3.969683028665376e+01};
+static constexpr double ACKLAM_B[] {1., -1.328068155288572e+01, 6.680131188771972e+01, -1.556989798598866e+02, 1.615858368580409e+02, -5.447609879822406e+01};
+static constexpr double ACKLAM_C[] {2.938163982698783e+00, 4.374664141464968e+00, -2.549732539343734e+00, -2.400758277161838e+00, -3.223964580411365e-01, -7.784894002430293e-03};
+static constexpr double ACKLAM_D[] {1., 3.754408661907416e+00, 2.445134137142996e+00, 3.224671290700398e-01, 7.784695709041462e-03};
+
+struct ScalarOps {
+    using V = double;
+    static constexpr size_t COUNT = 1;
+    static V load(const double *p) {return *p;}
+    static void store(double *p, V v) {*p = v;}
+    static V set1(double v) {return v;}
+    static V add(V a, V b) {return a + b;}
+    static V sub(V a, V b) {return a - b;}
+    static V mul(V a, V b) {return a * b;}
+    static V div(V a, V b) {return a / b;}
+    static V fma(V a, V b, V c) {return a * b + c;}
+    static V max(V a, V b) {return std::max(a, b);}
+    static V sqrt(V a) {return std::sqrt(a);}
+    static V exp(V a) {return std::exp(a);}
+    static V log(V a) {return std::log(a);}
+    static V log1p(V a) {return std::log1p(a);}
+    static V erfc(V a) {return std::erfc(a);}
+    static V neg(V a) {return -a;}
+    using M = bool;
+    static M lt(V a, V b) {return a < b;}
+    static M gt(V a, V b) {return a > b;}
+    static V blend(M m, V ifTrue, V ifFalse) {return m ? ifTrue: ifFalse;}
+    static bool any(M m) {return m;}
+};
+
+#if FRP_IGAMMA_SLEEF
+#  if __AVX512F__
+struct SIMDOps {
+    using V = __m512d;
+    using M = __mmask8;
+    static constexpr size_t COUNT = 8;
+    static V load(const double *p) {return _mm512_loadu_pd(p);}
+    static void store(double *p, V v) {_mm512_storeu_pd(p, v);}
+    static V set1(double v) {return _mm512_set1_pd(v);}
+    static V add(V a, V b) {return _mm512_add_pd(a, b);}
+    static V sub(V a, V b) {return _mm512_sub_pd(a, b);}
+    static V mul(V a, V b) {return _mm512_mul_pd(a, b);}
+    static V div(V a, V b) {return _mm512_div_pd(a, b);}
+    static V fma(V a, V b, V c) {return _mm512_fmadd_pd(a, b, c);}
+    static V max(V a, V b) {return _mm512_max_pd(a, b);}
+    static V sqrt(V a) {return _mm512_sqrt_pd(a);}
+    static V exp(V a) {return Sleef_expd8_u10(a);}
+    static V log(V a) {return Sleef_logd8_u10(a);}
+    static V log1p(V a) {return Sleef_log1pd8_u10(a);}
+    static V erfc(V a) {return Sleef_erfcd8_u15(a);}
+    static V neg(V a) {return _mm512_sub_pd(_mm512_setzero_pd(), a);}
+    static M lt(V a, V b) {return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);}
+    static M gt(V a, V b) {return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ);}
+    static V blend(M m, V ifTrue, V ifFalse) {return _mm512_mask_blend_pd(m, ifFalse, ifTrue);}
+    static bool any(M m) {return m;}
+};
+#  else
+struct SIMDOps {
+    using V = __m256d;
+    using M = __m256d;
+    static constexpr size_t COUNT = 4;
+    static V load(const double *p) {return _mm256_loadu_pd(p);}
+    static void store(double *p, V v) {_mm256_storeu_pd(p, v);}
+    static V set1(double v) {return _mm256_set1_pd(v);}
+    static V add(V a, V b) {return _mm256_add_pd(a, b);}
+    static V sub(V a, V b) {return _mm256_sub_pd(a, b);}
+    static V mul(V a, V b) {return _mm256_mul_pd(a, b);}
+    static V div(V a, V b) {return _mm256_div_pd(a, b);}
+#    if __FMA__
+    static V fma(V a, V b, V c) {return _mm256_fmadd_pd(a, b, c);}
+#    else
+    static V fma(V a, V b, V c) {return _mm256_add_pd(_mm256_mul_pd(a, b), c);}
+#    endif
+    static V max(V a, V b) {return _mm256_max_pd(a, b);}
+    static V sqrt(V a) {return _mm256_sqrt_pd(a);}
+    static V exp(V a) {return Sleef_expd4_u10(a);}
+    static V log(V a) {return Sleef_logd4_u10(a);}
+    static V log1p(V a) {return Sleef_log1pd4_u10(a);}
+    static V erfc(V a) {return Sleef_erfcd4_u15(a);}
+    static V neg(V a) {return _mm256_sub_pd(_mm256_setzero_pd(), a);}
+    static M lt(V a, V b) {return _mm256_cmp_pd(a, b, _CMP_LT_OQ);}
+    static M gt(V a, V b) {return _mm256_cmp_pd(a, b, _CMP_GT_OQ);}
+    static V blend(M m, V ifTrue, V ifFalse) {return _mm256_blendv_pd(ifFalse, ifTrue, m);}
+    static bool any(M m) {return _mm256_movemask_pd(m);}
+};
+#  endif
+#else
+using SIMDOps = ScalarOps;
+#endif
+
+template<typename Ops, size_t N>
+static inline typename Ops::V horner(const double (&c)[N], typename Ops::V x) {
+    typename Ops::V ret = Ops::set1(c[N - 1]);
+    for(size_t i = N - 1; i--;) ret = Ops::fma(ret, x, Ops::set1(c[i]));
+    return ret;
+}
+
+// Phi^{-1}(u), for u in (0, 1).
+template<typename Ops>
+static inline typename Ops::V normal_quantile(typename Ops::V u) {
+    using V = typename Ops::V;
+    constexpr double plow = 0.02425;
+    const V half = Ops::set1(0.5);
+    // Central region
+    const V q = Ops::sub(u, half), r = Ops::mul(q, q);
+    const V central = Ops::div(Ops::mul(horner<Ops>(ACKLAM_A, r), q), horner<Ops>(ACKLAM_B, r));
+    // Tails: use the smaller of u and 1 - u, then fix the sign.
+    const auto upper = Ops::gt(u, half);
+    const V p = Ops::blend(upper, Ops::sub(Ops::set1(1.), u), u);
+    const V t = Ops::sqrt(Ops::mul(Ops::set1(-2.), Ops::log(p)));
+    V tail = Ops::div(horner<Ops>(ACKLAM_C, t), horner<Ops>(ACKLAM_D, t));
+    tail = Ops::blend(upper, Ops::neg(tail), tail);
+    const auto in_tail = Ops::lt(p, Ops::set1(plow));
+    return Ops::blend(in_tail, tail, central);
+}
+
+/*
+ * Returns the smaller tail: P(a, x) when x < a, Q(a, x) otherwise.
+ * ihsqrt2pia = 1/sqrt(2 pi a)
+ */
+template<typename Ops>
+static inline typename Ops::V temme_tail(double a, double ihsqrt2pia, typename Ops::V x) {
+    using V = typename Ops::V;
+    const V va = Ops::set1(a);
+    const V sigma = Ops::div(Ops::sub(x, va), va);
+    // phi = sigma - log(1 + sigma), with a series near 0 to avoid cancellation.
+    const V direct = Ops::sub(sigma, Ops::log1p(sigma));
+    V series = Ops::set1(1. / 14);
+    for(int k = 13; k >= 2; --k) series = Ops::fma(series, Ops::neg(sigma), Ops::set1(1. / k));
+    series = Ops::mul(series, Ops::mul(sigma, sigma));
+    const V asig = Ops::max(sigma, Ops::neg(sigma));
+    const V phi = Ops::blend(Ops::lt(asig, Ops::set1(0.1)), series, direct);
+    const V y = Ops::mul(va, phi);
+    const auto below = Ops::lt(x, va);
+    V z = Ops::sqrt(Ops::mul(Ops::set1(2.), phi));
+    z = Ops::blend(below, Ops::neg(z), z);
+    const V ia = Ops::set1(1. / a);
+    V w = horner<Ops>(TEMME_C3, z);
+    w = Ops::fma(w, ia, horner<Ops>(TEMME_C2, z));
+    w = Ops::fma(w, ia, horner<Ops>(TEMME_C1, z));
+    w = Ops::fma(w, ia, horner<Ops>(TEMME_C0, z));
+    V ret = Ops::mul(w, Ops::mul(Ops::exp(Ops::neg(y)), Ops::set1(ihsqrt2pia)));
+    ret = Ops::blend(below, Ops::neg(ret), ret);
+    return Ops::fma(Ops::erfc(Ops::sqrt(y)), Ops::set1(0.5), ret);
+}
+
+// log P(a, x) by its power series; accurate for x well below a.
+template<typename Ops>
+static inline typename Ops::V log_p_series(double a, double lga, typename Ops::V x, typename Ops::V logx) {
+    using V = typename Ops::V;
+    V del = Ops::set1(1. / a), sum = del;
+    for(unsigned k = 1; k <= SERIES_TERMS; ++k) {
+        del = Ops::mul(del, Ops::mul(x, Ops::set1(1. / (a + k))));
+        sum = Ops::add(sum, del);
+    }
+    return Ops::add(Ops::sub(Ops::mul(Ops::set1(a), logx), Ops::add(x, Ops::set1(lga))), Ops::log(sum));
+}
+
+// log Q(a, x) by Legendre's continued fraction (modified Lentz); accurate for x well above a.
+template<typename Ops>
+static inline typename Ops::V log_q_cf(double a, double lga, typename Ops::V x, typename Ops::V logx) {
+    using V = typename Ops::V;
+    V b = Ops::add(x, Ops::set1(1. - a));
+    V c = Ops::set1(1e300), d = Ops::div(Ops::set1(1.), b), h = d;
+    for(unsigned i = 1; i <= SERIES_TERMS; ++i) {
+        const V an = Ops::set1(-double(i) * (i - a));
+        b = Ops::add(b, Ops::set1(2.));
+        d = Ops::div(Ops::set1(1.), Ops::fma(an, d, b));
+        c = Ops::add(b, Ops::div(an, c));
+        h = Ops::mul(h, Ops::mul(d, c));
+    }
+    return Ops::add(Ops::sub(Ops::mul(Ops::set1(a), logx), Ops::add(x, Ops::set1(lga))), Ops::log(h));
+}
+
+template<typename Ops>
+static inline typename Ops::V gamma_p_inv_lanes(double a, double lga, double ihsqrt2pia, typename Ops::V u) {
+    using V = typename Ops::V;
+    const V va = Ops::set1(a), one = Ops::set1(1.);
+    const V logu = Ops::log(u), logq = Ops::log1p(Ops::neg(u));
+    // Wilson-Hilferty
+    const double t = 1. / (9. * a);
+    const V z = normal_quantile<Ops>(u);
+    V base = Ops::fma(z, Ops::set1(std::sqrt(t)), Ops::set1(1. - t));
+    base = Ops::max(base, Ops::set1(1e-3));
+    V x = Ops::mul(va, Ops::mul(base, Ops::mul(base, base)));
+    // Deep in the lower tail, P(a, x) ~= x^a / Gamma(a + 1) is the better start.
+    const V xpow = Ops::exp(Ops::mul(Ops::add(logu, Ops::set1(std::lgamma(a + 1.))), Ops::set1(1. / a)));
+    x = Ops::blend(Ops::lt(xpow, Ops::set1(.2 * a)), xpow, x);
+    const V am1 = Ops::set1(a - 1.), vlga = Ops::set1(lga), floor = Ops::set1(1e-300);
+    const V series_cut = Ops::set1(SERIES_CUTOFF * a), cf_cut = Ops::set1(CF_CUTOFF * a);
+    for(unsigned i = 0; i < NEWTON_STEPS; ++i) {
+        const V logx = Ops::log(x);
+        const auto below = Ops::lt(x, va);
+        // Smaller tail (P below the mode, Q above) and its log.
+        const V tail = temme_tail<Ops>(a, ihsqrt2pia, x);
+        V logtail = Ops::log(tail);
+        const auto use_series = Ops::lt(x, series_cut), use_cf = Ops::gt(x, cf_cut);
+        if(Ops::any(use_series)) logtail = Ops::blend(use_series, log_p_series<Ops>(a, lga, x, logx), logtail);
+        if(Ops::any(use_cf)) logtail = Ops::blend(use_cf, log_q_cf<Ops>(a, lga, x, logx), logtail);
+        // Newton on log P (or -log Q), which stays well-conditioned in the tails:
+        // x -= (log P - log u) * P / p(x), x += (log Q - log q) * Q / p(x)
+        const V dens = Ops::exp(Ops::sub(Ops::sub(Ops::mul(am1, logx), x), vlga));
+        V resid = Ops::blend(below, Ops::sub(logtail, logu), Ops::sub(logq, logtail));
+        const V step = Ops::div(Ops::mul(resid, Ops::exp(logtail)), dens);
+        // Never step more than halfway toward 0.
+        x = Ops::max(Ops::sub(x, step), Ops::max(Ops::mul(x, Ops::set1(0.5)), floor));
+        if(!Ops::any(Ops::gt(Ops::max(step, Ops::neg(step)), Ops::mul(x, Ops::set1(1e-14))))) break;
+    }
+    return x;
+}
+
+} // namespace detail
+
+/*
+ * out[i] = P^{-1}(a, u[i]).
+ * u and out may alias.
+ */
+template<typename FT>
+void gamma_p_inv(double a, const double *u, FT *out, size_t n, bool high_prec=false) {
+    if(high_prec || a < FAST_MIN_SHAPE) {
+        OMP_PRAGMA("omp parallel for schedule(static, 256)")
+        for(size_t i = 0; i < n; ++i)
+            out[i] = boost::math::gamma_p_inv(a, u[i]);
+        return;
+    }
+    using Ops = detail::SIMDOps;
+    const double lga = std::lgamma(a), ihsqrt2pia = 1. / std::sqrt(2. * M_PI * a);
+    static constexpr size_t CHUNK = 1024;
+    const size_t nchunks = (n + CHUNK - 1) / CHUNK;
+    OMP_PRAGMA("omp parallel for")
+    for(size_t c = 0; c < nchunks; ++c) {
+        const size_t start = c * CHUNK, end = std::min(n, start + CHUNK);
+        size_t i = start;
+        alignas(64) double buf[Ops::COUNT];
+        for(; i + Ops::COUNT <= end; i += Ops::COUNT) {
+            Ops::store(buf, detail::gamma_p_inv_lanes<Ops>(a, lga, ihsqrt2pia, Ops::load(u + i)));
+            for(size_t j = 0; j < Ops::COUNT; ++j) out[i + j] = buf[j];
+        }
+        for(; i < end; ++i)
+            out[i] = detail::gamma_p_inv_lanes<detail::ScalarOps>(a, lga, ihsqrt2pia, u[i]);
+    }
+}
+
+/*
+ * Inverse CDF of the chi distribution with `dof` degrees of freedom:
+ *     F^{-1}(u) = sqrt(2 P^{-1}(dof / 2, u)).
+ * These are the row norms of a dof-dimensional standard Gaussian matrix.
+ */
+template<typename FT>
+void chi_inv(double dof, const double *u, FT *out, size_t n, bool high_prec=false) {
+    gamma_p_inv(dof * .5, u, out, n, high_prec);
+    OMP_PRAGMA("omp parallel for schedule(static, 4096)")
+    for(size_t i = 0; i < n; ++i)
+        out[i] = std::sqrt(FT(2) * out[i]);
+}
+
+} // namespace special
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_IGAMMA_H__
@@ -2,6 +2,7 @@
 #define _JL_H__
 #include <random>
 #include "frp/spinner.h"
+#include "frp/serial.h"
 
 namespace frp {
 
@@ -57,6 +58,20 @@ public:
     }
     OrthogonalJLTransform(OrthogonalJLTransform &&o) = default;
     OrthogonalJLTransform(const OrthogonalJLTransform &o) = default;
+    // Only sizes and per-block seeds are stored; the Hadamard-Rademacher blocks are regenerated.
+    explicit OrthogonalJLTransform(serial::Reader &r) {
+        r.expect(serial::OJLT, sizeof(FT));
+        from_ = r.read<uint64_t>();
+        to_ = r.read<uint64_t>();
+        seeds_ = r.read_vector<uint64_t>();
+        for(const auto seed: seeds_) blocks_.emplace_back(from_, seed);
+    }
+    void write(serial::Writer &w) const {
+        w.write_header(serial::OJLT, sizeof(FT));
+        w.write<uint64_t>(from_);
+        w.write<uint64_t>(to_);
+        w.write_array(seeds_);
+    }
     void resize(size_type newfrom, size_type newto) {
         //std::fprintf(stderr, "Resizing from %zu to %zu (rounded up %zu)\n", from_, roundup(newfrom), newfrom);
         newfrom = roundup(newfrom);
@@ -1,17 +1,19 @@
 #ifndef _GFRP_KERNEL_H__
 #define _GFRP_KERNEL_H__
 #include "frp/spinner.h"
+#include "frp/half.h"
+#include "frp/serial.h"
 
 namespace frp {
 
 struct ApplyMatmul {
-    template<typename FT, bool SO, typename OType, typename VT>
-    static void apply(OType &out, const blaze::DynamicMatrix<FT, SO> &mat, const blaze::DenseVector<VT,SO> &inp) {
-        out = mat * ~inp;
+    template<typename MT, bool SO, typename OType, typename VT>
+    static void apply(OType &out, const blaze::DenseMatrix<MT, SO> &mat, const blaze::DenseVector<VT,SO> &inp) {
+        out = ~mat * ~inp;
     }
-    template<typename FT, bool SO, typename OType, typename VT>
-    static void apply(OType &out, const blaze::DynamicMatrix<FT, SO> &mat, const blaze::DenseVector<VT,!SO> &inp) {
-        out = trans(mat * trans(~inp));
+    template<typename MT, bool SO, typename OType, typename VT>
+    static void apply(OType &out, const blaze::DenseMatrix<MT, SO> &mat, const blaze::DenseVector<VT,!SO> &inp) {
+        out = trans(~mat * trans(~inp));
     }
 };
 
@@ -20,22 +22,35 @@ namespace kernel {
 template<typename T, bool val> struct ResizeOrErrorImpl;
 template<typename T> struct ResizeOrError: public ResizeOrErrorImpl<T, blaze::IsView<std::decay_t<T>>::value> {};
 template<typename T> struct ResizeOrErrorImpl<T,true> {
-    template<typename=typename std::enable_if<blaze::IsView<std::decay_t<T>>::value>::type>
-    static void apply(const T &, size_t) {
+    template<typename...Args, typename=typename std::enable_if<blaze::IsView<std::decay_t<T>>::value>::type>
+    static void apply(const T &, Args &&...) {
         throw std::runtime_error("Can't resize a view");
     }
 };
 template<typename T> struct ResizeOrErrorImpl<T,false> {
     template<typename...Args, typename=typename std::enable_if<!blaze::IsView<std::decay_t<T>>::value>::type>
-    static void apply(const T &x, Args &&...sizes) {
+    static void apply(T &x, Args &&...sizes) {
         x.resize(std::forward<Args>(sizes)...);
     }
 };
 
+template<typename Block, typename OutputMatrix, typename InputMatrix, typename=void>
+struct has_apply_batch: std::false_type {};
+template<typename Block, typename OutputMatrix, typename InputMatrix>
+struct has_apply_batch<Block, OutputMatrix, InputMatrix,
+                       std::void_t<decltype(std::declval<const Block &>().apply_batch(std::declval<OutputMatrix &>(), std::declval<const InputMatrix &>()))>>: std::true_type {};
+
+// Finalizers declare expansion, the number of output slots per projection Kernel reserves for them.
+template<typename Finalizer, typename=void>
+struct finalizer_expansion: std::integral_constant<size_t, 2> {};
+template<typename Finalizer>
+struct finalizer_expansion<Finalizer, std::void_t<decltype(Finalizer::expansion)>>: std::integral_constant<size_t, Finalizer::expansion> {};
+
 struct GaussianFinalizer {
 private:
     uint32_t use_lowprec_:1;
 public:
+    static constexpr size_t expansion = 2;
     GaussianFinalizer(bool use_low_precision=false): use_lowprec_(use_low_precision) {}
     void set_use_lowprec(bool use_lowprec) {use_lowprec_ = use_lowprec;}
 
@@ -116,6 +131,7 @@ private:
     uint64_t seed_;
     uint32_t use_lowprec_:1;
 public:
+    static constexpr size_t expansion = 2;
     BoringFinalizer(size_t seed=0, bool use_low_precision=false): seed_(seed), use_lowprec_(use_low_precision) {}
     void set_use_lowprec(bool use_lowprec) {use_lowprec_ = use_lowprec;}
 
@@ -135,6 +151,80 @@ public:
     }
 };
 
+namespace detail {
+// relu/heaviside on whichever vector width vec::SIMDTypes selects.
+#if _FEATURE_AVX512F || __AVX512F__
+INLINE __m512  relu(__m512 v)  {return _mm512_max_ps(v, _mm512_setzero_ps());}
+INLINE __m512d relu(__m512d v) {return _mm512_max_pd(v, _mm512_setzero_pd());}
+INLINE __m512  heaviside(__m512 v)  {return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(v, _mm512_setzero_ps(), _CMP_GT_OQ), _mm512_set1_ps(1.f));}
+INLINE __m512d heaviside(__m512d v) {return _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(v, _mm512_setzero_pd(), _CMP_GT_OQ), _mm512_set1_pd(1.));}
+#endif
+#if __AVX__
+INLINE __m256  relu(__m256 v)  {return _mm256_max_ps(v, _mm256_setzero_ps());}
+INLINE __m256d relu(__m256d v) {return _mm256_max_pd(v, _mm256_setzero_pd());}
+INLINE __m256  heaviside(__m256 v)  {return _mm256_and_ps(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_set1_ps(1.f));}
+INLINE __m256d heaviside(__m256d v) {return _mm256_and_pd(_mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_GT_OQ), _mm256_set1_pd(1.));}
+#endif
+#if __SSE2__
+INLINE __m128  relu(__m128 v)  {return _mm_max_ps(v, _mm_setzero_ps());}
+INLINE __m128d relu(__m128d v) {return _mm_max_pd(v, _mm_setzero_pd());}
+INLINE __m128  heaviside(__m128 v)  {return _mm_and_ps(_mm_cmpgt_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f));}
+INLINE __m128d heaviside(__m128d v) {return _mm_and_pd(_mm_cmpgt_pd(v, _mm_setzero_pd()), _mm_set1_pd(1.));}
+#endif
+
+template<unsigned Order, typename FloatType>
+INLINE FloatType arccos_scalar(FloatType v) {
+    if(v <= FloatType(0)) return FloatType(0);
+    FloatType ret(1);
+    for(unsigned i = 0; i < Order; ++i) ret *= v;
+    return ret;
+}
+
+// In place: x -> Theta(x) * x^Order
+template<unsigned Order, typename FloatType>
+void arccos_finalize(FloatType *p, size_t n) {
+    using Space = vec::SIMDTypes<FloatType>;
+    using VT = typename Space::Type;
+    static constexpr size_t nper = sizeof(VT) / sizeof(FloatType);
+    size_t i = 0;
+    for(; i + nper <= n; i += nper) {
+        VT v = Space::loadu(p + i);
+        CONST_IF(Order == 0) {
+            v = heaviside(v);
+        } else {
+            v = relu(v);
+            const VT r = v;
+            for(unsigned k = 1; k < Order; ++k) v = Space::mul(v, r);
+        }
+        Space::storeu(p + i, v);
+    }
+    for(; i < n; ++i) p[i] = arccos_scalar<Order>(p[i]);
+}
+} // namespace detail
+
+/*
+ * Arc-cosine kernel of order n (Cho & Saul, 2009):
+ *     k_n(x, y) = 2 E_w[Theta(w.x) Theta(w.y) (w.x)^n (w.y)^n], w ~ N(0, I).
+ * Pair with an unscaled (sigma = 1) Gaussian-like block (sorf/ff/rf).
+ * Kernel's sqrt(2 / D) output scaling then yields the standard estimator; outputs are outdim() wide.
+ * Order 0 is the step (Heaviside) kernel, order 1 the ReLU kernel.
+ */
+template<unsigned Order=1>
+struct ArcCosineFinalizer {
+    static constexpr size_t expansion = 1; // In place: one feature per projection.
+    template<typename VecType>
+    void apply(VecType &in) const {
+        if(in.size() == 0) return;
+        if(static_cast<size_t>(&in[in.size() - 1] - &in[0]) == in.size() - 1) {
+            detail::arccos_finalize<Order>(&in[0], in.size());
+        } else {
+            for(auto &v: in) v = detail::arccos_scalar<Order>(v);
+        }
+    }
+};
+using StepFinalizer = ArcCosineFinalizer<0>;
+using ReLUFinalizer = ArcCosineFinalizer<1>;
+
 
 namespace ff {
 
@@ -142,6 +232,9 @@ template<typename FloatType, typename RademType=CompactRademacher>
 class KernelBlock {
 protected:
     size_t final_output_size_; // This is twice the size passed to the Hadamard transforms
+    uint64_t seed_;
+    FloatType sigma_;
+    bool renorm_;
     using RandomScalingBlock = RandomChiScalingBlock<FloatType>;
     using SizeType = uint32_t;
     using Shuffler = LutShuffler<SizeType>;
@@ -156,7 +249,7 @@ public:
     using float_type = FloatType;
     using GaussianMatrixType = UnitGaussianScalingBlock<FloatType>;
     KernelBlock(size_t size, uint64_t seed=-1, FloatType sigma=1., bool renorm=true):
-        final_output_size_(size),
+        final_output_size_(size), seed_(seed), sigma_(sigma), renorm_(renorm),
         tx_(
             std::make_tuple(FastFoodGaussianProductBlock<FloatType>(sigma),
                    RandomScalingBlock(seed + seed * seed - size * size, size),
@@ -175,6 +268,22 @@ public:
         auto &gmref(std::get<GaussianMatrixType>(tx_.get_tuple()));
         rsbref.rescale(float_type(size)/std::sqrt(gmref.vec_norm()));
     }
+    // Rebuilt from its seed; only parameters are stored.
+    explicit KernelBlock(serial::Reader &r): KernelBlock(read_params(r)) {}
+    void write(serial::Writer &w) const {
+        w.write_header(serial::FF_BLOCK, sizeof(FloatType));
+        w.write<uint64_t>(final_output_size_); w.write<uint64_t>(seed_); w.write<FloatType>(sigma_); w.write<uint8_t>(renorm_);
+    }
+private:
+    struct Params {size_t size; uint64_t seed; FloatType sigma; bool renorm;};
+    static Params read_params(serial::Reader &r) {
+        Params p;
+        r.expect(serial::FF_BLOCK, sizeof(FloatType));
+        p.size = r.read<uint64_t>(); p.seed = r.read<uint64_t>(); p.sigma = r.read<FloatType>(); p.renorm = r.read<uint8_t>();
+        return p;
+    }
+    KernelBlock(const Params &p): KernelBlock(p.size, p.seed, p.sigma, p.renorm) {}
+public:
     size_t transform_size() const {return final_output_size_;}
 #if 0
     auto       &rsbref()       {return std::get<RandomScalingBlock>(tx_.get_tuple());}
@@ -204,6 +313,22 @@ public:
     }
 };
 
+// Structured random features for the exponential kernel exp(-||x - y||_2 / sigma).
+// FastFood rows are rescaled by 1/|z|, giving multivariate Cauchy rows. Use with GaussianFinalizer.
+template<typename FloatType, typename RademType=CompactRademacher>
+class LaplacianKernelBlock: public KernelBlock<FloatType, RademType> {
+    RandomCauchyScalingBlock<FloatType> rcsb_;
+public:
+    LaplacianKernelBlock(size_t size, uint64_t seed=-1, FloatType sigma=1., bool renorm=true):
+        KernelBlock<FloatType, RademType>(size, seed, sigma, renorm), rcsb_(seed * seed + seed - 1, size) {}
+    template<typename InputType, typename OutputType>
+    void apply(OutputType &out, const InputType &in) const {
+        KernelBlock<FloatType, RademType>::apply(out, in);
+        auto half_vector(subvector(out, 0, this->transform_size()));
+        rcsb_.apply(half_vector);
+    }
+};
+
 } // namespace ff
 
 namespace sorf {
@@ -212,13 +337,15 @@ template<typename FloatType, typename RademType=PRNRademacher>
 class KernelBlock {
 protected:
     const size_t final_output_size_;
+    const uint64_t seed_;
+    const FloatType sigma_;
     SORFProductBlock<FloatType>                        sorf_;
     std::vector<std::pair<HadamardBlock, RademType>> blocks_;
 public:
     using float_type = FloatType;
     KernelBlock(size_t size, uint64_t seed=-1,
                 FloatType sigma=1., size_t nblocks=3):
-                    final_output_size_(size), sorf_(sigma) {
+                    final_output_size_(size), seed_(seed), sigma_(sigma), sorf_(sigma) {
         if(nblocks == 0) {
             const char *s = "Need more than 0 blocks for sorf::KernelBlock. (Recommended: 3.)\n";
             ::std::cerr << s; throw std::runtime_error(s);
@@ -227,6 +354,22 @@ public:
             blocks_.emplace_back(std::make_pair(HadamardBlock(),
                                  RademType(size, seed++)));
     }
+    // Rebuilt from its seed; only parameters are stored.
+    explicit KernelBlock(serial::Reader &r): KernelBlock(read_params(r)) {}
+    void write(serial::Writer &w) const {
+        w.write_header(serial::SORF_BLOCK, sizeof(FloatType));
+        w.write<uint64_t>(final_output_size_); w.write<uint64_t>(seed_); w.write<FloatType>(sigma_); w.write<uint64_t>(blocks_.size());
+    }
+private:
+    struct Params {size_t size; uint64_t seed; FloatType sigma; size_t nblocks;};
+    static Params read_params(serial::Reader &r) {
+        Params p;
+        r.expect(serial::SORF_BLOCK, sizeof(FloatType));
+        p.size = r.read<uint64_t>(); p.seed = r.read<uint64_t>(); p.sigma = r.read<FloatType>(); p.nblocks = r.read<uint64_t>();
+        return p;
+    }
+    KernelBlock(const Params &p): KernelBlock(p.size, p.seed, p.sigma, p.nblocks) {}
+public:
     size_t transform_size() const {return final_output_size_;}
     template<typename InputType, typename OutputType>
     void apply(OutputType &out, const InputType &in) const {
@@ -261,6 +404,43 @@ public:
     }
 };
 
+// SORF rows rescaled by 1/|z| (multivariate Cauchy), approximating exp(-||x - y||_2 / sigma).
+// Use with GaussianFinalizer.
+template<typename FloatType, typename RademType=PRNRademacher>
+class LaplacianKernelBlock: public KernelBlock<FloatType, RademType> {
+    RandomCauchyScalingBlock<FloatType> rcsb_;
+public:
+    LaplacianKernelBlock(size_t size, uint64_t seed=-1,
+                         FloatType sigma=1., size_t nblocks=3): KernelBlock<FloatType, RademType>(size, seed, sigma, nblocks), rcsb_(seed * seed + seed - 1, size)
+    {
+    }
+    template<typename InputType, typename OutputType>
+    void apply(OutputType &out, const InputType &in) const {
+        KernelBlock<FloatType, RademType>::apply(out, in);
+        rcsb_.apply(out);
+    }
+};
+
+// SORF with chi-distributed row norms drawn from a scrambled low-discrepancy sequence.
+// The orthogonal rows all have norm sqrt(size) / sigma; rescaling them by chi_size / sqrt(size)
+// restores the row-norm distribution of a Gaussian matrix while keeping the QMC variance reduction.
+template<typename FloatType, typename RademType=PRNRademacher>
+class QMCKernelBlock: public KernelBlock<FloatType, RademType> {
+    QMCChiScalingBlock<FloatType> qsb_;
+public:
+    QMCKernelBlock(size_t size, uint64_t seed=-1, FloatType sigma=1., size_t nblocks=3,
+                   qmc::SequenceType type=qmc::SOBOL, bool high_prec=false):
+        KernelBlock<FloatType, RademType>(size, seed, sigma, nblocks), qsb_(seed * seed + seed - 1, size, type, 0., high_prec)
+    {
+        qsb_.rescale(FloatType(1) / std::sqrt(FloatType(size)));
+    }
+    template<typename InputType, typename OutputType>
+    void apply(OutputType &out, const InputType &in) const {
+        KernelBlock<FloatType, RademType>::apply(out, in);
+        qsb_.apply(out);
+    }
+};
+
 } // namespace sorf
 
 namespace orf {
@@ -286,13 +466,22 @@ template<typename FloatType, typename RademType=CompactRademacher>
 class KernelBlock {
 protected:
     const size_t         final_output_size_;
-    blaze::DynamicMatrix<FloatType> matrix_;
+    serial::MatrixStore<FloatType> matrix_;
 public:
     using float_type = FloatType;
     KernelBlock(size_t size, uint64_t seed=-1,
                 FloatType sigma=1.):
         final_output_size_(size), matrix_(detail::make_q(size, sigma, seed)) {}
+    // Loads the materialized matrix, mapped in place.
+    explicit KernelBlock(serial::Reader &r):
+        final_output_size_(r.expect(serial::ORF_BLOCK, sizeof(FloatType)).template read<uint64_t>()), matrix_(r) {}
+    void write(serial::Writer &w) const {
+        w.write_header(serial::ORF_BLOCK, sizeof(FloatType));
+        w.write<uint64_t>(final_output_size_);
+        matrix_.write(w);
+    }
     size_t transform_size() const {return final_output_size_;}
+    auto matrix() const {return matrix_.view();}
     template<typename InputType, typename OutputType>
     void apply(OutputType &out, const InputType &in) const {
         if(out.size() != final_output_size_) {
@@ -302,7 +491,7 @@ public:
             throw std::runtime_error(buf);
         }
         // std::fprintf(stderr, "Applying orf::KernelBlock\n");
-        ApplyMatmul::apply(out, matrix_, in);
+        ApplyMatmul::apply(out, matrix_.view(), in);
     }
 };
 
@@ -311,27 +500,48 @@ public:
 
 namespace rf {
 
+template<typename FloatType>
+static size_t tile_rows(size_t ncol) {
+    // Keep a decompressed/regenerated tile within ~256 KiB so it stays in L2 for the GEMV/GEMM which consumes it.
+    return std::max(size_t(1), std::min(ncol, (size_t(1) << 18) / (ncol * sizeof(FloatType))));
+}
+
 template<typename FloatType, typename RademType=CompactRademacher>
 class KernelBlock {
 protected:
     const size_t         final_output_size_;
-    blaze::DynamicMatrix<FloatType> matrix_;
+    serial::MatrixStore<FloatType> matrix_;
 public:
     using float_type = FloatType;
     KernelBlock(size_t size, uint64_t seed=-1,
                 FloatType sigma=1.):
         final_output_size_(size), matrix_(size, size) {
+        auto &mat = matrix_.owned();
 #if 0
-        for(size_t i(0); i < matrix_.rows(); ++i) {
-            auto mrow(row(matrix_, i));
+        for(size_t i(0); i < mat.rows(); ++i) {
+            auto mrow(row(mat, i));
             unit_gaussian_fill(mrow, seed++);
         }
 #else
-        unit_gaussian_fill(matrix_, seed);
+        unit_gaussian_fill(mat, seed);
 #endif
-        matrix_ *= 1./sigma;
+        mat *= 1./sigma;
+    }
+    // Loads the materialized matrix, mapped in place.
+    explicit KernelBlock(serial::Reader &r):
+        final_output_size_(r.expect(serial::RF_BLOCK, sizeof(FloatType)).template read<uint64_t>()), matrix_(r) {}
+    void write(serial::Writer &w) const {
+        w.write_header(serial::RF_BLOCK, sizeof(FloatType));
+        w.write<uint64_t>(final_output_size_);
+        matrix_.write(w);
     }
     size_t transform_size() const {return final_output_size_;}
+    auto matrix() const {return matrix_.view();}
+protected:
+    struct uninitialized_t {};
+    // For derived blocks which fill matrix_ from another distribution.
+    KernelBlock(size_t size, uninitialized_t): final_output_size_(size), matrix_(size, size) {}
+public:
     template<typename InputType, typename OutputType>
     void apply(OutputType &out, const InputType &in) const {
         if(out.size() != final_output_size_) {
@@ -341,12 +551,227 @@ public:
             throw std::runtime_error(buf);
         }
         // std::fprintf(stderr, "Applying rf::KernelBlock\n");
-        ApplyMatmul::apply(out, matrix_, in);
+        ApplyMatmul::apply(out, matrix_.view(), in);
+    }
+    // Each row of `in` is an input point; each row of `out` receives its projection.
+    // A single GEMM replaces in.rows() GEMVs, so the matrix is streamed through cache once per batch.
+    template<typename InputMatrix, typename OutputMatrix>
+    void apply_batch(OutputMatrix &out, const InputMatrix &in) const {
+        if(out.columns() != final_output_size_ || out.rows() != in.rows()) {
+            char buf[512];
+            std::sprintf(buf, "[%s:%d:%s] Output shape was wrong (%zu/%zu, not %zu/%zu).\n", __FILE__, __LINE__, __PRETTY_FUNCTION__, out.rows(), out.columns(), in.rows(), final_output_size_);
+            ::std::cerr << buf;
+            throw std::runtime_error(buf);
+        }
+        out = in * trans(matrix_.view());
+    }
+};
+
+// Dense i.i.d. Cauchy(0, 1/sigma) entries: the spectral density of the L1 Laplacian kernel exp(-||x - y||_1 / sigma).
+// Use with GaussianFinalizer.
+template<typename FloatType, typename RademType=CompactRademacher>
+class LaplacianKernelBlock: public KernelBlock<FloatType, RademType> {
+    using super = KernelBlock<FloatType, RademType>;
+public:
+    LaplacianKernelBlock(size_t size, uint64_t seed=-1,
+                         FloatType sigma=1.): super(size, typename super::uninitialized_t()) {
+        auto &mat = this->matrix_.owned();
+        cauchy_fill(mat, seed);
+        mat *= 1./sigma;
     }
 };
 
+/*
+ * TiledKernelBlock provides apply/apply_batch for random feature blocks which never hold
+ * the full-precision matrix. Derived classes provide fill_tile(tile, first_row), which
+ * writes rows [first_row, first_row + tile.rows()) of the (sigma-scaled) Gaussian matrix.
+ * Tiles are generated independently, so application is parallelized over tiles.
+ */
+template<typename Derived, typename FloatType>
+class TiledKernelBlock {
+protected:
+    const size_t final_output_size_;
+    const Derived &derived() const {return *static_cast<const Derived *>(this);}
+public:
+    using float_type = FloatType;
+    TiledKernelBlock(size_t size): final_output_size_(size) {}
+    size_t transform_size() const {return final_output_size_;}
+    size_t ntiles() const {
+        const size_t tr = tile_rows<FloatType>(final_output_size_);
+        return (final_output_size_ + tr - 1) / tr;
+    }
+    template<typename InputType, typename OutputType>
+    void apply(OutputType &out, const InputType &in) const {
+        if(out.size() != final_output_size_) {
+            char buf[512];
+            std::sprintf(buf, "[%s:%d:%s] Warning: Output size was wrong (%zu, not %zu). Resizing\n", __FILE__, __LINE__, __PRETTY_FUNCTION__, out.size(), final_output_size_);
+            ::std::cerr << buf;
+            throw std::runtime_error(buf);
+        }
+        const size_t tr = tile_rows<FloatType>(final_output_size_), nt = ntiles();
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(size_t t = 0; t < nt; ++t) {
+            thread_local blaze::DynamicMatrix<FloatType> tile;
+            const size_t r0 = t * tr, nr = std::min(tr, final_output_size_ - r0);
+            tile.resize(nr, final_output_size_, false);
+            derived().fill_tile(tile, r0);
+            auto osub(subvector(out, r0, nr));
+            ApplyMatmul::apply(osub, tile, in);
+        }
+    }
+    template<typename InputMatrix, typename OutputMatrix>
+    void apply_batch(OutputMatrix &out, const InputMatrix &in) const {
+        if(out.columns() != final_output_size_ || out.rows() != in.rows()) {
+            char buf[512];
+            std::sprintf(buf, "[%s:%d:%s] Output shape was wrong (%zu/%zu, not %zu/%zu).\n", __FILE__, __LINE__, __PRETTY_FUNCTION__, out.rows(), out.columns(), in.rows(), final_output_size_);
+            ::std::cerr << buf;
+            throw std::runtime_error(buf);
+        }
+        // GEMM is already multithreaded by BLAS; tiles are processed in order.
+        const size_t tr = tile_rows<FloatType>(final_output_size_), nt = ntiles();
+        blaze::DynamicMatrix<FloatType> tile;
+        for(size_t t = 0; t < nt; ++t) {
+            const size_t r0 = t * tr, nr = std::min(tr, final_output_size_ - r0);
+            tile.resize(nr, final_output_size_, false);
+            derived().fill_tile(tile, r0);
+            submatrix(out, 0, r0, out.rows(), nr) = in * trans(tile);
+        }
+    }
+};
+
+// Stores the Gaussian matrix in 16-bit floats (half::Float16 or half::BFloat16),
+// widening tiles on the fly. Half the memory and bandwidth of float storage, a quarter of double.
+template<typename FloatType, typename StorageFormat=half::Float16, typename RademType=CompactRademacher>
+class ReducedPrecisionKernelBlock: public TiledKernelBlock<ReducedPrecisionKernelBlock<FloatType, StorageFormat, RademType>, FloatType> {
+    using super = TiledKernelBlock<ReducedPrecisionKernelBlock<FloatType, StorageFormat, RademType>, FloatType>;
+    std::vector<uint16_t> data_;
+public:
+    using storage_format = StorageFormat;
+    ReducedPrecisionKernelBlock(size_t size, uint64_t seed=-1,
+                                FloatType sigma=1.):
+        super(size), data_(size * size)
+    {
+        const size_t tr = tile_rows<FloatType>(size), nt = this->ntiles();
+        OMP_PRAGMA("omp parallel for")
+        for(size_t t = 0; t < nt; ++t) {
+            const size_t r0 = t * tr, nr = std::min(tr, size - r0);
+            blaze::DynamicMatrix<FloatType> tile(nr, size);
+            unit_gaussian_fill_rows(tile, seed, r0);
+            tile *= 1./sigma;
+            for(size_t i = 0; i < nr; ++i)
+                half::encode<StorageFormat>(&tile(i, 0), &data_[(r0 + i) * size], size);
+        }
+    }
+    template<typename MatrixType>
+    void fill_tile(MatrixType &tile, size_t first_row) const {
+        const size_t n = this->final_output_size_;
+        for(size_t i = 0; i < tile.rows(); ++i)
+            half::decode<StorageFormat>(&data_[(first_row + i) * n], &tile(i, 0), n);
+    }
+    size_t nbytes() const {return data_.size() * sizeof(uint16_t);}
+};
+
+// Never materializes the matrix: tiles are regenerated from the seed for every application.
+// Rows are seeded exactly as unit_gaussian_fill seeds them, so results match rf::KernelBlock
+// with the same seed and sigma, using O(tile) memory instead of O(size^2).
+template<typename FloatType, typename RademType=CompactRademacher>
+class StreamedKernelBlock: public TiledKernelBlock<StreamedKernelBlock<FloatType, RademType>, FloatType> {
+    using super = TiledKernelBlock<StreamedKernelBlock<FloatType, RademType>, FloatType>;
+    const uint64_t seed_;
+    const FloatType sigma_;
+public:
+    StreamedKernelBlock(size_t size, uint64_t seed=-1,
+                        FloatType sigma=1.):
+        super(size), seed_(seed), sigma_(sigma) {}
+    template<typename MatrixType>
+    void fill_tile(MatrixType &tile, size_t first_row) const {
+        unit_gaussian_fill_rows(tile, seed_, first_row);
+        tile *= 1./sigma_;
+    }
+    uint64_t seed() const {return seed_;}
+    FloatType sigma() const {return sigma_;}
+};
+
 } // namespace rf
 
+namespace poly {
+
+/*
+ * TensorSketch (Pham & Pagh, 2013) for the polynomial kernel (x.y + offset)^degree.
+ * Each of `degree` CountSketches of the (offset-augmented) input is moved into the frequency
+ * domain with FFTBlock, multiplied elementwise, and transformed back, which computes their
+ * circular convolution: a sketch of the degree-fold tensor product in O(degree * (nnz + D log D)).
+ * Inner products of the outputs are unbiased estimates of the kernel. No finalizer is needed.
+ */
+template<typename FloatType>
+class TensorSketch {
+    using ComplexType = std::complex<FloatType>;
+    size_t indim_, outdim_;
+    unsigned degree_;
+    FloatType sqrt_offset_;
+    std::vector<uint32_t> buckets_; // degree_ * (indim_ + 1); the last column hashes the offset coordinate
+    std::vector<FloatType> signs_;
+    std::unique_ptr<FFTBlock<FloatType>> fwd_, bck_;
+public:
+    using float_type = FloatType;
+    TensorSketch(size_t outdim, size_t indim, uint64_t seed, unsigned degree=2, FloatType offset=0.):
+        indim_(indim), outdim_(outdim), degree_(degree), sqrt_offset_(std::sqrt(offset)),
+        buckets_(size_t(degree) * (indim + 1)), signs_(buckets_.size()),
+        fwd_(new FFTBlock<FloatType>(outdim, FFTW_FORWARD, true, FFTW_MEASURE)),
+        bck_(new FFTBlock<FloatType>(outdim, FFTW_BACKWARD, true, FFTW_MEASURE))
+    {
+        if(degree == 0) throw std::runtime_error("TensorSketch requires degree >= 1");
+        if(outdim > std::numeric_limits<uint32_t>::max()) throw std::runtime_error("TensorSketch output dimension too large");
+        aes::AesCtr<uint64_t> gen(seed);
+        for(size_t i = 0; i < buckets_.size(); ++i) {
+            const uint64_t v = gen();
+            buckets_[i] = fastrange<uint32_t>(uint32_t(v >> 32), uint32_t(outdim));
+            signs_[i] = v & 1 ? FloatType(-1): FloatType(1);
+        }
+    }
+    size_t indim() const {return indim_;}
+    size_t outdim() const {return outdim_;}
+    unsigned degree() const {return degree_;}
+    template<typename InputType, typename OutputType>
+    void apply(OutputType &out, const InputType &in) const {
+        if(in.size() != indim_) {
+            char buf[512];
+            std::sprintf(buf, "[%s:%d:%s] Input size was wrong (%zu, not %zu).\n", __FILE__, __LINE__, __PRETTY_FUNCTION__, in.size(), indim_);
+            throw std::runtime_error(buf);
+        }
+        if(out.size() != outdim_) ResizeOrError<OutputType>::apply(out, outdim_);
+        thread_local blaze::DynamicVector<ComplexType> acc, tmp;
+        acc.resize(outdim_, false);
+        tmp.resize(outdim_, false);
+        const size_t stride = indim_ + 1;
+        for(unsigned p = 0; p < degree_; ++p) {
+            auto &dst = p ? tmp: acc;
+            blaze::reset(dst);
+            const uint32_t *h = &buckets_[p * stride];
+            const FloatType *s = &signs_[p * stride];
+            for_each_nz(in, [&](auto j, auto v) {dst[h[j]] += s[j] * FloatType(v);});
+            if(sqrt_offset_) dst[h[indim_]] += s[indim_] * sqrt_offset_;
+            fwd_->execute(&dst[0], &dst[0]);
+            if(p) acc *= tmp;
+        }
+        bck_->execute(&acc[0], &acc[0]);
+        const FloatType inv = FloatType(1) / outdim_;
+        for(size_t i = 0; i < outdim_; ++i) out[i] = acc[i].real() * inv;
+    }
+    template<typename InputMatrix, typename OutputMatrix>
+    void apply_batch(OutputMatrix &out, const InputMatrix &in) const {
+        if(out.rows() != in.rows() || out.columns() != outdim_)
+            ResizeOrError<OutputMatrix>::apply(out, in.rows(), outdim_);
+        OMP_PRAGMA("omp parallel for")
+        for(size_t i = 0; i < in.rows(); ++i) {
+            auto r(row(out, i));
+            apply(r, row(in, i));
+        }
+    }
+};
+
+} // namespace poly
+
 template<typename KernelBlock,
          typename Finalizer=GaussianFinalizer>
 class Kernel {
@@ -354,6 +779,7 @@ class Kernel {
     Finalizer             finalizer_;
     const size_t              indim_;
     size_t                   outdim_;
+    static constexpr size_t EXPANSION = finalizer_expansion<Finalizer>::value;
 public:
     using FloatType = typename KernelBlock::float_type;
 #ifdef SIGMA_RESCALE
@@ -379,32 +805,57 @@ public:
             blocks_.emplace_back(input_ru, gen(), std::forward<Args>(args)...));
     }
 
+    // Each block is stored as it chooses: parameters for structured blocks, matrices for dense ones.
+    explicit Kernel(serial::Reader &r):
+        indim_(r.expect(serial::KERNEL, sizeof(FloatType)).template read<uint64_t>())
+#ifdef SIGMA_RESCALE
+        , sigma_(r.read<FloatType>())
+#endif
+    {
+        outdim_ = r.read<uint64_t>();
+        const size_t nb = r.read<uint64_t>();
+        blocks_.reserve(nb);
+        while(blocks_.size() < nb) blocks_.emplace_back(r);
+    }
+    void write(serial::Writer &w) const {
+        w.write_header(serial::KERNEL, sizeof(FloatType));
+        w.write<uint64_t>(indim_);
+#ifdef SIGMA_RESCALE
+        w.write<FloatType>(sigma_);
+#endif
+        w.write<uint64_t>(outdim_);
+        w.write<uint64_t>(blocks_.size());
+        for(const auto &block: blocks_) block.write(w);
+    }
+
     size_t nblocks() const {return blocks_.size();}
     size_t indim() const {return indim_;}
     size_t outdim() const {return outdim_;}
+    // Width of apply's output: outdim() projections, each expanded by the finalizer.
+    size_t outsize() const {return outdim_ * EXPANSION;}
 
     template<typename OutputType>
     void apply(OutputType &out, size_t nelem) const {
         size_t in_rounded(roundup(nelem));
         blaze::DynamicVector<FloatType> tmp(nelem);
         tmp = ::blaze::subvector(out, 0, nelem);
-        if(out.size() != (blocks_.size() << 1) * in_rounded) {
-            ResizeOrError<OutputType>::apply(out, (blocks_.size() << 1) * in_rounded);
+        if(out.size() != blocks_.size() * EXPANSION * in_rounded) {
+            ResizeOrError<OutputType>::apply(out, blocks_.size() * EXPANSION * in_rounded);
 #if 0
             CONST_IF(blaze::IsView<OutputType>::value) {
                 auto ks(ks::sprintf("[%s] Wanted to resize out block from %zu to %zu to match %zu input and %zu rounded up input.\n",
-                                    __PRETTY_FUNCTION__, out.size(), (blocks_.size() << 1) * in_rounded, nelem, static_cast<size_t>(roundup(nelem))));
+                                    __PRETTY_FUNCTION__, out.size(), blocks_.size() * EXPANSION * in_rounded, nelem, static_cast<size_t>(roundup(nelem))));
                 ks.write(stderr);
                 throw std::runtime_error(ks.data());
             } else {
                 std::fprintf(stderr, "Resizing out block from %zu to %zu to match %zu input and %zu rounded up input.\n",
-                             out.size(), (blocks_.size() << 1) * in_rounded, nelem, (size_t)roundup(nelem));
-                out.resize((blocks_.size() << 1) * in_rounded);
+                             out.size(), blocks_.size() * EXPANSION * in_rounded, nelem, (size_t)roundup(nelem));
+                out.resize(blocks_.size() * EXPANSION * in_rounded);
             }
 #endif
         }
         for(size_t i = 0; i < blocks_.size(); ++i) {
-            auto sv(subvector(out, (in_rounded << 1) * i, in_rounded));
+            auto sv(subvector(out, EXPANSION * in_rounded * i, in_rounded));
             blocks_[i].apply(sv, tmp);
             finalizer_.apply(sv);
         }
@@ -412,24 +863,51 @@ public:
     template<typename InputType, typename OutputType, typename=std::enable_if_t<!std::is_arithmetic<InputType>::value>>
     void apply(OutputType &out, const InputType &in) const {
         size_t in_rounded(roundup(in.size()));
-        if(out.size() != (blocks_.size() << 1) * in_rounded) {
-            ResizeOrError<OutputType>::apply(out, (blocks_.size() << 1) * in_rounded);
+        if(out.size() != blocks_.size() * EXPANSION * in_rounded) {
+            ResizeOrError<OutputType>::apply(out, blocks_.size() * EXPANSION * in_rounded);
         }
         for(size_t i = 0; i < blocks_.size(); ++i) {
-            auto sv(subvector(out, (in_rounded << 1) * i, in_rounded));
+            auto sv(subvector(out, EXPANSION * in_rounded * i, in_rounded));
             blocks_[i].apply(sv, in);
             finalizer_.apply(sv);
         }
 
 #ifdef SIGMA_RESCALE
-#define MULVAL (std::sqrt(2. / static_cast<FloatType>(out.size() >> 1)) * sigma_ / std::sqrt(std::sqrt(in.size())))
+#define MULVAL (std::sqrt(2. / static_cast<FloatType>(out.size() / EXPANSION)) * sigma_ / std::sqrt(std::sqrt(in.size())))
 #else
-#define MULVAL (std::sqrt(2. / static_cast<FloatType>(out.size() >> 1)))
+#define MULVAL (std::sqrt(2. / static_cast<FloatType>(out.size() / EXPANSION)))
 #endif
         vec::blockmul(out, MULVAL);
 #undef MULVAL
         // TODO: add this multiplication to the finalizer to avoid a second RAM pass-through.
     }
+    // Batch application: row i of `out` receives the features for row i of `in`.
+    // Blocks which provide apply_batch (rf::*) use one GEMM per block; others fall back to per-row application.
+    template<typename InputMatrix, typename OutputMatrix>
+    void apply_batch(OutputMatrix &out, const InputMatrix &in) const {
+        const size_t in_rounded(roundup(in.columns())), outcols(blocks_.size() * EXPANSION * in_rounded);
+        if(out.rows() != in.rows() || out.columns() != outcols) {
+            ResizeOrError<OutputMatrix>::apply(out, in.rows(), outcols);
+        }
+        for(size_t i = 0; i < blocks_.size(); ++i) {
+            auto sm(submatrix(out, 0, EXPANSION * in_rounded * i, in.rows(), in_rounded));
+            CONST_IF(has_apply_batch<KernelBlock, decltype(sm), InputMatrix>::value) {
+                blocks_[i].apply_batch(sm, in);
+            } else {
+                OMP_PRAGMA("omp parallel for")
+                for(size_t j = 0; j < in.rows(); ++j) {
+                    auto sv(row(sm, j));
+                    blocks_[i].apply(sv, row(in, j));
+                }
+            }
+            OMP_PRAGMA("omp parallel for")
+            for(size_t j = 0; j < in.rows(); ++j) {
+                auto sv(subvector(row(out, j), EXPANSION * in_rounded * i, in_rounded));
+                finalizer_.apply(sv);
+            }
+        }
+        out *= std::sqrt(2. / static_cast<FloatType>(outcols / EXPANSION));
+    }
 };
 
 
@@ -437,6 +915,18 @@ template<typename FloatType, typename RademType>
 using FastFoodKernelBlock = ff::KernelBlock<FloatType, RademType>;
 template<typename FloatType, typename RademType>
 using SORFKernelBlock = sorf::KernelBlock<FloatType, RademType>;
+template<typename FloatType, unsigned Order=1, typename RademType=PRNRademacher>
+using ArcCosineKernel = Kernel<sorf::KernelBlock<FloatType, RademType>, ArcCosineFinalizer<Order>>;
+template<typename FloatType, typename RademType=PRNRademacher>
+using LaplacianKernel = Kernel<sorf::LaplacianKernelBlock<FloatType, RademType>, GaussianFinalizer>;
+template<typename FloatType>
+using PolynomialKernel = poly::TensorSketch<FloatType>;
+template<typename FloatType, typename RademType=PRNRademacher>
+using QMCSORFKernelBlock = sorf::QMCKernelBlock<FloatType, RademType>;
+template<typename FloatType, typename RademType=CompactRademacher>
+using StreamedRFKernelBlock = rf::StreamedKernelBlock<FloatType, RademType>;
+template<typename FloatType, typename StorageFormat=half::Float16, typename RademType=CompactRademacher>
+using HalfRFKernelBlock = rf::ReducedPrecisionKernelBlock<FloatType, StorageFormat, RademType>;
 
 } // namespace kernel
 
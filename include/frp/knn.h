@@ -0,0 +1,159 @@
+#ifndef _GFRP_KNN_H__
+#define _GFRP_KNN_H__
+#include "frp/metric.h"
+
+namespace frp {
+
+namespace knn {
+
+enum Metric: uint8_t {
+    L2,
+    COSINE,
+    INNER_PRODUCT
+};
+
+/*
+ * ExactKNN: exact k-NN by blocked GEMM, for ground truth and for indices too small to be worth approximating.
+ * Each thread takes a tile of queries Q and walks the data in tiles X, computing Q X^T in one GEMM per tile pair;
+ * L2 distances follow as ||q||^2 + ||x||^2 - 2 q . x from cached norms. Every row of a tile is folded straight into
+ * its query's bounded top-k heap, so no full distance matrix is ever materialized.
+ * Reported distances: Euclidean for L2, 1 - cos(q, x) for COSINE and -q . x for INNER_PRODUCT, so nearer is always smaller.
+ * search() runs over a caller's matrix without copying it; an ExactKNN object owns its rows and can grow with add_batch.
+ */
+template<typename FType=float, typename IDType=uint32_t>
+class ExactKNN {
+public:
+    using result_type = std::pair<FType, IDType>; // (distance, id)
+    static constexpr size_t QUERY_TILE = 64, DATA_TILE = 1024;
+private:
+    size_t d_;
+    Metric metric_;
+    blaze::DynamicMatrix<FType> data_;
+    std::vector<FType> norms_; // Squared norms for L2, inverse norms for COSINE, empty for INNER_PRODUCT.
+
+    static void check(size_t expected, size_t got) {
+        if(expected != got) {
+            char buf[256];
+            std::sprintf(buf, "ExactKNN expected %zu columns, got %zu", expected, got);
+            throw std::runtime_error(buf);
+        }
+    }
+    static FType norm_of(const FType *x, size_t d, Metric metric) {
+        const FType sq = frp::metric::sqrnorm(x, d);
+        return metric == COSINE ? (sq > 0 ? 1 / std::sqrt(sq): FType(0)): sq;
+    }
+    template<typename MT>
+    static void fill_norms(const MT &x, size_t start, Metric metric, FType *out) {
+        if(metric == INNER_PRODUCT) return;
+        OMP_PRAGMA("omp parallel for")
+        for(size_t i = start; i < x.rows(); ++i) out[i - start] = norm_of(&x(i, 0), x.columns(), metric);
+    }
+    static void push(std::vector<result_type> &heap, unsigned k, FType dist, IDType id) {
+        if(heap.size() < k) {
+            heap.emplace_back(dist, id);
+            std::push_heap(heap.begin(), heap.end());
+        } else if(dist < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = result_type(dist, id);
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+    template<typename MT, typename QMT>
+    static std::vector<std::vector<result_type>> search(const MT &x, const FType *xnorms, const QMT &q, unsigned k, Metric metric) {
+        check(x.columns(), q.columns());
+        const size_t n = x.rows(), nq = q.rows(), d = x.columns();
+        std::vector<std::vector<result_type>> ret(nq);
+        if(n == 0 || k == 0) return ret;
+        OMP_PRAGMA("omp parallel")
+        {
+            blaze::DynamicMatrix<FType> dots;
+            std::vector<std::vector<result_type>> heaps(QUERY_TILE);
+            FType qnorms[QUERY_TILE];
+            OMP_PRAGMA("omp for schedule(dynamic)")
+            for(size_t qs = 0; qs < nq; qs += QUERY_TILE) {
+                const size_t qn = std::min(QUERY_TILE, nq - qs);
+                const auto qtile = blaze::submatrix(q, qs, 0, qn, d);
+                for(size_t i = 0; i < qn; ++i) {
+                    heaps[i].clear();
+                    qnorms[i] = metric == INNER_PRODUCT ? FType(0): norm_of(&q(qs + i, 0), d, metric);
+                }
+                for(size_t xs = 0; xs < n; xs += DATA_TILE) {
+                    const size_t xn = std::min(DATA_TILE, n - xs);
+                    // Already inside a parallel region: keep blaze from spawning threads of its own.
+                    dots = blaze::serial(qtile * blaze::trans(blaze::submatrix(x, xs, 0, xn, d)));
+                    for(size_t i = 0; i < qn; ++i) {
+                        auto &heap = heaps[i];
+                        const FType qnorm = qnorms[i];
+                        switch(metric) {
+                            case L2:
+                                for(size_t j = 0; j < xn; ++j) push(heap, k, qnorm + xnorms[xs + j] - 2 * dots(i, j), xs + j);
+                                break;
+                            case COSINE:
+                                for(size_t j = 0; j < xn; ++j) push(heap, k, 1 - dots(i, j) * qnorm * xnorms[xs + j], xs + j);
+                                break;
+                            case INNER_PRODUCT:
+                                for(size_t j = 0; j < xn; ++j) push(heap, k, -dots(i, j), xs + j);
+                                break;
+                        }
+                    }
+                }
+                for(size_t i = 0; i < qn; ++i) {
+                    auto &heap = heaps[i];
+                    std::sort_heap(heap.begin(), heap.end());
+                    if(metric == L2)
+                        for(auto &h: heap) h.first = std::sqrt(std::max(FType(0), h.first));
+                    ret[qs + i].assign(heap.begin(), heap.end());
+                }
+            }
+        }
+        return ret;
+    }
+public:
+    ExactKNN(size_t d, Metric metric=L2): d_(d), metric_(metric) {}
+    template<typename MT>
+    ExactKNN(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, Metric metric=L2): ExactKNN((~X).columns(), metric) {add_batch(X);}
+    size_t size() const {return data_.rows();}
+    size_t dim() const {return d_;}
+    Metric metric() const {return metric_;}
+    const auto &data() const {return data_;}
+    size_t memory_bytes() const {return (data_.rows() * data_.columns() + norms_.size()) * sizeof(FType);}
+    template<typename MT>
+    void add_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &X) {
+        const auto &m = ~X;
+        check(d_, m.columns());
+        const size_t start = data_.rows();
+        data_.resize(start + m.rows(), d_, true);
+        submatrix(data_, start, 0, m.rows(), d_) = m;
+        if(metric_ != INNER_PRODUCT) {
+            norms_.resize(data_.rows());
+            fill_norms(data_, start, metric_, &norms_[start]);
+        }
+    }
+    // Row i holds the neighbors of query i, nearest first.
+    template<typename MT>
+    std::vector<std::vector<result_type>> query_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &Q, unsigned k) const {
+        return search(data_, norms_.data(), ~Q, k, metric_);
+    }
+    std::vector<result_type> query(const FType *q, unsigned k) const {
+        return std::move(search(data_, norms_.data(), blaze::CustomMatrix<const FType, blaze::unaligned, blaze::unpadded>(q, 1, d_), k, metric_)[0]);
+    }
+    template<typename VT>
+    std::vector<result_type> query(const VT &q, unsigned k) const {return query(static_cast<const FType *>(&q[0]), k);}
+    // Exact k-NN of every row of Q among the rows of X, which is not copied.
+    template<typename MT, typename QMT>
+    static std::vector<std::vector<result_type>>
+    search(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, const blaze::DenseMatrix<QMT, blaze::rowMajor> &Q, unsigned k, Metric metric=L2) {
+        const auto &x = ~X;
+        std::vector<FType> norms(metric == INNER_PRODUCT ? 0: x.rows());
+        fill_norms(x, 0, metric, norms.data());
+        return search(x, norms.data(), ~Q, k, metric);
+    }
+};
+
+} // namespace knn
+
+using knn::ExactKNN;
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_KNN_H__
@@ -532,6 +532,7 @@ struct PCAAggregator {
     PCAAggregator(size_t from, size_t to=0 /* ncomp */):
         mat_(from),
         mean_estimator_(from),
+        n_(0),
         nvs_(to ? to: size_t(-1))
     {
     }
@@ -542,10 +543,11 @@ struct PCAAggregator {
         REQUIRE(o.columns() == mat_.columns(), "must have matching # columns");
         assert((trans(o) * o).rows() == mat_.columns());
         std::future<void> fut = std::async(std::launch::async, [&]() {
-            for(size_t i = 0; i < mat_.rows(); ++i)
-                this->add(row(o, i));
+            for(size_t i = 0; i < o.rows(); ++i)
+                mean_estimator_.add(trans(row(o, i)));
         });
         mat_ += declsym(trans(o) * o);
+        n_ += o.rows();
         // TODO: map/reduce computation
         fut.get();
     }
@@ -553,10 +555,11 @@ struct PCAAggregator {
         REQUIRE(o.columns() == mat_.columns(), "must have matching # columns");
         assert((trans(o) * o).rows() == mat_.columns());
         std::future<void> fut = std::async(std::launch::async, [&]() {
-            for(size_t i = 0; i < mat_.rows(); ++i)
-                this->add(row(o, i));
+            for(size_t i = 0; i < o.rows(); ++i)
+                mean_estimator_.add(trans(row(o, i)));
         });
         mat_ += declsym(trans(o) * o);
+        n_ += o.rows();
         // TODO: map/reduce computation
         fut.get();
     }
@@ -579,16 +582,19 @@ struct PCAAggregator {
     bool ready() const {
         return eigvec_.get() && eigval_.get();
     }
+    size_t n() const {return n_;}
+    // After finalize(): principal directions as rows, and their variances, by decreasing variance.
+    const auto &components() const {return *eigvec_;}
+    const auto &variances() const {return *eigval_;}
     void finalize() {
         if(!n_) throw std::runtime_error("Can't finalize nothing");
         eigvec_.reset(new blaze::DynamicMatrix<FT, SO>(mat_.rows(), mat_.columns()));
         eigval_.reset(new blaze::DynamicVector<FT, SO>(mat_.rows(), mat_.columns()));
         auto &vecs = *eigvec_;
         auto &vals = *eigval_;
-        blaze::DynamicMatrix<FT, SO> mat =
-               (1. / (n_ > 1 ? n_ - 1: n_) * mat_) // XX^T / (n - 1)
-                -
-                mean_estimator_.mean() * trans(mean_estimator_.mean()); // muXmuXT
+        SymMat mat = blaze::declsym(
+               (1. / (n_ > 1 ? n_ - 1: n_)) * // (XX^T - n muXmuXT) / (n - 1)
+               (mat_ - FT(n_) * (mean_estimator_.mean() * trans(mean_estimator_.mean()))));
         blaze::eigen(mat, vals, vecs);
         blaze::DynamicVector<uint32_t> indices(vals.size());
         std::iota(indices.begin(), indices.end(), 0u);
@@ -598,7 +604,7 @@ struct PCAAggregator {
         blaze::DynamicVector<FT, SO> retvals(rrows);
         for(auto i = 0u; i < rrows; ++i) {
             retvals[i] = vals[indices[i]];
-            row(ret, i) = vecs[indices[i]];
+            row(ret, i) = row(vecs, indices[i]); // Eigenvectors are the rows of vecs.
         }
         std::swap(ret, vecs);
         std::swap(retvals, vals);
@@ -2,26 +2,42 @@
 #define FRP_LSH_H__
 #include "vec/vec.h"
 #include "frp/jl.h"
+#include "frp/quantize.h"
 #include "clhash/include/clhash.h"
 #include "flat_hash_map/flat_hash_map.hpp"
+#include <queue>
+#include <atomic>
+#include <map>
+#include <mutex>
 
 
 namespace frp {
+/*
+ * CLHash with immutable keys shared between hashers: hashers constructed with the same seeds share one key,
+ * interned in a process-wide table, so copies only bump a reference count.
+ */
 struct mclhasher {
-    const void *random_data_;
-    mclhasher(uint64_t seed1=137, uint64_t seed2=777): random_data_(get_random_key_for_clhash(seed1, seed2)) {}
-    mclhasher(const mclhasher &o): random_data_(copy_random_data(o)) {} // copy data
-    mclhasher(mclhasher &&o): random_data_(o.random_data_) {
-        o.random_data_ = nullptr; // move
-    }
-    static void *copy_random_data(const mclhasher &o) {
-        void *ret;
-        if(posix_memalign(&ret, sizeof(__m128i), RANDOM_BYTES_NEEDED_FOR_CLHASH)) throw std::bad_alloc();
-        return std::memcpy(ret, o.random_data_, RANDOM_BYTES_NEEDED_FOR_CLHASH);
+    std::shared_ptr<const void> key_;
+    static std::shared_ptr<const void> shared_key(uint64_t seed1, uint64_t seed2) {
+        static std::mutex mut;
+        static std::map<std::pair<uint64_t, uint64_t>, std::weak_ptr<const void>> keys;
+        static size_t sweep_at = 64;
+        std::lock_guard<std::mutex> lock(mut);
+        auto &wp = keys[std::make_pair(seed1, seed2)];
+        if(auto ret = wp.lock()) return ret;
+        std::shared_ptr<const void> ret(get_random_key_for_clhash(seed1, seed2), [](const void *p) {std::free(const_cast<void *>(p));});
+        wp = ret;
+        if(keys.size() >= sweep_at) { // Drop entries whose hashers have all been destroyed.
+            for(auto it = keys.begin(); it != keys.end(); it = it->second.expired() ? keys.erase(it): std::next(it));
+            sweep_at = std::max(size_t(64), 2 * keys.size());
+        }
+        return ret;
     }
+    mclhasher(uint64_t seed1=137, uint64_t seed2=777): key_(shared_key(seed1, seed2)) {}
+    const void *key() const {return key_.get();}
     template<typename T>
     uint64_t operator()(const T *data, const size_t len) const {
-        return clhash(random_data_, (const char *)data, len * sizeof(T));
+        return clhash(key_.get(), (const char *)data, len * sizeof(T));
     }
     uint64_t operator()(const char *str) const {return operator()(str, std::strlen(str));}
     template<typename T>
@@ -35,20 +51,32 @@ struct mclhasher {
     uint64_t operator()(const std::string &str) const {
         return operator()(str.data(), str.size());
     }
-    ~mclhasher() {
-        std::free((void *)random_data_);
+    // out[i] = (*this)(data + i * len, len) for n contiguous arrays, e.g. one bucket vector per table.
+    // Four independent hashes are issued per iteration so their carry-less multiply chains overlap.
+    template<typename T>
+    void hash_batch(const T *data, size_t len, size_t n, uint64_t *out) const {
+        const void *key = key_.get();
+        const size_t nb = len * sizeof(T);
+        const char *p = (const char *)data;
+        size_t i = 0;
+        for(; i + 4 <= n; i += 4, p += 4 * nb) {
+            const uint64_t h0 = clhash(key, p, nb), h1 = clhash(key, p + nb, nb),
+                           h2 = clhash(key, p + 2 * nb, nb), h3 = clhash(key, p + 3 * nb, nb);
+            out[i] = h0; out[i + 1] = h1; out[i + 2] = h2; out[i + 3] = h3;
+        }
+        for(; i < n; ++i, p += nb) out[i] = clhash(key, p, nb);
     }
 };
 using SIMDSpace = vec::SIMDTypes<uint64_t>;
 using VType = typename SIMDSpace::VType;
 template<typename F, typename V> ATTR_CONST INLINE auto cmp_zero(V v);
-#if _FEATURE_AVX512F
+#if HAS_AVX_512
 template<> ATTR_CONST INLINE auto
 cmp_zero<float> (__m512 v) {
     return _mm512_cmp_ps_mask(v, _mm512_setzero_ps(), _CMP_GT_OQ);
 }
 template<> ATTR_CONST INLINE auto
-cmp_zero<float> (__m512d v) {
+cmp_zero<double> (__m512d v) {
     return _mm512_cmp_pd_mask(v, _mm512_setzero_pd(), _CMP_GT_OQ);
 }
 #elif __AVX__
@@ -199,25 +227,38 @@ struct LSHasher {
         return blaze::dot(container_, ov);
     }
     // TODO: Store full matrix to get hashes
-    // TODO: Use structured matrices to speed up calculation (FFHT, then downsample to bins)
+    // For structured-matrix hashing, see FHTLSHasher (SRP) and CrossPolytopeLSHasher.
 };
 
 
 
-template<typename FType, bool OSO>
-static INLINE uint64_t cmp2hash(const blaze::DynamicVector<FType, OSO> &c, size_t n=0) {
-    assert(n <= 64);
-    uint64_t ret = 0;
-    if(n == 0) {
-        n = n;
-    }
+// Number of signs cmp2hash packs per vector comparison (0 if scalar).
+template<typename FType>
+static constexpr size_t cmp2hash_lanes() {
 #if HAS_AVX_512
-    static constexpr size_t COUNT = sizeof(__m512d) / sizeof(FType);
+    return sizeof(__m512d) / sizeof(FType);
 #elif __AVX__
-    static constexpr size_t COUNT = sizeof(__m256d) / sizeof(FType);
+    return sizeof(__m256d) / sizeof(FType);
 #else
-    static constexpr size_t COUNT = 0;
+    return 0;
 #endif
+}
+
+// Bit of cmp2hash(c, n) which holds the sign of c[i].
+template<typename FType>
+static constexpr unsigned cmp2hash_bit(size_t i, size_t n) {
+    constexpr size_t COUNT = cmp2hash_lanes<FType>();
+    if(COUNT == 0) return n - 1 - i;
+    const size_t vectorized = n / COUNT * COUNT, rem = n - vectorized;
+    return i < vectorized ? (vectorized - COUNT - i / COUNT * COUNT) + i % COUNT + rem
+                          : n - 1 - i;
+}
+
+template<typename FType>
+static INLINE uint64_t cmp2hash(const FType *c, size_t n) {
+    assert(n <= 64);
+    uint64_t ret = 0;
+    static constexpr size_t COUNT = cmp2hash_lanes<FType>();
     size_t i = 0;
 #if HAS_AVX_512 || defined(__AVX__)
     CONST_IF(COUNT) {
@@ -238,19 +279,100 @@ static INLINE uint64_t cmp2hash(const blaze::DynamicVector<FType, OSO> &c, size_
     return ret;
 }
 
+template<typename FType, bool OSO>
+static INLINE uint64_t cmp2hash(const blaze::DynamicVector<FType, OSO> &c, size_t n=0) {
+    if(n == 0) n = c.size();
+    return cmp2hash(&c[0], n);
+}
+
+// Packs the signs (> 0) of c[0:n) into out[0:(n + 63) / 64), sign i at bit i % 64 of word i / 64.
+template<typename FType>
+static INLINE void pack_signs(const FType *c, size_t n, uint64_t *out) {
+    std::memset(out, 0, (n + 63) / 64 * sizeof(uint64_t));
+    size_t i = 0;
+#if HAS_AVX_512 || defined(__AVX__)
+    static constexpr size_t COUNT = cmp2hash_lanes<FType>();
+    using LV = F2VType<FType, sizeof(VType)>;
+    for(; i + COUNT <= n; i += COUNT) // COUNT divides 64, so a mask never straddles two words.
+        out[i / 64] |= uint64_t(cmp_zero<FType, typename LV::type>(LV::load(c + i))) << (i % 64);
+#endif
+    for(; i < n; ++i) out[i / 64] |= uint64_t(c[i] > 0.) << (i % 64);
+}
+
+/*
+ * Multi-probe LSH (Lv et al., 2007): enumerate sets of perturbations in increasing order of total score,
+ * using a heap over "shift" (replace the largest element with its successor) and "expand" (append the successor).
+ * scores[0:m) must be sorted in increasing order; func(const uint32_t *indices, size_t n) is called for
+ * up to nsets sets accepted by valid(indices, n).
+ */
+template<typename FT, typename Valid, typename F>
+void for_each_perturbation(const FT *scores, unsigned m, size_t nsets, const Valid &valid, const F &func) {
+    if(m == 0 || nsets == 0) return;
+    using Set = std::pair<double, std::vector<uint32_t>>;
+    auto cmp = [](const Set &a, const Set &b) {return a.first > b.first;};
+    std::priority_queue<Set, std::vector<Set>, decltype(cmp)> heap(cmp);
+    heap.emplace(scores[0], std::vector<uint32_t>{0});
+    while(nsets && !heap.empty()) {
+        Set set = std::move(const_cast<Set &>(heap.top()));
+        heap.pop();
+        if(valid(set.second.data(), set.second.size())) {
+            func(set.second.data(), set.second.size());
+            --nsets;
+        }
+        const uint32_t last = set.second.back();
+        if(last + 1 < m) {
+            Set expanded(set.first + scores[last + 1], set.second);
+            expanded.second.push_back(last + 1);
+            heap.push(std::move(expanded));
+            set.first += scores[last + 1] - scores[last];
+            set.second.back() = last + 1;
+            heap.push(std::move(set));
+        }
+    }
+}
+
+// Keys of the nprobes buckets most likely to hold neighbors of a point whose SRP projections are proj[0:nbits),
+// exact bucket first. Flipping bit i costs proj[i]^2: the closer a projection is to its hyperplane, the likelier it flips.
+template<typename FType>
+void srp_probes(const FType *proj, unsigned nbits, unsigned nprobes, std::vector<uint64_t> &out,
+                std::vector<std::pair<FType, uint32_t>> &scratch) {
+    const uint64_t key = cmp2hash(proj, nbits);
+    out.assign(1, key);
+    if(nprobes <= 1) return;
+    scratch.resize(nbits);
+    for(unsigned i = 0; i < nbits; ++i) scratch[i] = {proj[i] * proj[i], i};
+    std::sort(scratch.begin(), scratch.end());
+    std::vector<FType> scores(nbits);
+    for(unsigned i = 0; i < nbits; ++i) scores[i] = scratch[i].first;
+    for_each_perturbation(scores.data(), nbits, nprobes - 1, [](auto, auto) {return true;},
+        [&](const uint32_t *idx, size_t n) {
+            uint64_t flipped = key;
+            for(size_t i = 0; i < n; ++i) flipped ^= uint64_t(1) << cmp2hash_bit<FType>(scratch[idx[i]].second, nbits);
+            out.push_back(flipped);
+        });
+}
+
 template<typename FType=float, bool SO=blaze::rowMajor, typename DistributionType=std::normal_distribution<FType>>
 struct MatrixLSHasher {
     using CType = ::blaze::DynamicMatrix<FType, SO>;
     using this_type       =       MatrixLSHasher<FType, SO>;
     using const_this_type = const MatrixLSHasher<FType, SO>;
-    CType container_;
+    serial::MatrixStore<FType, SO> container_;
     template<typename...DistArgs>
     MatrixLSHasher(size_t nr, size_t nc, bool orthonormalize=true, uint64_t seed=0,
                    DistArgs &&...args):
         container_(std::move(generate_randproj_matrix<FType, SO, DistributionType>(nr, nc, orthonormalize, seed, std::forward<DistArgs>(args)...))) {}
+    explicit MatrixLSHasher(CType &&mat): container_(std::move(mat)) {}
+    // The projection matrix is stored materialized and mapped in place on load.
+    explicit MatrixLSHasher(serial::Reader &r): container_(r.expect(serial::MATRIX_LSH, sizeof(FType))) {}
+    void write(serial::Writer &w) const {
+        w.write_header(serial::MATRIX_LSH, sizeof(FType));
+        container_.write(w);
+    }
+    auto matrix() const {return container_.view();}
     auto &multiply(const blaze::DynamicVector<FType, SO> &c, blaze::DynamicVector<FType, SO> &ret) const {
         //std::fprintf(stderr, "size of input: %zu. size of ret: %zu. Matrix sizes: %zu/%zu\n", c.size(), ret.size(), container_.rows(), container_.columns());
-        ret = this->container_ * c;
+        ret = this->container_.view() * c;
         //std::fprintf(stderr, "multiplied successfully\n");
         return ret;
     }
@@ -262,7 +384,7 @@ struct MatrixLSHasher {
     }
     auto multiply(const blaze::DynamicVector<FType, !SO> &c) const {
         //std::fprintf(stderr, "size of input: %zu. size of vec: %zu. Matrix sizes: %zu/%zu\n", c.size(), container_.rows(), container_.columns());
-        blaze::DynamicVector<FType, SO> vec = this->container_ * trans(c);
+        blaze::DynamicVector<FType, SO> vec = this->container_.view() * trans(c);
         return vec;
     }
     template<typename...Args>
@@ -270,7 +392,7 @@ struct MatrixLSHasher {
     template<bool OSO>
     uint64_t hash(const blaze::DynamicVector<FType, OSO> &c) const {
 #if VERBOSE_AF
-        std::cout << this->container_ << '\n';
+        std::cout << this->container_.view() << '\n';
 #endif
         blaze::DynamicVector<FType, SO> vec = multiply(c);
         return cmp2hash(vec); // This is the SRP hasher (signed random projection)
@@ -281,6 +403,49 @@ struct MatrixLSHasher {
     }
 };
 
+// dst[i] = floor(src[i] + offset[i]), converted to int32.
+static INLINE void floor_offset(const float *src, const float *offset, int32_t *dst, size_t n) {
+    size_t i = 0;
+#if HAS_AVX_512
+    for(; i + 16 <= n; i += 16)
+        _mm512_storeu_si512(dst + i, _mm512_cvt_roundps_epi32(_mm512_add_ps(_mm512_loadu_ps(src + i), _mm512_loadu_ps(offset + i)),
+                                                              _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+#elif __AVX__
+    for(; i + 8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_add_ps(_mm256_loadu_ps(src + i), _mm256_loadu_ps(offset + i)))));
+#endif
+    for(; i < n; ++i) dst[i] = std::floor(src[i] + offset[i]);
+}
+static INLINE void floor_offset(const double *src, const double *offset, int32_t *dst, size_t n) {
+    size_t i = 0;
+#if HAS_AVX_512
+    for(; i + 8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm512_cvt_roundpd_epi32(_mm512_add_pd(_mm512_loadu_pd(src + i), _mm512_loadu_pd(offset + i)),
+                                                                           _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+#elif __AVX__
+    for(; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvttpd_epi32(_mm256_floor_pd(_mm256_add_pd(_mm256_loadu_pd(src + i), _mm256_loadu_pd(offset + i)))));
+#endif
+    for(; i < n; ++i) dst[i] = std::floor(src[i] + offset[i]);
+}
+
+template<typename FT=float>
+struct ThresholdedCauchyDistribution {
+    std::cauchy_distribution<FT> cd_;
+    FT absmax_;
+    template<typename...Args> ThresholdedCauchyDistribution(FT absmax, Args &&...args): cd_(std::forward<Args>(args)...), absmax_(std::abs(absmax)) {
+    }
+    template<typename RNG>
+    FT operator()(RNG &rng) {
+        return std::clamp(cd_(rng), -absmax_, absmax_);
+    }
+};
+
+/*
+ * p-stable LSH (Datar et al., 2004): bucket i of x is floor(a_i . x / r + b_i), with a_i drawn i.i.d. from
+ * DistributionType (Gaussian for L2, Cauchy for L1) and b_i ~ U[0, 1). The k bucket coordinates are hashed with CLHash.
+ * hash() works from a stack buffer; hash_batch() does one GEMM, a fused SIMD offset/floor/convert per row and batched CLHash.
+ */
 template<typename FType=float, bool OSO=blaze::rowMajor, typename DistributionType=std::normal_distribution<FType>>
 struct E2LSHasher {
     MatrixLSHasher<FType, OSO, DistributionType> superhasher_;
@@ -288,41 +453,122 @@ struct E2LSHasher {
     double r_;
     mclhasher clhasher_;
     template<typename...Args>
-    E2LSHasher(unsigned d, unsigned k, double r = 1., uint64_t seed=0, Args &&...args): superhasher_(k, d, false, seed, std::forward<Args>(args)...), r_(r), b_(k), clhasher_(seed * seed + seed) {
-        superhasher_.container_ /= r;
-        std::uniform_real_distribution<FType> gen(0, r_);
+    static blaze::DynamicMatrix<FType, OSO> pstable_matrix(unsigned d, unsigned k, double r, uint64_t seed, const Args &...args) {
+        blaze::DynamicMatrix<FType, OSO> ret(k, d);
+        OMP_PRAGMA("omp parallel for")
+        for(size_t i = 0; i < k; ++i) {
+            std::mt19937_64 gen(seed + i * 0x9E3779B97F4A7C15ull);
+            DistributionType dist(args...);
+            for(auto &v: row(ret, i))
+                v = dist(gen) / r;
+        }
+        return ret;
+    }
+    template<typename...Args>
+    E2LSHasher(unsigned d, unsigned k, double r = 1., uint64_t seed=0, const Args &...args):
+        superhasher_(pstable_matrix(d, k, r, seed, args...)), b_(k), r_(r), clhasher_(seed * seed + seed)
+    {
+        std::uniform_real_distribution<FType> gen(0, 1);
         std::mt19937_64 mt(seed ^ uint64_t(d * k * r));
         for(auto &v: b_)
             v = gen(mt);
     }
     E2LSHasher(const E2LSHasher &o) = default;
     E2LSHasher(E2LSHasher &&o) = default;
+    size_t k() const {return b_.size();}
+    size_t dim() const {return superhasher_.matrix().columns();}
     template<typename...Args>
     decltype(auto) project(Args &&...args) const {
-        //std::fprintf(stderr, "b size: %zu\n", b_.size());
-        //auto v = superhasher_.project(std::forward<Args>(args)...);
-        //std::fprintf(stderr, "v size: %zu\n", v.size());
         return floor(superhasher_.project(std::forward<Args>(args)...) + b_);
     }
-    template<typename...Args>
-    uint64_t hash(Args &&...args) const {
-        auto proj = this->project(std::forward<Args>(args)...);
-        return clhasher_(&b_[0], b_.size() * sizeof(FType));
+    // Real-valued bucket coordinates a_i . x / r + b_i, written to out[0:k()).
+    template<typename VT>
+    void coordinates(const VT &x, FType *out) const {
+        const auto mat = superhasher_.matrix();
+        const blaze::CustomVector<const FType, blaze::unaligned, blaze::unpadded, blaze::rowVector> cx(&x[0], dim());
+        for(size_t i = 0; i < k(); ++i)
+            out[i] = blaze::dot(row(mat, i), cx) + b_[i];
     }
-    template<typename...Args>
-    uint64_t operator()(Args &&...args) const {
-        return hash(std::forward<Args>(args)...);
+    template<typename VT>
+    void buckets(const VT &x, int32_t *out) const {
+        const auto mat = superhasher_.matrix();
+        const blaze::CustomVector<const FType, blaze::unaligned, blaze::unpadded, blaze::rowVector> cx(&x[0], dim());
+        for(size_t i = 0; i < k(); ++i)
+            out[i] = std::floor(blaze::dot(row(mat, i), cx) + b_[i]);
     }
-};
-
-template<typename FT=float>
-struct ThresholdedCauchyDistribution {
-    std::cauchy_distribution<FT> cd_;
-    FT absmax_;
-    template<typename...Args> ThresholdedCauchyDistribution(FT absmax, Args &&...args): cd_(std::forward<Args>(args)...), absmax_(std::abs(absmax)) {
+    uint64_t hash_buckets(const int32_t *buckets) const {return clhasher_(buckets, b_.size());}
+    // Hashes of the nprobes buckets most likely to hold neighbors of x, exact bucket first.
+    // Moving coordinate i down a bucket costs frac_i^2 and up (1 - frac_i)^2, frac_i being x's offset within its bucket.
+    template<typename VT>
+    void probes(const VT &x, unsigned nprobes, std::vector<uint64_t> &out) const {
+        const size_t k = b_.size();
+        std::vector<FType> v(k);
+        coordinates(x, v.data());
+        std::vector<int32_t> buckets(k);
+        std::vector<std::pair<FType, uint32_t>> moves(2 * k); // (score, 2 * coordinate + up)
+        for(size_t i = 0; i < k; ++i) {
+            const FType f = std::floor(v[i]), frac = v[i] - f;
+            buckets[i] = static_cast<int32_t>(f);
+            moves[2 * i] = {frac * frac, uint32_t(2 * i)};
+            moves[2 * i + 1] = {(1 - frac) * (1 - frac), uint32_t(2 * i + 1)};
+        }
+        out.assign(1, hash_buckets(buckets.data()));
+        if(nprobes <= 1) return;
+        std::sort(moves.begin(), moves.end());
+        std::vector<FType> scores(2 * k);
+        for(size_t i = 0; i < 2 * k; ++i) scores[i] = moves[i].first;
+        for_each_perturbation(scores.data(), 2 * k, nprobes - 1,
+            [&](const uint32_t *idx, size_t n) {
+                for(size_t i = 1; i < n; ++i)
+                    for(size_t j = 0; j < i; ++j)
+                        if(moves[idx[i]].second >> 1 == moves[idx[j]].second >> 1) return false;
+                return true;
+            },
+            [&](const uint32_t *idx, size_t n) {
+                for(size_t i = 0; i < n; ++i) buckets[moves[idx[i]].second >> 1] += moves[idx[i]].second & 1 ? 1: -1;
+                out.push_back(hash_buckets(buckets.data()));
+                for(size_t i = 0; i < n; ++i) buckets[moves[idx[i]].second >> 1] -= moves[idx[i]].second & 1 ? 1: -1;
+            });
     }
-    FT operator()() {
-        return std::clamp(cd_(), -absmax_, absmax_);
+    template<typename VT>
+    uint64_t hash(const VT &x) const {
+        static constexpr size_t STACK_SIZE = 256;
+        if(k() <= STACK_SIZE) {
+            int32_t buf[STACK_SIZE];
+            buckets(x, buf);
+            return hash_buckets(buf);
+        }
+        std::vector<int32_t> buf(k());
+        buckets(x, buf.data());
+        return hash_buckets(buf.data());
+    }
+    template<typename VT>
+    uint64_t operator()(const VT &x) const {
+        return hash(x);
+    }
+    // Hashes every row of X into out[0:X.rows()). workspace holds the projections and is reused across calls.
+    template<typename MT>
+    void hash_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, uint64_t *out, blaze::DynamicMatrix<FType> &workspace) const {
+        if((~X).columns() != dim()) throw std::runtime_error("Wrong number of columns for E2LSHasher::hash_batch");
+        workspace = (~X) * trans(superhasher_.matrix());
+        static constexpr size_t CHUNK = 64;
+        const size_t nr = workspace.rows();
+        OMP_PRAGMA("omp parallel")
+        {
+            std::vector<int32_t> buf(CHUNK * k());
+            OMP_PRAGMA("omp for")
+            for(size_t start = 0; start < nr; start += CHUNK) {
+                const size_t end = std::min(start + CHUNK, nr);
+                for(size_t i = start; i < end; ++i)
+                    floor_offset(&workspace(i, 0), &b_[0], &buf[(i - start) * k()], k());
+                clhasher_.hash_batch(buf.data(), k(), end - start, out + start);
+            }
+        }
+    }
+    template<typename MT>
+    void hash_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, uint64_t *out) const {
+        blaze::DynamicMatrix<FType> workspace;
+        hash_batch(X, out, workspace);
     }
 };
 
@@ -335,66 +581,82 @@ struct L1E2LSHasher: public E2LSHasher<FType, OSO, ThresholdedCauchyDistribution
 
 
 
+/*
+ * Structured SRP: signs of orthogonal JL (Hadamard-Rademacher) transforms of the zero-padded input.
+ * Each transform yields ncroundup() projections, so for more bits than that, transforms with independent
+ * seeds are stacked. sketch()/sketch_batch() pack any number of bits into uint64_t words;
+ * hash() returns a single key and requires nr <= 64.
+ */
 template<typename FType=float, bool SO=blaze::rowMajor, typename DistributionType=std::normal_distribution<FType>>
 struct FHTLSHasher {
     using this_type       =       FHTLSHasher<FType, SO>;
     using const_this_type = const FHTLSHasher<FType, SO>;
-    //std::vector<blaze::DynamicVector<FType, SO>> d_; // diagonal matrix
-    //                                                 // use Matrix for case that we need more projections than we have dimensions
     std::vector<jl::OrthogonalJLTransform<FType>> jlt_;
     size_t nc_, nr_;
     auto ncroundup() const {return roundup(nc_);}
-    template<typename...DistArgs>
-    FHTLSHasher(size_t nr, size_t nc, uint64_t seed=0, unsigned nblocks=1,
-                DistArgs &&...args): nc_(nc), nr_(nr) {
-        unsigned njlts = (nr + nc - 1) / nc;
-        jlt_.reserve(njlts);
-        if(nr > nc) {
-            std::mt19937_64 mt(seed + nc * nr);
-            throw std::runtime_error("Not implemented: projections > dimensionality. TODO: this");
-        } else {
+    size_t nprojections() const {return jlt_.size() * ncroundup();}
+    size_t nbits() const {return nr_;}
+    size_t nwords() const {return (nr_ + 63) / 64;}
+    FHTLSHasher(size_t nr, size_t nc, uint64_t seed=0, unsigned nblocks=1): nc_(nc), nr_(nr) {
+        if(nr <= nc) {
             jlt_.emplace_back(nc, nr, seed + (nc * nr), nblocks);
-            //d_.emplace_back(roundup(nc), 0);
-        }
-        blaze::RNG gen(seed);
-        DistributionType dist(std::forward<DistArgs>(args)...);
-#if 0
-        for(auto &d: d_) 
-            for(size_t i = 0; i < nc; ++i)
-                d[i] = dist(gen);
-#endif
+        } else {
+            const size_t ts = ncroundup(), njlts = (nr + ts - 1) / ts;
+            std::mt19937_64 mt(seed + nc * nr);
+            jlt_.reserve(njlts);
+            while(jlt_.size() < njlts) jlt_.emplace_back(nc, ts, mt(), nblocks);
+        }
+    }
+    // Writes all nprojections() projections of x[0:nc_) to out.
+    void project_into(const FType *x, FType *out) const {
+        const size_t ts = ncroundup();
+        for(size_t b = 0; b < jlt_.size(); ++b) {
+            FType *p = out + b * ts;
+            std::copy(x, x + nc_, p);
+            std::fill(p + nc_, p + ts, FType(0));
+            jlt_[b].transform_inplace(p);
+        }
     }
     auto &multiply(const blaze::DynamicVector<FType, SO> &c, blaze::DynamicVector<FType, SO> &ret) const {
-        // This will change when we support more projections than input dimensions
-        //auto &d = d_[0];
-        auto &jl = jlt_[0];
-        const auto ts = ncroundup();
-        if(ret.size() != ts) ret.resize(ts);
-        //subvector(ret, 0, nc_) = trans(c) * subvector(d, 0, nc_);
-        subvector(ret, 0, nc_) = c;
-        subvector(ret, nc_, ts - nc_) = 0;
-        jl.transform_inplace(ret);
+        if(ret.size() != nprojections()) ret.resize(nprojections());
+        project_into(&c[0], &ret[0]);
         return ret;
     }
-    auto multiply(const blaze::DynamicVector<FType, SO> &c) const {
-        blaze::DynamicVector<FType, SO> vec(ncroundup());
-        multiply(c, vec);
-        return vec;
-    }
-    auto multiply(const blaze::DynamicVector<FType, !SO> &c) const {
-        // This will change when we support more projections than input dimensions
-        //auto &d = d_[0];
-        auto &jl = jlt_[0];
-        auto ts = ncroundup();
-        blaze::DynamicVector<FType, SO> vec(ts);
-        //subvector(vec, 0, nc_) = trans(c) * subvector(d, 0, nc_); if using d_
-        subvector(vec, 0, nc_) = trans(c);
-        subvector(vec, nc_, ts - nc_) = 0;
-        jl.transform_inplace(vec);
+    // Any dense vector with contiguous storage.
+    template<typename VT>
+    blaze::DynamicVector<FType, SO> multiply(const VT &c) const {
+        blaze::DynamicVector<FType, SO> vec(nprojections());
+        project_into(&c[0], &vec[0]);
         return vec;
     }
     template<typename...Args>
     decltype(auto) project(Args &&...args) const {return multiply(std::forward<Args>(args)...);}
+    // Packs the nbits() signs of x into out[0:nwords()); buf must hold nprojections() values.
+    void sketch(const FType *x, uint64_t *out, FType *buf) const {
+        project_into(x, buf);
+        pack_signs(buf, nr_, out);
+    }
+    template<typename VT>
+    std::vector<uint64_t> sketch(const VT &x) const {
+        blaze::DynamicVector<FType> buf(nprojections());
+        std::vector<uint64_t> ret(nwords());
+        sketch(&x[0], ret.data(), &buf[0]);
+        return ret;
+    }
+    // Sketches every row of mat into out[i * nwords():(i + 1) * nwords()).
+    template<typename MT>
+    void sketch_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &mat, uint64_t *out) const {
+        const auto &m = ~mat;
+        if(m.columns() != nc_) throw std::runtime_error("Wrong number of columns for FHTLSHasher::sketch_batch");
+        const size_t nw = nwords();
+        OMP_PRAGMA("omp parallel")
+        {
+            blaze::DynamicVector<FType> buf(nprojections());
+            OMP_PRAGMA("omp for")
+            for(size_t i = 0; i < m.rows(); ++i)
+                sketch(&m(i, 0), out + i * nw, &buf[0]);
+        }
+    }
     template<bool OSO>
     uint64_t hash(const blaze::DynamicVector<FType, OSO> &c) const {
         blaze::DynamicVector<FType, SO> vec = multiply(c);
@@ -407,6 +669,216 @@ struct FHTLSHasher {
 };
 
 
+// Index of the largest |x[i]| in x[0:n), the first on ties.
+static INLINE size_t argmax_abs(const float *x, size_t n) {
+    float best = 0.;
+    size_t i = 0;
+#if HAS_AVX_512
+    if(n >= 16) {
+        __m512 vmax = _mm512_abs_ps(_mm512_loadu_ps(x));
+        for(i = 16; i + 16 <= n; i += 16) vmax = _mm512_max_ps(vmax, _mm512_abs_ps(_mm512_loadu_ps(x + i)));
+        best = _mm512_reduce_max_ps(vmax);
+    }
+#elif __AVX__
+    const __m256 signbit = _mm256_set1_ps(-0.f);
+    if(n >= 8) {
+        __m256 vmax = _mm256_andnot_ps(signbit, _mm256_loadu_ps(x));
+        for(i = 8; i + 8 <= n; i += 8) vmax = _mm256_max_ps(vmax, _mm256_andnot_ps(signbit, _mm256_loadu_ps(x + i)));
+        __m128 m = _mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1));
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        best = _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+    }
+#endif
+    for(; i < n; ++i) best = std::max(best, std::abs(x[i]));
+    // Second pass: locate the first lane holding the maximum.
+    i = 0;
+#if HAS_AVX_512
+    for(const __m512 vb = _mm512_set1_ps(best); i + 16 <= n; i += 16)
+        if(auto m = _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_loadu_ps(x + i)), vb, _CMP_EQ_OQ)) return i + __builtin_ctz(m);
+#elif __AVX__
+    for(const __m256 vb = _mm256_set1_ps(best); i + 8 <= n; i += 8)
+        if(int m = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(signbit, _mm256_loadu_ps(x + i)), vb, _CMP_EQ_OQ))) return i + __builtin_ctz(m);
+#endif
+    for(; i < n; ++i) if(std::abs(x[i]) == best) return i;
+    return 0; // Only reached when x contains NaNs.
+}
+static INLINE size_t argmax_abs(const double *x, size_t n) {
+    double best = 0.;
+    size_t i = 0;
+#if HAS_AVX_512
+    if(n >= 8) {
+        __m512d vmax = _mm512_abs_pd(_mm512_loadu_pd(x));
+        for(i = 8; i + 8 <= n; i += 8) vmax = _mm512_max_pd(vmax, _mm512_abs_pd(_mm512_loadu_pd(x + i)));
+        best = _mm512_reduce_max_pd(vmax);
+    }
+#elif __AVX__
+    const __m256d signbit = _mm256_set1_pd(-0.);
+    if(n >= 4) {
+        __m256d vmax = _mm256_andnot_pd(signbit, _mm256_loadu_pd(x));
+        for(i = 4; i + 4 <= n; i += 4) vmax = _mm256_max_pd(vmax, _mm256_andnot_pd(signbit, _mm256_loadu_pd(x + i)));
+        const __m128d m = _mm_max_pd(_mm256_castpd256_pd128(vmax), _mm256_extractf128_pd(vmax, 1));
+        best = _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m, m)));
+    }
+#endif
+    for(; i < n; ++i) best = std::max(best, std::abs(x[i]));
+    i = 0;
+#if HAS_AVX_512
+    for(const __m512d vb = _mm512_set1_pd(best); i + 8 <= n; i += 8)
+        if(auto m = _mm512_cmp_pd_mask(_mm512_abs_pd(_mm512_loadu_pd(x + i)), vb, _CMP_EQ_OQ)) return i + __builtin_ctz(m);
+#elif __AVX__
+    for(const __m256d vb = _mm256_set1_pd(best); i + 4 <= n; i += 4)
+        if(int m = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(signbit, _mm256_loadu_pd(x + i)), vb, _CMP_EQ_OQ))) return i + __builtin_ctz(m);
+#endif
+    for(; i < n; ++i) if(std::abs(x[i]) == best) return i;
+    return 0;
+}
+
+/*
+ * Cross-polytope LSH (Andoni et al., 2015): x is pseudo-rotated by nrotations Hadamard-Rademacher blocks (HD3HD2HD1)
+ * and hashed to its nearest vertex +-e_i of the cross-polytope, i.e., the argmax of |x_i| and its sign.
+ * k such hashes are combined into one key. Inputs longer than cp_dim are feature-hashed down to cp_dim;
+ * shorter ones are zero-padded. last_cp_dim restricts the final hash to its first coordinates,
+ * tuning the number of buckets between powers of two.
+ * Costs O(k * cp_dim * log(cp_dim)) per point, like FHTLSHasher, but each hash carries log2(2 * cp_dim) bits.
+ */
+template<typename FType=float>
+struct CrossPolytopeLSHasher {
+    size_t dim_, cp_dim_, last_cp_dim_;
+    unsigned k_, nrotations_;
+    std::vector<uint32_t> fh_index_; // Feature hashing, empty if dim_ <= cp_dim_.
+    std::vector<FType> fh_sign_;
+    std::vector<HadamardRademacherSDBlockT<FType>> rotations_; // k_ * nrotations_, applied in order.
+
+    CrossPolytopeLSHasher(size_t dim, unsigned k, uint64_t seed=0, size_t cp_dim=0, size_t last_cp_dim=0, unsigned nrotations=3):
+        dim_(dim), cp_dim_(roundup(cp_dim ? cp_dim: dim)), last_cp_dim_(last_cp_dim ? last_cp_dim: cp_dim_), k_(k), nrotations_(nrotations)
+    {
+        if(k == 0 || last_cp_dim_ > cp_dim_ || (k - 1) * std::log2(2. * cp_dim_) + std::log2(2. * last_cp_dim_) > 64.) {
+            char buf[256];
+            std::sprintf(buf, "Cannot combine %u cross-polytope hashes of dimension %zu (last: %zu) into a 64-bit key", k, cp_dim_, last_cp_dim_);
+            throw std::runtime_error(buf);
+        }
+        std::mt19937_64 mt(seed + dim * k);
+        if(dim_ > cp_dim_) {
+            fh_index_.resize(dim_);
+            fh_sign_.resize(dim_);
+            for(size_t i = 0; i < dim_; ++i) {
+                const uint64_t v = mt();
+                fh_index_[i] = v % cp_dim_;
+                fh_sign_[i] = v >> 63 ? -1.: 1.;
+            }
+        }
+        rotations_.reserve(k_ * nrotations_);
+        while(rotations_.size() < k_ * nrotations_) rotations_.emplace_back(cp_dim_, mt());
+    }
+    size_t dim() const {return dim_;}
+    size_t k() const {return k_;}
+    size_t cp_dim() const {return cp_dim_;}
+    // Scratch space, in elements, needed by the pointer overloads of hash() and probes().
+    size_t buffer_size() const {return k_ * cp_dim_;}
+    size_t nvertices(unsigned j) const {return 2 * (j + 1 == k_ ? last_cp_dim_: cp_dim_);}
+
+    // Writes the k_ rotated copies of x[0:dim_) to buf[j * cp_dim_:(j + 1) * cp_dim_).
+    void rotate(const FType *x, FType *buf) const {
+        if(fh_index_.empty()) {
+            std::copy(x, x + dim_, buf);
+            std::fill(buf + dim_, buf + cp_dim_, FType(0));
+        } else {
+            std::fill(buf, buf + cp_dim_, FType(0));
+            for(size_t i = 0; i < dim_; ++i) buf[fh_index_[i]] += fh_sign_[i] * x[i];
+        }
+        for(unsigned j = 1; j < k_; ++j) std::copy(buf, buf + cp_dim_, buf + j * cp_dim_);
+        for(unsigned j = 0; j < k_; ++j)
+            for(unsigned r = 0; r < nrotations_; ++r)
+                rotations_[j * nrotations_ + r].apply(buf + j * cp_dim_);
+    }
+    // Vertex 2i (+e_i) or 2i + 1 (-e_i) nearest to the j'th rotation.
+    uint32_t vertex(const FType *rotated, unsigned j) const {
+        const size_t i = argmax_abs(rotated, nvertices(j) / 2);
+        return 2 * i + (rotated[i] < 0);
+    }
+    uint64_t combine(const uint32_t *vertices) const {
+        uint64_t ret = 0;
+        for(unsigned j = 0; j < k_; ++j) ret = ret * nvertices(j) + vertices[j];
+        return ret;
+    }
+    // buf must hold buffer_size() elements.
+    uint64_t hash(const FType *x, FType *buf) const {
+        rotate(x, buf);
+        uint64_t ret = 0;
+        for(unsigned j = 0; j < k_; ++j) ret = ret * nvertices(j) + vertex(buf + j * cp_dim_, j);
+        return ret;
+    }
+    template<typename VT>
+    uint64_t hash(const VT &x) const {
+        blaze::DynamicVector<FType> buf(buffer_size());
+        return hash(&x[0], &buf[0]);
+    }
+    template<typename VT>
+    uint64_t operator()(const VT &x) const {return hash(x);}
+    // Hashes every row of X into out[0:X.rows()).
+    template<typename MT>
+    void hash_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, uint64_t *out) const {
+        const auto &m = ~X;
+        if(m.columns() != dim_) throw std::runtime_error("Wrong number of columns for CrossPolytopeLSHasher::hash_batch");
+        OMP_PRAGMA("omp parallel")
+        {
+            blaze::DynamicVector<FType> buf(buffer_size());
+            OMP_PRAGMA("omp for")
+            for(size_t i = 0; i < m.rows(); ++i)
+                out[i] = hash(&m(i, 0), &buf[0]);
+        }
+    }
+    /*
+     * Keys of the nprobes buckets most likely to hold neighbors of x, exact bucket first.
+     * Replacing hash j's vertex with +-e_i costs (max_i |y_i| - (+-y_i))^2, y being the j'th rotation;
+     * probe sequences change at most one vertex per hash. Only the nprobes - 1 cheapest alternatives
+     * of each hash can appear among the first nprobes sets, so only those are ranked.
+     */
+    void probes(const FType *x, unsigned nprobes, std::vector<uint64_t> &out, FType *buf) const {
+        rotate(x, buf);
+        std::vector<uint32_t> vertices(k_);
+        for(unsigned j = 0; j < k_; ++j) vertices[j] = vertex(buf + j * cp_dim_, j);
+        out.assign(1, combine(vertices.data()));
+        if(nprobes <= 1) return;
+        std::vector<std::pair<FType, uint64_t>> moves, alternatives; // (score, j << 32 | vertex)
+        for(unsigned j = 0; j < k_; ++j) {
+            const FType *y = buf + j * cp_dim_;
+            const size_t nv = nvertices(j);
+            const FType best = std::abs(y[vertices[j] / 2]);
+            alternatives.clear();
+            for(uint32_t v = 0; v < nv; ++v) {
+                if(v == vertices[j]) continue;
+                const FType diff = best - (v & 1 ? -y[v / 2]: y[v / 2]);
+                alternatives.emplace_back(diff * diff, uint64_t(j) << 32 | v);
+            }
+            const size_t keep = std::min<size_t>(nprobes - 1, alternatives.size());
+            std::partial_sort(alternatives.begin(), alternatives.begin() + keep, alternatives.end());
+            moves.insert(moves.end(), alternatives.begin(), alternatives.begin() + keep);
+        }
+        std::sort(moves.begin(), moves.end());
+        std::vector<FType> scores(moves.size());
+        for(size_t i = 0; i < moves.size(); ++i) scores[i] = moves[i].first;
+        for_each_perturbation(scores.data(), moves.size(), nprobes - 1,
+            [&](const uint32_t *idx, size_t n) {
+                for(size_t i = 1; i < n; ++i)
+                    for(size_t j = 0; j < i; ++j)
+                        if(moves[idx[i]].second >> 32 == moves[idx[j]].second >> 32) return false;
+                return true;
+            },
+            [&](const uint32_t *idx, size_t n) {
+                std::vector<uint32_t> perturbed(vertices);
+                for(size_t i = 0; i < n; ++i) perturbed[moves[idx[i]].second >> 32] = uint32_t(moves[idx[i]].second);
+                out.push_back(combine(perturbed.data()));
+            });
+    }
+    template<typename VT>
+    void probes(const VT &x, unsigned nprobes, std::vector<uint64_t> &out) const {
+        blaze::DynamicVector<FType> buf(buffer_size());
+        probes(&x[0], nprobes, out, &buf[0]);
+    }
+};
+
+
 template<typename Hasher, typename IDType=uint32_t> //, ContainerTemplate=template<typename...> class=std::vector,
          //typename... ContainerArgs>
 struct LSHTable {
@@ -416,12 +888,12 @@ struct LSHTable {
     IDType nadded_ = 0;
     LSHTable(Hasher &&hasher): hasher_(std::move(hasher)) {
     }
+    // Not thread-safe; see ConcurrentLSHIndex for concurrent inserts.
     template<typename T>
-    auto add(const T &x) {
-        auto id = nadded_++;
-        auto v = hasher_(x);
-        auto tmp = map_.emplace(v, {id}); // start with just ID
-        if(!tmp.second) tmp.first->push_back(id); // If already present, push back
+    IDType add(const T &x) {
+        const IDType id = nadded_++;
+        map_[hasher_(x)].push_back(id);
+        return id;
     }
     template<typename T>
     const Container *query(const T &x) const {
@@ -437,6 +909,447 @@ auto make_lshtable(Hasher &&hasher) {
     return LSHTable<Hasher, IDType>(std::move(hasher));
 }
 
+/*
+ * BucketTable: an LSH table mapping 64-bit keys to ids. Entries are staged, then freeze() lays them out
+ * CSR-style: one contiguous id array with per-bucket offsets. Staging more entries and freezing again merges them.
+ */
+template<typename IDType=uint32_t>
+struct BucketTable {
+    ska::flat_hash_map<uint64_t, uint32_t> buckets_; // key -> bucket index
+    std::vector<size_t> offsets_{0};
+    std::vector<IDType> ids_;
+    std::vector<std::pair<uint64_t, IDType>> staged_;
+
+    void stage(uint64_t key, IDType id) {staged_.emplace_back(key, id);}
+    void reserve(size_t n) {staged_.reserve(staged_.size() + n);}
+    template<typename F>
+    void for_bucket(uint64_t key, const F &func) const {
+        auto it = buckets_.find(key);
+        if(it != buckets_.end())
+            func(&ids_[offsets_[it->second]], &ids_[offsets_[it->second + 1]]);
+    }
+    size_t nbuckets() const {return buckets_.size();}
+    size_t size() const {return ids_.size();}
+    // CSR arrays plus one (key, bucket) pair per bucket; hash table slack is not counted.
+    size_t memory_bytes() const {
+        return ids_.size() * sizeof(IDType) + offsets_.size() * sizeof(size_t)
+             + buckets_.size() * sizeof(std::pair<uint64_t, uint32_t>) + staged_.size() * sizeof(staged_[0]);
+    }
+    void freeze() {
+        if(staged_.empty()) return;
+        staged_.reserve(staged_.size() + ids_.size());
+        for(const auto &pair: buckets_)
+            for(size_t i = offsets_[pair.second]; i < offsets_[pair.second + 1]; ++i)
+                staged_.emplace_back(pair.first, ids_[i]);
+        std::sort(staged_.begin(), staged_.end());
+        buckets_.clear();
+        ids_.resize(staged_.size());
+        offsets_.clear();
+        for(size_t i = 0; i < staged_.size(); ++i) {
+            if(i == 0 || staged_[i].first != staged_[i - 1].first) {
+                buckets_.emplace(staged_[i].first, uint32_t(offsets_.size()));
+                offsets_.push_back(i);
+            }
+            ids_[i] = staged_[i].second;
+        }
+        offsets_.push_back(staged_.size());
+        std::vector<std::pair<uint64_t, IDType>>().swap(staged_);
+    }
+};
+
+/*
+ * LSHIndex: L independent tables, each keyed by K concatenated sign bits (K <= 64).
+ * The L * K hyperplanes are stacked into one matrix, so hashing a point or a batch for every table
+ * is a single matrix product. Points are staged until freeze(), which lays each table out CSR-style
+ * (bucket -> [offsets[b], offsets[b + 1]) in one contiguous id array).
+ * Queries gather candidates from all tables, deduplicate them and re-rank by exact Euclidean distance
+ * against an owned copy of the points. For cosine similarity, normalize inputs before adding.
+ * quantize() replaces that copy (or fronts it) with compressed codes; see DCI::quantize.
+ */
+template<typename FType=float, typename IDType=uint32_t>
+class LSHIndex {
+public:
+    using result_type = std::pair<FType, IDType>; // (distance, id)
+    using hasher_type = MatrixLSHasher<FType, blaze::rowMajor>;
+private:
+    unsigned ntables_, nbits_;
+    size_t dim_, n_;
+    hasher_type hasher_;
+    std::vector<BucketTable<IDType>> tables_;
+    std::vector<FType> data_; // Row-major copy of the points, used for re-ranking.
+    bool frozen_;
+    quant::QuantizedStore<FType> codes_;
+    unsigned exact_rerank_ = 0;
+
+    static void check_params(unsigned ntables, unsigned nbits) {
+        if(nbits == 0 || nbits > 64 || ntables == 0) {
+            char buf[256];
+            std::sprintf(buf, "LSHIndex requires 1 <= nbits <= 64 and ntables > 0 (got nbits = %u, ntables = %u)", nbits, ntables);
+            throw std::runtime_error(buf);
+        }
+    }
+    auto cv(const FType *p) const {return blaze::CustomVector<const FType, blaze::unaligned, blaze::unpadded>(p, dim_);}
+    void stage(const FType *proj, IDType id) {
+        for(unsigned t = 0; t < ntables_; ++t)
+            tables_[t].stage(cmp2hash(proj + size_t(t) * nbits_, nbits_), id);
+    }
+    struct Scratch {
+        std::vector<IDType> cand, shortlist;
+        std::vector<uint64_t> keys;
+        std::vector<std::pair<FType, uint32_t>> order;
+        std::vector<float> table;
+        std::vector<result_type> approx;
+    };
+    std::vector<result_type> query_projected(const FType *x, const FType *proj, unsigned k, unsigned nprobes, Scratch &scratch) const {
+        auto &cand = scratch.cand;
+        cand.clear();
+        for(unsigned t = 0; t < ntables_; ++t) {
+            srp_probes(proj + size_t(t) * nbits_, nbits_, nprobes, scratch.keys, scratch.order);
+            for(const auto key: scratch.keys)
+                tables_[t].for_bucket(key, [&](const IDType *b, const IDType *e) {
+                    cand.insert(cand.end(), b, e);
+                });
+        }
+        std::sort(cand.begin(), cand.end());
+        cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
+        return rerank(x, cand, k, scratch);
+    }
+    // Ranks by code when quantized, passing the best max(k, exact_rerank_) on to exact distances if points are kept.
+    std::vector<result_type> rerank(const FType *x, const std::vector<IDType> &cand, unsigned k, Scratch &scratch) const {
+        const std::vector<IDType> *ids = &cand;
+        if(quantized()) {
+            const size_t kk = std::max<size_t>(k, exact_rerank_);
+            auto &approx = scratch.approx;
+            scratch.table.resize(codes_.table_size());
+            codes_.prepare(x, scratch.table.data());
+            approx.resize(cand.size());
+            for(size_t i = 0; i < cand.size(); ++i)
+                approx[i] = result_type(codes_.distance(scratch.table.data(), cand[i]), cand[i]);
+            if(approx.size() > kk) {
+                std::nth_element(approx.begin(), approx.begin() + kk, approx.end());
+                approx.resize(kk);
+            }
+            if(!exact_rerank_) {
+                std::sort(approx.begin(), approx.end());
+                for(auto &r: approx) r.first = std::sqrt(r.first);
+                return approx;
+            }
+            scratch.shortlist.resize(approx.size());
+            for(size_t i = 0; i < approx.size(); ++i) scratch.shortlist[i] = approx[i].second;
+            ids = &scratch.shortlist;
+        }
+        std::vector<result_type> ret(ids->size());
+        const auto q = cv(x);
+        for(size_t i = 0; i < ids->size(); ++i)
+            ret[i] = result_type(blaze::sqrNorm(cv(point((*ids)[i])) - q), (*ids)[i]);
+        if(ret.size() > k) {
+            std::nth_element(ret.begin(), ret.begin() + k, ret.end());
+            ret.resize(k);
+        }
+        std::sort(ret.begin(), ret.end());
+        for(auto &r: ret) r.first = std::sqrt(r.first);
+        return ret;
+    }
+public:
+    LSHIndex(size_t dim, unsigned ntables, unsigned nbits, uint64_t seed=0):
+        ntables_(ntables), nbits_(nbits), dim_(dim), n_(0),
+        hasher_((check_params(ntables, nbits), size_t(ntables) * nbits), dim, false, seed),
+        tables_(ntables), frozen_(true) {}
+    size_t size() const {return n_;}
+    size_t dim() const {return dim_;}
+    unsigned ntables() const {return ntables_;}
+    unsigned nbits() const {return nbits_;}
+    bool frozen() const {return frozen_;}
+    size_t nbuckets(unsigned t) const {return tables_[t].nbuckets();}
+    const hasher_type &hasher() const {return hasher_;}
+    const FType *point(IDType id) const {return &data_[size_t(id) * dim_];}
+    const auto &codes() const {return codes_;}
+    unsigned exact_rerank() const {return exact_rerank_;}
+    bool quantized() const {return codes_.type() != quant::NO_QUANTIZATION;}
+    bool needs_points() const {return !quantized() || exact_rerank_;}
+    // Bytes held by the tables, the copy of the points and the codes; the hyperplanes are not counted.
+    size_t memory_bytes() const {
+        size_t ret = data_.size() * sizeof(FType) + codes_.bytes();
+        for(const auto &table: tables_) ret += table.memory_bytes();
+        return ret;
+    }
+    // Encodes every point with a trained store. With exact_rerank == 0, the full-precision copy is freed and
+    // later points are stored only as codes.
+    void quantize(quant::QuantizedStore<FType> store, unsigned exact_rerank=0) {
+        if(!store.trained()) throw std::runtime_error("LSHIndex::quantize requires a trained QuantizedStore");
+        if(!needs_points()) throw std::runtime_error("LSHIndex points were already released by quantize(store, 0)");
+        store.clear();
+        store.reserve(n_);
+        for(size_t i = 0; i < n_; ++i) store.add(point(i));
+        codes_ = std::move(store);
+        exact_rerank_ = exact_rerank;
+        if(!exact_rerank) std::vector<FType>().swap(data_);
+    }
+
+    // Hashes of x for every table.
+    template<typename VT>
+    std::vector<uint64_t> hash(const VT &x) const {
+        blaze::DynamicVector<FType> proj = hasher_.matrix() * cv(&x[0]);
+        std::vector<uint64_t> ret(ntables_);
+        for(unsigned t = 0; t < ntables_; ++t) ret[t] = cmp2hash(&proj[size_t(t) * nbits_], nbits_);
+        return ret;
+    }
+    template<typename VT>
+    IDType add(const VT &x) {
+        const IDType id = n_++;
+        if(quantized()) codes_.add(&x[0]);
+        if(needs_points()) data_.insert(data_.end(), &x[0], &x[0] + dim_);
+        blaze::DynamicVector<FType> proj = hasher_.matrix() * cv(&x[0]);
+        stage(&proj[0], id);
+        frozen_ = false;
+        return id;
+    }
+    // Hashes the whole batch with one GEMM. Returns the id of the first row.
+    template<typename MT>
+    IDType add_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &mat) {
+        const auto &m = ~mat;
+        if(m.columns() != dim_) throw std::runtime_error("Wrong number of columns for LSHIndex::add_batch");
+        const IDType start = n_;
+        blaze::DynamicMatrix<FType> proj = m * trans(hasher_.matrix());
+        if(quantized()) codes_.add_batch(m);
+        if(needs_points()) {
+            data_.resize((n_ + m.rows()) * dim_);
+            OMP_PRAGMA("omp parallel for")
+            for(size_t i = 0; i < m.rows(); ++i)
+                std::copy(&m(i, 0), &m(i, 0) + dim_, &data_[(n_ + i) * dim_]);
+        }
+        OMP_PRAGMA("omp parallel for")
+        for(unsigned t = 0; t < ntables_; ++t) {
+            tables_[t].reserve(m.rows());
+            for(size_t i = 0; i < m.rows(); ++i)
+                tables_[t].stage(cmp2hash(&proj(i, size_t(t) * nbits_), nbits_), IDType(start + i));
+        }
+        n_ += m.rows();
+        frozen_ = false;
+        return start;
+    }
+    // Merges staged points into the contiguous bucket arrays. Must be called before querying.
+    void freeze() {
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(unsigned t = 0; t < ntables_; ++t)
+            tables_[t].freeze();
+        frozen_ = true;
+    }
+    // Distances to candidate ids, returning the k nearest in increasing order.
+    std::vector<result_type> rerank(const FType *x, const std::vector<IDType> &cand, unsigned k) const {
+        Scratch scratch;
+        return rerank(x, cand, k, scratch);
+    }
+    // nprobes buckets are visited per table (multi-probe LSH), ordered by how likely they are to hold neighbors.
+    template<typename VT>
+    std::vector<result_type> query(const VT &x, unsigned k, unsigned nprobes=1) const {
+        if(!frozen_) throw std::runtime_error("LSHIndex must be frozen before querying");
+        blaze::DynamicVector<FType> proj = hasher_.matrix() * cv(&x[0]);
+        Scratch scratch;
+        return query_projected(&x[0], &proj[0], k, nprobes, scratch);
+    }
+    // Projects all queries with one GEMM and serves them in parallel, reusing scratch buffers per thread.
+    template<typename MT>
+    std::vector<std::vector<result_type>> query_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &queries, unsigned k, unsigned nprobes=1) const {
+        if(!frozen_) throw std::runtime_error("LSHIndex must be frozen before querying");
+        const auto &q = ~queries;
+        if(q.columns() != dim_) throw std::runtime_error("Wrong number of columns for LSHIndex::query_batch");
+        blaze::DynamicMatrix<FType> proj = q * trans(hasher_.matrix());
+        std::vector<std::vector<result_type>> ret(q.rows());
+        OMP_PRAGMA("omp parallel")
+        {
+            Scratch scratch;
+            OMP_PRAGMA("omp for schedule(dynamic, 16)")
+            for(size_t i = 0; i < q.rows(); ++i)
+                ret[i] = query_projected(&q(i, 0), &proj(i, 0), k, nprobes, scratch);
+        }
+        return ret;
+    }
+};
+
+/*
+ * ConcurrentLSHIndex: the SRP tables of LSHIndex, accepting inserts from many threads while serving lock-free queries.
+ * Ids come from an atomic counter. Rows are copied into fixed-size chunks which never move, so any published id
+ * can be dereferenced. Each table is a fixed array of slots, each heading a list of buckets pushed by CAS.
+ * A bucket is a chain of append-only segments, newest first, each twice the size of the last:
+ * writers reserve an entry with fetch_add and store the id with release semantics, installing a larger segment
+ * by CAS when one fills. Readers scan the reserved prefix of each segment and skip entries not yet written.
+ * Nothing is unlinked or freed while the index is alive, so no epoch-based reclamation is needed.
+ */
+template<typename FType=float, typename IDType=uint32_t>
+class ConcurrentLSHIndex {
+public:
+    using result_type = std::pair<FType, IDType>; // (distance, id)
+    using hasher_type = MatrixLSHasher<FType, blaze::rowMajor>;
+    static constexpr IDType EMPTY = std::numeric_limits<IDType>::max();
+private:
+    static constexpr uint32_t INITIAL_SEGMENT = 4, MAX_SEGMENT = 1u << 20;
+    static constexpr size_t CHUNK_SHIFT = 12, CHUNK_SIZE = size_t(1) << CHUNK_SHIFT;
+    struct Segment {
+        const uint32_t capacity_;
+        std::atomic<uint32_t> reserved_;
+        Segment *const next_;
+        std::unique_ptr<std::atomic<IDType>[]> ids_;
+        Segment(uint32_t capacity, Segment *next): capacity_(capacity), reserved_(0), next_(next), ids_(new std::atomic<IDType>[capacity]) {
+            for(uint32_t i = 0; i < capacity; ++i) ids_[i].store(EMPTY, std::memory_order_relaxed);
+        }
+    };
+    struct Bucket {
+        const uint64_t key_;
+        Bucket *const next_;
+        std::atomic<Segment *> head_;
+        Bucket(uint64_t key, Bucket *next, IDType id): key_(key), next_(next), head_(new Segment(INITIAL_SEGMENT, nullptr)) {
+            Segment *s = head_.load(std::memory_order_relaxed);
+            s->ids_[0].store(id, std::memory_order_relaxed);
+            s->reserved_.store(1, std::memory_order_relaxed);
+        }
+        ~Bucket() {
+            for(Segment *s = head_.load(), *n; s; s = n) n = s->next_, delete s;
+        }
+        void append(IDType id) {
+            for(;;) {
+                Segment *s = head_.load(std::memory_order_acquire);
+                const uint32_t pos = s->reserved_.fetch_add(1, std::memory_order_relaxed);
+                if(pos < s->capacity_) {
+                    s->ids_[pos].store(id, std::memory_order_release);
+                    return;
+                }
+                Segment *grown = new Segment(std::min(s->capacity_ * 2, MAX_SEGMENT), s);
+                if(!head_.compare_exchange_strong(s, grown, std::memory_order_acq_rel)) delete grown;
+            }
+        }
+        template<typename F>
+        void for_each(const F &func) const {
+            for(const Segment *s = head_.load(std::memory_order_acquire); s; s = s->next_) {
+                const uint32_t n = std::min(s->reserved_.load(std::memory_order_acquire), s->capacity_);
+                for(uint32_t i = 0; i < n; ++i) {
+                    const IDType id = s->ids_[i].load(std::memory_order_acquire);
+                    if(id != EMPTY) func(id);
+                }
+            }
+        }
+    };
+    struct Table {
+        unsigned shift_;
+        std::unique_ptr<std::atomic<Bucket *>[]> slots_;
+        Table(unsigned logslots): shift_(64 - logslots), slots_(new std::atomic<Bucket *>[size_t(1) << logslots]) {
+            for(size_t i = 0; i < (size_t(1) << logslots); ++i) slots_[i].store(nullptr, std::memory_order_relaxed);
+        }
+        Table(Table &&o) = default;
+        ~Table() {
+            if(!slots_) return;
+            for(size_t i = 0; i < (size_t(1) << (64 - shift_)); ++i)
+                for(Bucket *b = slots_[i].load(), *n; b; b = n) n = b->next_, delete b;
+        }
+        std::atomic<Bucket *> &slot(uint64_t key) const {return slots_[(key * 0x9E3779B97F4A7C15ull) >> shift_];}
+        const Bucket *find(uint64_t key) const {
+            for(const Bucket *b = slot(key).load(std::memory_order_acquire); b; b = b->next_)
+                if(b->key_ == key) return b;
+            return nullptr;
+        }
+        void insert(uint64_t key, IDType id) {
+            auto &head = slot(key);
+            Bucket *h = head.load(std::memory_order_acquire);
+            for(;;) {
+                for(Bucket *b = h; b; b = b->next_) {
+                    if(b->key_ == key) {
+                        b->append(id);
+                        return;
+                    }
+                }
+                Bucket *nb = new Bucket(key, h, id);
+                if(head.compare_exchange_strong(h, nb, std::memory_order_acq_rel, std::memory_order_acquire)) return;
+                delete nb; // Another writer pushed a bucket, possibly for this key: rescan.
+            }
+        }
+    };
+    unsigned ntables_, nbits_;
+    size_t dim_, capacity_;
+    hasher_type hasher_;
+    std::vector<Table> tables_;
+    std::unique_ptr<std::atomic<FType *>[]> chunks_;
+    std::atomic<size_t> n_;
+
+    auto cv(const FType *p) const {return blaze::CustomVector<const FType, blaze::unaligned, blaze::unpadded>(p, dim_);}
+    size_t nchunks() const {return (capacity_ + CHUNK_SIZE - 1) / CHUNK_SIZE;}
+    FType *chunk(size_t c) {
+        FType *p = chunks_[c].load(std::memory_order_acquire);
+        if(p) return p;
+        FType *np = new FType[CHUNK_SIZE * dim_];
+        if(chunks_[c].compare_exchange_strong(p, np, std::memory_order_acq_rel)) return np;
+        delete[] np;
+        return p;
+    }
+public:
+    // expected_size sizes the slot arrays; capacity bounds the number of points.
+    ConcurrentLSHIndex(size_t dim, unsigned ntables, unsigned nbits, uint64_t seed=0,
+                       size_t expected_size=size_t(1) << 20, size_t capacity=size_t(1) << 28):
+        ntables_(ntables), nbits_(nbits), dim_(dim), capacity_(capacity),
+        hasher_(size_t(ntables) * nbits, dim, false, seed),
+        chunks_(new std::atomic<FType *>[(capacity + CHUNK_SIZE - 1) / CHUNK_SIZE]), n_(0)
+    {
+        if(nbits == 0 || nbits > 64 || ntables == 0) {
+            char buf[256];
+            std::sprintf(buf, "ConcurrentLSHIndex requires 1 <= nbits <= 64 and ntables > 0 (got nbits = %u, ntables = %u)", nbits, ntables);
+            throw std::runtime_error(buf);
+        }
+        unsigned logslots = 10;
+        while(logslots < 30 && logslots < nbits && (size_t(1) << logslots) < expected_size) ++logslots;
+        tables_.reserve(ntables);
+        while(tables_.size() < ntables) tables_.emplace_back(logslots);
+        for(size_t i = 0; i < nchunks(); ++i) chunks_[i].store(nullptr, std::memory_order_relaxed);
+    }
+    ~ConcurrentLSHIndex() {
+        for(size_t i = 0; i < nchunks(); ++i) delete[] chunks_[i].load();
+    }
+    // Number of ids handed out; the most recent may not be visible to queries yet.
+    size_t size() const {return std::min(n_.load(std::memory_order_relaxed), capacity_);}
+    size_t dim() const {return dim_;}
+    unsigned ntables() const {return ntables_;}
+    unsigned nbits() const {return nbits_;}
+    const FType *point(IDType id) const {
+        return chunks_[id >> CHUNK_SHIFT].load(std::memory_order_acquire) + (id & (CHUNK_SIZE - 1)) * dim_;
+    }
+    // Thread-safe. The point becomes visible to queries table by table as its id is published.
+    template<typename VT>
+    IDType add(const VT &x) {
+        const size_t id = n_.fetch_add(1, std::memory_order_relaxed);
+        if(id >= capacity_) throw std::runtime_error("ConcurrentLSHIndex is full");
+        std::copy(&x[0], &x[0] + dim_, chunk(id >> CHUNK_SHIFT) + (id & (CHUNK_SIZE - 1)) * dim_);
+        blaze::DynamicVector<FType> proj = hasher_.matrix() * cv(&x[0]);
+        for(unsigned t = 0; t < ntables_; ++t)
+            tables_[t].insert(cmp2hash(&proj[size_t(t) * nbits_], nbits_), IDType(id));
+        return id;
+    }
+    // Thread-safe and lock-free; may run concurrently with add.
+    template<typename VT>
+    std::vector<result_type> query(const VT &x, unsigned k, unsigned nprobes=1) const {
+        blaze::DynamicVector<FType> proj = hasher_.matrix() * cv(&x[0]);
+        std::vector<IDType> cand;
+        std::vector<uint64_t> keys;
+        std::vector<std::pair<FType, uint32_t>> order;
+        for(unsigned t = 0; t < ntables_; ++t) {
+            srp_probes(&proj[size_t(t) * nbits_], nbits_, nprobes, keys, order);
+            for(const auto key: keys)
+                if(const Bucket *b = tables_[t].find(key))
+                    b->for_each([&](IDType id) {cand.push_back(id);});
+        }
+        std::sort(cand.begin(), cand.end());
+        cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
+        std::vector<result_type> ret(cand.size());
+        const auto q = cv(&x[0]);
+        for(size_t i = 0; i < cand.size(); ++i)
+            ret[i] = result_type(blaze::sqrNorm(cv(point(cand[i])) - q), cand[i]);
+        if(ret.size() > k) {
+            std::nth_element(ret.begin(), ret.begin() + k, ret.end());
+            ret.resize(k);
+        }
+        std::sort(ret.begin(), ret.end());
+        for(auto &r: ret) r.first = std::sqrt(r.first);
+        return ret;
+    }
+};
+
 } // frp
 
 #endif
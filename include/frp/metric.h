@@ -0,0 +1,138 @@
+#ifndef _GFRP_METRIC_H__
+#define _GFRP_METRIC_H__
+#include <immintrin.h>
+#include "frp/util.h"
+
+namespace frp {
+
+namespace metric {
+
+/*
+ * Fused SIMD distance kernels over raw rows: squared L2, dot product and squared norm, with two accumulators
+ * to hide FMA latency. Rows zero-padded to a multiple of the vector width (e.g., DCI-owned storage) skip the scalar tail.
+ */
+template<typename FT> struct SIMDOps;
+#if __AVX512F__
+template<> struct SIMDOps<float> {
+    using V = __m512;
+    static constexpr size_t N = 16;
+    static V zero() {return _mm512_setzero_ps();}
+    static V load(const float *p) {return _mm512_loadu_ps(p);}
+    static V sub(V a, V b) {return _mm512_sub_ps(a, b);}
+    static V fmadd(V a, V b, V c) {return _mm512_fmadd_ps(a, b, c);}
+    static V add(V a, V b) {return _mm512_add_ps(a, b);}
+    static float sum(V a) {return _mm512_reduce_add_ps(a);}
+};
+template<> struct SIMDOps<double> {
+    using V = __m512d;
+    static constexpr size_t N = 8;
+    static V zero() {return _mm512_setzero_pd();}
+    static V load(const double *p) {return _mm512_loadu_pd(p);}
+    static V sub(V a, V b) {return _mm512_sub_pd(a, b);}
+    static V fmadd(V a, V b, V c) {return _mm512_fmadd_pd(a, b, c);}
+    static V add(V a, V b) {return _mm512_add_pd(a, b);}
+    static double sum(V a) {return _mm512_reduce_add_pd(a);}
+};
+#elif __AVX__
+template<> struct SIMDOps<float> {
+    using V = __m256;
+    static constexpr size_t N = 8;
+    static V zero() {return _mm256_setzero_ps();}
+    static V load(const float *p) {return _mm256_loadu_ps(p);}
+    static V sub(V a, V b) {return _mm256_sub_ps(a, b);}
+#if __FMA__
+    static V fmadd(V a, V b, V c) {return _mm256_fmadd_ps(a, b, c);}
+#else
+    static V fmadd(V a, V b, V c) {return _mm256_add_ps(_mm256_mul_ps(a, b), c);}
+#endif
+    static V add(V a, V b) {return _mm256_add_ps(a, b);}
+    static float sum(V a) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+    }
+};
+template<> struct SIMDOps<double> {
+    using V = __m256d;
+    static constexpr size_t N = 4;
+    static V zero() {return _mm256_setzero_pd();}
+    static V load(const double *p) {return _mm256_loadu_pd(p);}
+    static V sub(V a, V b) {return _mm256_sub_pd(a, b);}
+#if __FMA__
+    static V fmadd(V a, V b, V c) {return _mm256_fmadd_pd(a, b, c);}
+#else
+    static V fmadd(V a, V b, V c) {return _mm256_add_pd(_mm256_mul_pd(a, b), c);}
+#endif
+    static V add(V a, V b) {return _mm256_add_pd(a, b);}
+    static double sum(V a) {
+        const __m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+};
+#endif
+
+template<typename FT>
+static INLINE FT sqrl2(const FT *a, const FT *b, size_t n) {
+    FT ret = 0;
+    size_t i = 0;
+#if __AVX512F__ || __AVX__
+    using O = SIMDOps<FT>;
+    constexpr size_t N = O::N;
+    if(n >= N) {
+        auto acc0 = O::zero(), acc1 = O::zero();
+        for(; i + 2 * N <= n; i += 2 * N) {
+            const auto d0 = O::sub(O::load(a + i), O::load(b + i)), d1 = O::sub(O::load(a + i + N), O::load(b + i + N));
+            acc0 = O::fmadd(d0, d0, acc0);
+            acc1 = O::fmadd(d1, d1, acc1);
+        }
+        if(i + N <= n) {
+            const auto d = O::sub(O::load(a + i), O::load(b + i));
+            acc0 = O::fmadd(d, d, acc0);
+            i += N;
+        }
+        ret = O::sum(O::add(acc0, acc1));
+    }
+#endif
+    for(; i < n; ++i) ret += (a[i] - b[i]) * (a[i] - b[i]);
+    return ret;
+}
+
+template<typename FT>
+static INLINE FT dot(const FT *a, const FT *b, size_t n) {
+    FT ret = 0;
+    size_t i = 0;
+#if __AVX512F__ || __AVX__
+    using O = SIMDOps<FT>;
+    constexpr size_t N = O::N;
+    if(n >= N) {
+        auto acc0 = O::zero(), acc1 = O::zero();
+        for(; i + 2 * N <= n; i += 2 * N) {
+            acc0 = O::fmadd(O::load(a + i), O::load(b + i), acc0);
+            acc1 = O::fmadd(O::load(a + i + N), O::load(b + i + N), acc1);
+        }
+        if(i + N <= n) {
+            acc0 = O::fmadd(O::load(a + i), O::load(b + i), acc0);
+            i += N;
+        }
+        ret = O::sum(O::add(acc0, acc1));
+    }
+#endif
+    for(; i < n; ++i) ret += a[i] * b[i];
+    return ret;
+}
+
+template<typename FT>
+static INLINE FT sqrnorm(const FT *a, size_t n) {return dot(a, a, n);}
+
+// Prefetches the cache lines of a row of n elements into L1.
+template<typename FT>
+static INLINE void prefetch(const FT *p, size_t n) {
+    const char *c = reinterpret_cast<const char *>(p), *e = reinterpret_cast<const char *>(p + n);
+    for(; c < e; c += 64) _mm_prefetch(c, _MM_HINT_T0);
+}
+
+} // namespace metric
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_METRIC_H__
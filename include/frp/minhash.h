@@ -0,0 +1,265 @@
+#ifndef _GFRP_MINHASH_H__
+#define _GFRP_MINHASH_H__
+#include <immintrin.h>
+#include "frp/lsh.h"
+
+namespace frp {
+
+namespace minhash {
+
+/*
+ * Set similarity sketches. Elements are 64-bit ids (e.g., the nonzero indices of a sparse vector,
+ * or mclhasher hashes of strings); every sketch is a signature of k uint64_t registers,
+ * and two signatures agree in each register with probability equal to the (weighted) Jaccard similarity.
+ *
+ * OnePermutationMinHash: one hash per element, binned into k registers, with optimal densification for empty bins.
+ * KMinHash:              k independent 32-bit multiply-shift hashes per element, reduced with a SIMD min.
+ * ICWS:                  Improved Consistent Weighted Sampling (Ioffe, 2010) for nonnegative weighted sets.
+ * pack_bbit/bbit_similarity: b-bit MinHash (Li and Konig, 2010).
+ * MinHashLSH:            banding into BucketTables for candidate generation.
+ */
+
+static constexpr uint64_t EMPTY = std::numeric_limits<uint64_t>::max();
+
+static INLINE uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    return x ^ (x >> 33);
+}
+static INLINE uint64_t hash64(uint64_t x, uint64_t seed) {return mix64(x ^ mix64(seed + 0x9E3779B97F4A7C15ull));}
+static INLINE uint64_t reduce(uint64_t x, uint64_t n) {return (__uint128_t(x) * n) >> 64;}
+// Uniform double in (0, 1).
+static INLINE double to_unit(uint64_t x) {return ((x >> 11) + .5) * 0x1p-53;}
+
+template<typename Vector>
+std::vector<uint64_t> nonzero_indices(const Vector &x) {
+    std::vector<uint64_t> ret;
+    for_each_nz(x, [&](auto i, auto) {ret.push_back(i);});
+    return ret;
+}
+
+class OnePermutationMinHash {
+    unsigned k_;
+    uint64_t seed_;
+public:
+    OnePermutationMinHash(unsigned k, uint64_t seed=0): k_(k), seed_(seed) {}
+    unsigned k() const {return k_;}
+    template<typename It>
+    void sketch(It begin, It end, uint64_t *out) const {
+        std::fill(out, out + k_, EMPTY);
+        for(; begin != end; ++begin) {
+            const uint64_t h = hash64(*begin, seed_);
+            auto &reg = out[reduce(h, k_)]; // Bin by the high bits; within a bin, the minimum hash is the minimum of the low bits.
+            reg = std::min(reg, h);
+        }
+        densify(out);
+    }
+    template<typename Vector>
+    void sketch_nz(const Vector &x, uint64_t *out) const {
+        const auto idx = nonzero_indices(x);
+        sketch(idx.begin(), idx.end(), out);
+    }
+    // Optimal densification (Shrivastava, 2017): each empty bin copies the first originally-filled bin
+    // hit by its own hash sequence, so similar sets fill empty bins consistently.
+    void densify(uint64_t *out) const {
+        std::vector<uint8_t> filled(k_);
+        size_t nfilled = 0;
+        for(unsigned i = 0; i < k_; ++i) nfilled += (filled[i] = out[i] != EMPTY);
+        if(nfilled == 0 || nfilled == k_) return;
+        for(unsigned i = 0; i < k_; ++i) {
+            if(filled[i]) continue;
+            for(uint64_t attempt = 0;; ++attempt) {
+                const size_t j = reduce(hash64((uint64_t(i) << 32) | attempt, ~seed_), k_);
+                if(filled[j]) {
+                    out[i] = out[j];
+                    break;
+                }
+            }
+        }
+    }
+};
+
+class KMinHash {
+    unsigned k_;
+    std::vector<uint64_t> a_, b_; // Register j hashes x to (a_j * x + b_j) >> 32 for 32-bit x.
+public:
+    KMinHash(unsigned k, uint64_t seed=0): k_(k), a_(k), b_(k) {
+        for(unsigned j = 0; j < k; ++j) {
+            a_[j] = hash64(2 * j, seed) | 1;
+            b_[j] = hash64(2 * j + 1, seed);
+        }
+    }
+    unsigned k() const {return k_;}
+    // Lowers registers out[0:k) with the hashes of one element. Each 64-bit lane keeps a 32-bit hash.
+    void update(uint64_t element, uint64_t *out) const {
+        const uint32_t x = static_cast<uint32_t>(mix64(element));
+        size_t j = 0;
+#if __AVX512F__
+        const __m512i vx = _mm512_set1_epi64(x);
+        for(; j + 8 <= k_; j += 8) {
+            const __m512i a = _mm512_loadu_si512(&a_[j]);
+            const __m512i prod = _mm512_add_epi64(_mm512_mul_epu32(a, vx), _mm512_slli_epi64(_mm512_mul_epu32(_mm512_srli_epi64(a, 32), vx), 32));
+            const __m512i h = _mm512_srli_epi64(_mm512_add_epi64(prod, _mm512_loadu_si512(&b_[j])), 32);
+            _mm512_storeu_si512(out + j, _mm512_min_epu64(h, _mm512_loadu_si512(out + j)));
+        }
+#elif __AVX2__
+        const __m256i vx = _mm256_set1_epi64x(x);
+        for(; j + 4 <= k_; j += 4) {
+            const __m256i a = _mm256_loadu_si256((const __m256i *)&a_[j]);
+            const __m256i prod = _mm256_add_epi64(_mm256_mul_epu32(a, vx), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), vx), 32));
+            const __m256i h = _mm256_srli_epi64(_mm256_add_epi64(prod, _mm256_loadu_si256((const __m256i *)&b_[j])), 32);
+            // Upper halves are zero, so an unsigned 32-bit min is a 64-bit min.
+            _mm256_storeu_si256((__m256i *)(out + j), _mm256_min_epu32(h, _mm256_loadu_si256((const __m256i *)(out + j))));
+        }
+#endif
+        for(; j < k_; ++j) out[j] = std::min(out[j], (a_[j] * x + b_[j]) >> 32);
+    }
+    template<typename It>
+    void sketch(It begin, It end, uint64_t *out) const {
+        std::fill(out, out + k_, EMPTY >> 32);
+        for(; begin != end; ++begin) update(*begin, out);
+    }
+    template<typename Vector>
+    void sketch_nz(const Vector &x, uint64_t *out) const {
+        std::fill(out, out + k_, EMPTY >> 32);
+        for_each_nz(x, [&](auto i, auto) {update(i, out);});
+    }
+};
+
+class ICWS {
+    unsigned k_;
+    uint64_t seed_;
+public:
+    ICWS(unsigned k, uint64_t seed=0): k_(k), seed_(seed) {}
+    unsigned k() const {return k_;}
+    // pairs of (element, weight > 0); nonpositive weights are ignored.
+    template<typename It>
+    void sketch(It begin, It end, uint64_t *out) const {
+        std::vector<double> best(k_, std::numeric_limits<double>::max());
+        std::fill(out, out + k_, EMPTY);
+        for(; begin != end; ++begin) {
+            const uint64_t i = begin->first;
+            const double w = begin->second;
+            if(w <= 0.) continue;
+            const double lw = std::log(w);
+            for(unsigned j = 0; j < k_; ++j) {
+                // r, c ~ Gamma(2, 1) and beta ~ U(0, 1), consistent across sets for each (element, sample).
+                const uint64_t h = hash64(i, seed_ + j);
+                const double r = -std::log(to_unit(h) * to_unit(mix64(h + 1)));
+                const double c = -std::log(to_unit(mix64(h + 2)) * to_unit(mix64(h + 3)));
+                const double beta = to_unit(mix64(h + 4));
+                const double t = std::floor(lw / r + beta);
+                const double lna = std::log(c) - r * (t - beta) - r; // ln(c / (y * exp(r))), y = exp(r * (t - beta))
+                if(lna < best[j]) {
+                    best[j] = lna;
+                    out[j] = hash64(i, uint64_t(int64_t(t)));
+                }
+            }
+        }
+    }
+    template<typename Vector>
+    void sketch_nz(const Vector &x, uint64_t *out) const {
+        std::vector<std::pair<uint64_t, double>> pairs;
+        for_each_nz(x, [&](auto i, auto v) {pairs.emplace_back(i, double(v));});
+        sketch(pairs.begin(), pairs.end(), out);
+    }
+};
+
+// Fraction of registers on which two signatures agree: an unbiased estimate of (weighted) Jaccard similarity.
+static inline double similarity(const uint64_t *a, const uint64_t *b, size_t k) {
+    size_t eq = 0;
+    size_t i = 0;
+#if __AVX512F__
+    for(; i + 8 <= k; i += 8)
+        eq += __builtin_popcount(_mm512_cmpeq_epi64_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+#elif __AVX2__
+    for(; i + 4 <= k; i += 4)
+        eq += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i))))));
+#endif
+    for(; i < k; ++i) eq += a[i] == b[i];
+    return double(eq) / k;
+}
+
+// b-bit MinHash: keeps the lowest b bits (b in {1, 2, 4, 8, 16, 32}) of each register, packed 64 / b per word.
+static inline size_t bbit_words(size_t k, unsigned b) {return (k * b + 63) / 64;}
+static inline void pack_bbit(const uint64_t *sig, size_t k, unsigned b, uint64_t *out) {
+    if(b == 0 || b > 32 || (b & (b - 1))) throw std::runtime_error("b-bit MinHash requires b in {1, 2, 4, 8, 16, 32}");
+    const uint64_t mask = (uint64_t(1) << b) - 1;
+    std::fill(out, out + bbit_words(k, b), uint64_t(0));
+    for(size_t i = 0; i < k; ++i)
+        out[i * b / 64] |= (mix64(sig[i]) & mask) << (i * b % 64);
+}
+// Jaccard estimate from b-bit signatures, correcting for chance b-bit collisions (assuming small sets relative to the universe).
+static inline double bbit_similarity(const uint64_t *a, const uint64_t *b, size_t k, unsigned bits) {
+    uint64_t low = 0; // Lowest bit of every field
+    for(unsigned s = 0; s < 64; s += bits) low |= uint64_t(1) << s;
+    size_t mismatches = 0;
+    const size_t nw = bbit_words(k, bits);
+    for(size_t w = 0; w < nw; ++w) {
+        uint64_t x = a[w] ^ b[w];
+        for(unsigned s = 1; s < bits; s <<= 1) x |= x >> s; // OR each field into its lowest bit
+        mismatches += __builtin_popcountll(x & low);
+    }
+    const double match = 1. - double(mismatches) / k, chance = std::ldexp(1., -int(bits));
+    return std::max(0., (match - chance) / (1. - chance));
+}
+
+// Band b of a signature: a hash of registers [b * rows, (b + 1) * rows).
+static inline uint64_t band_key(const uint64_t *sig, unsigned band, unsigned rows) {
+    uint64_t h = band;
+    for(unsigned i = 0; i < rows; ++i) h = hash64(sig[band * rows + i], h);
+    return h;
+}
+
+/*
+ * Banded LSH over signatures of nbands * rows registers: two sets collide in a band with probability J^rows,
+ * so the candidate probability 1 - (1 - J^rows)^nbands has its threshold near (1 / nbands)^(1 / rows).
+ * Candidates are verified with the stored signatures.
+ */
+template<typename IDType=uint32_t>
+class MinHashLSH {
+    unsigned nbands_, rows_;
+    std::vector<BucketTable<IDType>> tables_;
+    std::vector<uint64_t> sigs_;
+    size_t n_;
+public:
+    using result_type = std::pair<double, IDType>; // (estimated similarity, id)
+    MinHashLSH(unsigned nbands, unsigned rows): nbands_(nbands), rows_(rows), tables_(nbands), n_(0) {}
+    size_t size() const {return n_;}
+    size_t k() const {return size_t(nbands_) * rows_;}
+    const uint64_t *signature(IDType id) const {return &sigs_[size_t(id) * k()];}
+    IDType add(const uint64_t *sig) {
+        const IDType id = n_++;
+        sigs_.insert(sigs_.end(), sig, sig + k());
+        for(unsigned b = 0; b < nbands_; ++b) tables_[b].stage(band_key(sig, b, rows_), id);
+        return id;
+    }
+    void freeze() {
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(unsigned b = 0; b < nbands_; ++b) tables_[b].freeze();
+    }
+    // Candidates sharing at least one band, with estimated similarity >= threshold, most similar first.
+    std::vector<result_type> query(const uint64_t *sig, double threshold=0.) const {
+        std::vector<IDType> cand;
+        for(unsigned b = 0; b < nbands_; ++b)
+            tables_[b].for_bucket(band_key(sig, b, rows_), [&](const IDType *s, const IDType *e) {cand.insert(cand.end(), s, e);});
+        std::sort(cand.begin(), cand.end());
+        cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
+        std::vector<result_type> ret;
+        for(const auto id: cand) {
+            const double sim = similarity(sig, signature(id), k());
+            if(sim >= threshold) ret.emplace_back(sim, id);
+        }
+        std::sort(ret.begin(), ret.end(), [](const auto &x, const auto &y) {return x.first > y.first || (x.first == y.first && x.second < y.second);});
+        return ret;
+    }
+};
+
+} // namespace minhash
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_MINHASH_H__
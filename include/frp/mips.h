@@ -0,0 +1,97 @@
+#ifndef _GFRP_MIPS_H__
+#define _GFRP_MIPS_H__
+#include "frp/util.h"
+
+namespace frp {
+
+namespace mips {
+
+/*
+ * Asymmetric transforms reducing maximum inner product search to nearest-neighbor search (Bachrach et al., 2014).
+ * Data: P(x) = [x, sqrt(M^2 - ||x||^2)]; queries: Q(q) = [q, 0], with M >= max ||x||.
+ * ||P(x) - Q(q)||^2 = M^2 + ||q||^2 - 2 q . x and cos(P(x), Q(q)) = q . x / (M ||q||), so Euclidean indices (DCI, E2LSH)
+ * and angular ones (SRP through MatrixLSHasher or FHTLSHasher) built over P(data) and queried with Q(q) rank by inner product.
+ * Outputs have dim() = d + 1 columns. Pointer and batch overloads write into caller storage and do not allocate.
+ */
+template<typename FType=float>
+class MIPSTransform {
+    size_t d_;
+    double max_norm_;
+    template<typename MT, typename OMT>
+    void prepare(const MT &in, OMT &out) const {
+        if(in.columns() != d_) {
+            char buf[256];
+            std::sprintf(buf, "MIPSTransform expected %zu columns, got %zu", d_, in.columns());
+            throw std::runtime_error(buf);
+        }
+        if(out.rows() != in.rows() || out.columns() != dim()) out.resize(in.rows(), dim());
+    }
+public:
+    MIPSTransform(size_t d, double max_norm=0.): d_(d), max_norm_(max_norm) {}
+    size_t input_dim() const {return d_;}
+    size_t dim() const {return d_ + 1;}
+    double max_norm() const {return max_norm_;}
+    void set_max_norm(double max_norm) {max_norm_ = max_norm;}
+    // Sets M to the largest row norm of X. Points transformed later with larger norms get an augmentation of 0.
+    template<typename MT>
+    void fit(const blaze::DenseMatrix<MT, blaze::rowMajor> &X) {
+        const auto &m = ~X;
+        double mx = 0.;
+        OMP_PRAGMA("omp parallel for reduction(max:mx)")
+        for(size_t i = 0; i < m.rows(); ++i)
+            mx = std::max(mx, double(blaze::sqrNorm(row(m, i))));
+        max_norm_ = std::sqrt(mx);
+    }
+    void transform_data(const FType *x, FType *out) const {
+        const double sqn = blaze::sqrNorm(blaze::CustomVector<const FType, blaze::unaligned, blaze::unpadded>(x, d_));
+        std::copy(x, x + d_, out);
+        out[d_] = std::sqrt(std::max(0., max_norm_ * max_norm_ - sqn));
+    }
+    void transform_query(const FType *q, FType *out) const {
+        std::copy(q, q + d_, out);
+        out[d_] = 0;
+    }
+    // Transform every row of X into out, which is resized to X.rows() x dim() only if its shape differs.
+    template<typename MT, typename OMT>
+    void transform_data_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, blaze::DenseMatrix<OMT, blaze::rowMajor> &out) const {
+        const auto &m = ~X;
+        auto &o = ~out;
+        prepare(m, o);
+        OMP_PRAGMA("omp parallel for")
+        for(size_t i = 0; i < m.rows(); ++i)
+            transform_data(&m(i, 0), &o(i, 0));
+    }
+    template<typename MT, typename OMT>
+    void transform_query_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, blaze::DenseMatrix<OMT, blaze::rowMajor> &out) const {
+        const auto &m = ~X;
+        auto &o = ~out;
+        prepare(m, o);
+        OMP_PRAGMA("omp parallel for")
+        for(size_t i = 0; i < m.rows(); ++i)
+            transform_query(&m(i, 0), &o(i, 0));
+    }
+    template<typename VT>
+    blaze::DynamicVector<FType> data(const VT &x) const {
+        blaze::DynamicVector<FType> ret(dim());
+        transform_data(&x[0], &ret[0]);
+        return ret;
+    }
+    template<typename VT>
+    blaze::DynamicVector<FType> query(const VT &q) const {
+        blaze::DynamicVector<FType> ret(dim());
+        transform_query(&q[0], &ret[0]);
+        return ret;
+    }
+    // q . x, recovered from the Euclidean distance between P(x) and Q(q) and ||q||^2.
+    double inner_product(double l2dist, double query_sqrnorm) const {
+        return .5 * (max_norm_ * max_norm_ + query_sqrnorm - l2dist * l2dist);
+    }
+};
+
+} // namespace mips
+
+using mips::MIPSTransform;
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_MIPS_H__
@@ -0,0 +1,132 @@
+#ifndef _GFRP_QMC_H__
+#define _GFRP_QMC_H__
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <stdexcept>
+#include <cstdio>
+#include <algorithm>
+#include "frp/util.h"
+
+namespace frp {
+
+namespace qmc {
+
+/*
+ * Randomized one-dimensional low-discrepancy sequences on (0, 1).
+ *
+ * SOBOL:  the base-2 (van der Corput) Sobol dimension with Owen (nested uniform) scrambling,
+ *         using the Laine-Karras hash, and a scrambled index order (Burley, 2020).
+ *         Different `dim` values are independent scrambles of the same sequence.
+ * HALTON: radical inverse in the dim'th prime base, with an independent random digit
+ *         permutation for every digit position.
+ *
+ * Used to place per-row radii (through an inverse CDF) more evenly than i.i.d. draws.
+ */
+
+enum SequenceType {
+    SOBOL,
+    HALTON
+};
+
+static inline const char *sequence_name(SequenceType t) {
+    switch(t) {
+        case SOBOL: return "sobol";
+        case HALTON: return "halton";
+    }
+    return "unknown";
+}
+
+static inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Each bit only affects more significant bits, so applied to a bit-reversed value
+// this is a nested uniform scramble.
+static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+static inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+static inline double sobol(uint32_t index, uint32_t seed) {
+    const uint32_t shuffled = nested_uniform_scramble(index, seed * 0x9E3779B9u + 1);
+    const uint32_t v = nested_uniform_scramble(reverse_bits(shuffled), seed);
+    return (double(v) + .5) * (1. / 4294967296.);
+}
+
+static constexpr unsigned PRIMES[] {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+class ScrambledHalton {
+    const unsigned base_;
+    unsigned ndigits_;
+    std::vector<uint16_t> perms_; // ndigits_ permutations of [0, base_)
+public:
+    ScrambledHalton(uint64_t seed, unsigned dim=0):
+        base_(PRIMES[dim % (sizeof(PRIMES) / sizeof(PRIMES[0]))]), ndigits_(0)
+    {
+        // Enough digits to resolve a double.
+        for(double resolution = 1.; resolution > 0x1p-53; resolution /= base_, ++ndigits_);
+        perms_.resize(size_t(ndigits_) * base_);
+        wy::WyHash<uint64_t> gen(seed ^ (uint64_t(dim) << 32));
+        for(unsigned k = 0; k < ndigits_; ++k) {
+            uint16_t *p = &perms_[size_t(k) * base_];
+            for(unsigned i = 0; i < base_; ++i) p[i] = i;
+            for(unsigned i = base_; i > 1; --i) std::swap(p[i - 1], p[gen() % i]);
+        }
+    }
+    unsigned base() const {return base_;}
+    double operator()(uint64_t index) const {
+        const double invb = 1. / base_;
+        double ret = 0., f = invb;
+        for(unsigned k = 0; k < ndigits_; ++k, f *= invb) {
+            ret += perms_[size_t(k) * base_ + index % base_] * f;
+            index /= base_;
+        }
+        return ret + .5 * f; // Center within the final cell so the value lies in (0, 1).
+    }
+};
+
+// Fill out[0:n) with the first n points of the randomized sequence.
+static inline void fill(double *out, size_t n, uint64_t seed, SequenceType type=SOBOL, unsigned dim=0) {
+    switch(type) {
+        case SOBOL: {
+            if(n > (size_t(1) << 32)) throw std::runtime_error("Sobol sequence supports at most 2^32 points.");
+            const uint32_t s = static_cast<uint32_t>(seed ^ (seed >> 32)) + dim * 0x85EBCA6Bu;
+            OMP_PRAGMA("omp parallel for schedule(static, 4096)")
+            for(size_t i = 0; i < n; ++i) out[i] = sobol(i, s);
+            break;
+        }
+        case HALTON: {
+            const ScrambledHalton h(seed, dim);
+            OMP_PRAGMA("omp parallel for schedule(static, 4096)")
+            for(size_t i = 0; i < n; ++i) out[i] = h(i);
+            break;
+        }
+        default: {
+            char buf[128];
+            std::sprintf(buf, "Unknown QMC sequence type %d", int(type));
+            throw std::runtime_error(buf);
+        }
+    }
+}
+
+} // namespace qmc
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_QMC_H__
@@ -0,0 +1,304 @@
+#ifndef _GFRP_QUANTIZE_H__
+#define _GFRP_QUANTIZE_H__
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <immintrin.h>
+#include "frp/util.h"
+#include "frp/metric.h"
+
+namespace frp {
+
+namespace quant {
+
+/*
+ * Compressed point storage for re-ranking.
+ * ScalarQuantizer: per-dimension affine 8-bit codes, x[i] ~= min[i] + scale[i] * c[i]; d bytes per point (4x smaller than float).
+ * ProductQuantizer (Jegou et al., 2011): m subspaces with 256 k-means centroids each; m bytes per point.
+ * Both compare queries to codes asymmetrically: prepare() turns a full-precision query into a table of floats once,
+ * after which distance(table, code) is a SIMD pass over the code bytes. Distances are squared Euclidean.
+ * Codebooks are kept in float regardless of FType.
+ */
+template<typename FType=float>
+class ScalarQuantizer {
+    size_t d_;
+    std::vector<float> min_, scale_;
+public:
+    ScalarQuantizer(size_t d=0): d_(d) {}
+    size_t dim() const {return d_;}
+    size_t code_size() const {return d_;}
+    size_t table_size() const {return d_;}
+    bool trained() const {return min_.size() == d_ && d_;}
+    // Per-dimension ranges of the rows of X. Values outside them are clamped when encoding.
+    template<typename MT>
+    void train(const blaze::DenseMatrix<MT, blaze::rowMajor> &X) {
+        const auto &m = ~X;
+        if(m.columns() != d_ || m.rows() == 0) throw std::runtime_error("ScalarQuantizer::train requires a nonempty matrix with dim() columns");
+        min_.assign(d_, std::numeric_limits<float>::max());
+        std::vector<float> mx(d_, std::numeric_limits<float>::lowest());
+        for(size_t i = 0; i < m.rows(); ++i)
+            for(size_t j = 0; j < d_; ++j)
+                min_[j] = std::min(min_[j], float(m(i, j))), mx[j] = std::max(mx[j], float(m(i, j)));
+        scale_.resize(d_);
+        for(size_t j = 0; j < d_; ++j) scale_[j] = mx[j] > min_[j] ? (mx[j] - min_[j]) / 255.f: 1.f;
+    }
+    void encode(const FType *x, uint8_t *code) const {
+        for(size_t j = 0; j < d_; ++j)
+            code[j] = uint8_t(std::min(255.f, std::max(0.f, std::round((float(x[j]) - min_[j]) / scale_[j]))));
+    }
+    void decode(const uint8_t *code, FType *x) const {
+        for(size_t j = 0; j < d_; ++j) x[j] = min_[j] + scale_[j] * code[j];
+    }
+    // table = q - min, so distance is sum((table - scale * c)^2).
+    void prepare(const FType *q, float *table) const {
+        for(size_t j = 0; j < d_; ++j) table[j] = float(q[j]) - min_[j];
+    }
+    float distance(const float *table, const uint8_t *code) const {
+        const float *s = scale_.data();
+        float ret = 0;
+        size_t j = 0;
+#if __AVX512F__
+        __m512 acc = _mm512_setzero_ps();
+        for(; j + 16 <= d_; j += 16) {
+            const __m512 c = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(code + j))));
+            const __m512 diff = _mm512_fnmadd_ps(_mm512_loadu_ps(s + j), c, _mm512_loadu_ps(table + j));
+            acc = _mm512_fmadd_ps(diff, diff, acc);
+        }
+        ret = _mm512_reduce_add_ps(acc);
+#elif __AVX2__
+        __m256 acc = _mm256_setzero_ps();
+        for(; j + 8 <= d_; j += 8) {
+            const __m256 c = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + j))));
+            const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(table + j), _mm256_mul_ps(_mm256_loadu_ps(s + j), c));
+            acc = _mm256_add_ps(_mm256_mul_ps(diff, diff), acc);
+        }
+        ret = metric::SIMDOps<float>::sum(acc);
+#endif
+        for(; j < d_; ++j) {
+            const float diff = table[j] - s[j] * code[j];
+            ret += diff * diff;
+        }
+        return ret;
+    }
+};
+
+template<typename FType=float>
+class ProductQuantizer {
+public:
+    static constexpr size_t KSUB = 256;
+private:
+    size_t d_;
+    unsigned m_, ksub_;
+    std::vector<size_t> start_; // Subspace j covers dimensions [start_[j], start_[j + 1]).
+    std::vector<float> centroids_; // Centroids of subspace j: KSUB rows of len(j) floats at offset KSUB * start_[j].
+    size_t len(unsigned j) const {return start_[j + 1] - start_[j];}
+    const float *centroid(unsigned j, unsigned c) const {return &centroids_[KSUB * start_[j] + c * len(j)];}
+    float *centroid(unsigned j, unsigned c) {return &centroids_[KSUB * start_[j] + c * len(j)];}
+    template<typename T>
+    unsigned nearest(unsigned j, const T *x, float *buf) const {
+        std::copy(x, x + len(j), buf);
+        unsigned best = 0;
+        float bestd = std::numeric_limits<float>::max();
+        for(unsigned c = 0; c < ksub_; ++c) {
+            const float dist = metric::sqrl2(buf, centroid(j, c), len(j));
+            if(dist < bestd) bestd = dist, best = c;
+        }
+        return best;
+    }
+public:
+    ProductQuantizer(size_t d=0, unsigned m=1): d_(d), m_(m), ksub_(0), start_(m + 1) {
+        if(d && (m == 0 || m > d)) {
+            char buf[256];
+            std::sprintf(buf, "ProductQuantizer requires 1 <= m <= d (got m = %u, d = %zu)", m, d);
+            throw std::runtime_error(buf);
+        }
+        for(unsigned j = 0; j <= m; ++j) start_[j] = d * j / m;
+    }
+    size_t dim() const {return d_;}
+    unsigned nsubspaces() const {return m_;}
+    unsigned ksub() const {return ksub_;}
+    size_t code_size() const {return m_;}
+    size_t table_size() const {return m_ * KSUB;}
+    bool trained() const {return ksub_ != 0;}
+    // Lloyd's k-means in each subspace, in parallel, seeded with distinct random rows.
+    // Cost is O(rows * 256 * d * niter), so pass a sample of the data rather than all of it.
+    template<typename MT>
+    void train(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, unsigned niter=20, uint64_t seed=0) {
+        const auto &mat = ~X;
+        const size_t n = mat.rows();
+        if(mat.columns() != d_ || n == 0) throw std::runtime_error("ProductQuantizer::train requires a nonempty matrix with dim() columns");
+        ksub_ = std::min(n, KSUB);
+        centroids_.assign(KSUB * d_, 0.f);
+        OMP_PRAGMA("omp parallel for schedule(dynamic)")
+        for(unsigned j = 0; j < m_; ++j) {
+            const size_t l = len(j);
+            std::vector<float> sub(n * l), sums(ksub_ * l);
+            for(size_t i = 0; i < n; ++i)
+                for(size_t k = 0; k < l; ++k) sub[i * l + k] = mat(i, start_[j] + k);
+            std::mt19937_64 mt(seed + j);
+            std::vector<size_t> order(n);
+            std::iota(order.begin(), order.end(), size_t(0));
+            std::shuffle(order.begin(), order.end(), mt);
+            for(unsigned c = 0; c < ksub_; ++c) std::copy(&sub[order[c] * l], &sub[order[c] * l] + l, centroid(j, c));
+            std::vector<unsigned> assignment(n), counts(ksub_);
+            for(unsigned iter = 0; iter < niter; ++iter) {
+                bool changed = false;
+                for(size_t i = 0; i < n; ++i) {
+                    unsigned best = 0;
+                    float bestd = std::numeric_limits<float>::max();
+                    for(unsigned c = 0; c < ksub_; ++c) {
+                        const float dist = metric::sqrl2(&sub[i * l], centroid(j, c), l);
+                        if(dist < bestd) bestd = dist, best = c;
+                    }
+                    changed |= iter == 0 || assignment[i] != best;
+                    assignment[i] = best;
+                }
+                if(!changed) break;
+                std::fill(sums.begin(), sums.end(), 0.f);
+                std::fill(counts.begin(), counts.end(), 0u);
+                for(size_t i = 0; i < n; ++i) {
+                    ++counts[assignment[i]];
+                    for(size_t k = 0; k < l; ++k) sums[assignment[i] * l + k] += sub[i * l + k];
+                }
+                for(unsigned c = 0; c < ksub_; ++c) {
+                    float *cent = centroid(j, c);
+                    if(counts[c]) {
+                        for(size_t k = 0; k < l; ++k) cent[k] = sums[c * l + k] / counts[c];
+                    } else {
+                        // Reseed an empty cluster at a random row.
+                        const size_t i = mt() % n;
+                        std::copy(&sub[i * l], &sub[i * l] + l, cent);
+                    }
+                }
+            }
+        }
+    }
+    void encode(const FType *x, uint8_t *code) const {
+        float buf[256];
+        std::unique_ptr<float[]> big;
+        float *b = buf;
+        if(d_ > 256) big.reset(new float[d_]), b = big.get();
+        for(unsigned j = 0; j < m_; ++j) code[j] = nearest(j, x + start_[j], b);
+    }
+    void decode(const uint8_t *code, FType *x) const {
+        for(unsigned j = 0; j < m_; ++j) std::copy(centroid(j, code[j]), centroid(j, code[j]) + len(j), x + start_[j]);
+    }
+    // table[j * 256 + c]: squared distance between subspace j of q and centroid c.
+    void prepare(const FType *q, float *table) const {
+        std::vector<float> buf(q, q + d_);
+        for(unsigned j = 0; j < m_; ++j) {
+            for(unsigned c = 0; c < ksub_; ++c) table[j * KSUB + c] = metric::sqrl2(&buf[start_[j]], centroid(j, c), len(j));
+            std::fill(table + j * KSUB + ksub_, table + (j + 1) * KSUB, std::numeric_limits<float>::max());
+        }
+    }
+    // Sum of m table lookups, gathered 16 (AVX-512) or 8 (AVX2) subspaces at a time.
+    float distance(const float *table, const uint8_t *code) const {
+        float ret = 0;
+        unsigned j = 0;
+#if __AVX512F__
+        const __m512i step = _mm512_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792,
+                                               2048, 2304, 2560, 2816, 3072, 3328, 3584, 3840);
+        __m512 acc = _mm512_setzero_ps();
+        for(; j + 16 <= m_; j += 16) {
+            const __m512i idx = _mm512_add_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(code + j))),
+                                                 _mm512_add_epi32(step, _mm512_set1_epi32(j * KSUB)));
+            acc = _mm512_add_ps(acc, _mm512_i32gather_ps(idx, table, 4));
+        }
+        ret = _mm512_reduce_add_ps(acc);
+#elif __AVX2__
+        const __m256i step = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+        __m256 acc = _mm256_setzero_ps();
+        for(; j + 8 <= m_; j += 8) {
+            const __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + j))),
+                                                 _mm256_add_epi32(step, _mm256_set1_epi32(j * KSUB)));
+            acc = _mm256_add_ps(acc, _mm256_i32gather_ps(table, idx, 4));
+        }
+        ret = metric::SIMDOps<float>::sum(acc);
+#endif
+        for(; j < m_; ++j) ret += table[j * KSUB + code[j]];
+        return ret;
+    }
+};
+
+enum QuantizerType: uint8_t {
+    NO_QUANTIZATION,
+    SCALAR_INT8,
+    PRODUCT
+};
+
+/*
+ * QuantizedStore: one trained quantizer plus the contiguous codes of every point added, in insertion order.
+ * Indices (DCI::quantize, LSHIndex::quantize) hold one and re-rank candidates with distance(table, id).
+ */
+template<typename FType=float>
+class QuantizedStore {
+    QuantizerType type_;
+    ScalarQuantizer<FType> sq_;
+    ProductQuantizer<FType> pq_;
+    size_t code_size_;
+    std::vector<uint8_t> codes_;
+public:
+    QuantizedStore(): type_(NO_QUANTIZATION), code_size_(0) {}
+    // nsubspaces is used only by PRODUCT, and defaults to d / 4 (one byte per four dimensions).
+    QuantizedStore(size_t d, QuantizerType type, unsigned nsubspaces=0):
+        type_(type), sq_(type == SCALAR_INT8 ? d: 0),
+        pq_(type == PRODUCT ? d: 0, nsubspaces ? nsubspaces: std::max(size_t(1), d / 4)),
+        code_size_(type == SCALAR_INT8 ? sq_.code_size(): type == PRODUCT ? pq_.code_size(): 0) {}
+    QuantizerType type() const {return type_;}
+    const auto &scalar() const {return sq_;}
+    const auto &product() const {return pq_;}
+    size_t code_size() const {return code_size_;}
+    size_t size() const {return code_size_ ? codes_.size() / code_size_: 0;}
+    size_t bytes() const {return codes_.size();}
+    size_t table_size() const {return type_ == SCALAR_INT8 ? sq_.table_size(): type_ == PRODUCT ? pq_.table_size(): 0;}
+    bool trained() const {return type_ == SCALAR_INT8 ? sq_.trained(): type_ == PRODUCT && pq_.trained();}
+    template<typename MT>
+    void train(const blaze::DenseMatrix<MT, blaze::rowMajor> &X, unsigned niter=20, uint64_t seed=0) {
+        if(type_ == SCALAR_INT8) sq_.train(X);
+        else if(type_ == PRODUCT) pq_.train(X, niter, seed);
+    }
+    const uint8_t *code(size_t id) const {return &codes_[id * code_size_];}
+    void reserve(size_t n) {codes_.reserve(n * code_size_);}
+    void clear() {codes_.clear();}
+    void add(const FType *x) {
+        codes_.resize(codes_.size() + code_size_);
+        encode(x, &codes_[codes_.size() - code_size_]);
+    }
+    void replace(size_t id, const FType *x) {encode(x, &codes_[id * code_size_]);}
+    template<typename MT>
+    void add_batch(const blaze::DenseMatrix<MT, blaze::rowMajor> &X) {
+        const auto &m = ~X;
+        const size_t start = size();
+        codes_.resize(codes_.size() + m.rows() * code_size_);
+        OMP_PRAGMA("omp parallel for")
+        for(size_t i = 0; i < m.rows(); ++i) encode(&m(i, 0), &codes_[(start + i) * code_size_]);
+    }
+    void encode(const FType *x, uint8_t *code) const {
+        if(type_ == SCALAR_INT8) sq_.encode(x, code);
+        else if(type_ == PRODUCT) pq_.encode(x, code);
+    }
+    void decode(const uint8_t *code, FType *x) const {
+        if(type_ == SCALAR_INT8) sq_.decode(code, x);
+        else if(type_ == PRODUCT) pq_.decode(code, x);
+    }
+    // Fills table[0:table_size()) for query q.
+    void prepare(const FType *q, float *table) const {
+        if(type_ == SCALAR_INT8) sq_.prepare(q, table);
+        else if(type_ == PRODUCT) pq_.prepare(q, table);
+    }
+    // Approximate squared distance between the prepared query and point id.
+    float distance(const float *table, size_t id) const {
+        return type_ == SCALAR_INT8 ? sq_.distance(table, code(id)): pq_.distance(table, code(id));
+    }
+    void prefetch(size_t id) const {metric::prefetch(code(id), code_size_);}
+};
+
+} // namespace quant
+
+using quant::ScalarQuantizer;
+using quant::ProductQuantizer;
+using quant::QuantizedStore;
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_QUANTIZE_H__
@@ -0,0 +1,320 @@
+#ifndef _GFRP_SERIAL_H__
+#define _GFRP_SERIAL_H__
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "frp/util.h"
+
+namespace frp {
+
+namespace serial {
+
+/*
+ * Versioned binary serialization for transforms, kernels and indexes.
+ *
+ * Layout: a file header (magic, format version, byte-order mark), then one object.
+ * Every object begins with (tag, sizeof(float type)) and is followed by its fields.
+ * Structured blocks which are cheap to regenerate store only their seeds and parameters.
+ * Dense matrices are stored materialized, padded to blaze's row spacing and aligned to
+ * ALIGNMENT bytes within the file, so that a mapped file can be used in place through
+ * aligned, padded blaze::CustomMatrix views without copying.
+ *
+ * Objects provide `void write(serial::Writer &) const` and an `explicit T(serial::Reader &)` constructor.
+ * Files are read through mmap; objects loaded this way keep the mapping alive for as long as they need it.
+ */
+
+static constexpr char     MAGIC[8]        {'G', 'F', 'R', 'P', 'S', 'E', 'R', '\0'};
+static constexpr uint32_t FORMAT_VERSION  = 2; // 2: DCI stores its deletion bitmap.
+static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304u;
+static constexpr size_t   ALIGNMENT       = 64;
+
+enum ObjectTag: uint32_t {
+    OJLT          = 1,
+    KERNEL        = 2,
+    ORF_BLOCK     = 3,
+    RF_BLOCK      = 4,
+    SORF_BLOCK    = 5,
+    FF_BLOCK      = 6,
+    MATRIX_LSH    = 7,
+    DCI_INDEX     = 8,
+    DENSE_MATRIX  = 9
+};
+
+static inline const char *tag_name(uint32_t tag) {
+    switch(tag) {
+        case OJLT: return "OrthogonalJLTransform";
+        case KERNEL: return "Kernel";
+        case ORF_BLOCK: return "orf::KernelBlock";
+        case RF_BLOCK: return "rf::KernelBlock";
+        case SORF_BLOCK: return "sorf::KernelBlock";
+        case FF_BLOCK: return "ff::KernelBlock";
+        case MATRIX_LSH: return "MatrixLSHasher";
+        case DCI_INDEX: return "DCI";
+        case DENSE_MATRIX: return "matrix";
+    }
+    return "unknown";
+}
+
+class MappedFile {
+    const char *data_;
+    size_t size_;
+public:
+    MappedFile(const std::string &path, bool populate=true): data_(nullptr), size_(0) {
+        const int fd = ::open(path.data(), O_RDONLY);
+        if(fd < 0) throw std::runtime_error(std::string("Could not open ") + path + " for reading.");
+        struct stat st;
+        if(::fstat(fd, &st)) {
+            ::close(fd);
+            throw std::runtime_error(std::string("Could not stat ") + path);
+        }
+        size_ = st.st_size;
+        if(size_) {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            if(populate) flags |= MAP_POPULATE;
+#endif
+            void *p = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+            if(p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error(std::string("Could not mmap ") + path);
+            }
+            data_ = static_cast<const char *>(p);
+        }
+        ::close(fd);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() {
+        if(data_) ::munmap(const_cast<char *>(data_), size_);
+    }
+    const char *data() const {return data_;}
+    size_t size() const {return size_;}
+};
+
+class Writer {
+    std::FILE *fp_;
+    size_t offset_;
+public:
+    Writer(const std::string &path): fp_(std::fopen(path.data(), "wb")), offset_(0) {
+        if(!fp_) throw std::runtime_error(std::string("Could not open ") + path + " for writing.");
+        write_file_header();
+    }
+    Writer(const Writer &) = delete;
+    ~Writer() {
+        std::fclose(fp_);
+    }
+    size_t offset() const {return offset_;}
+    void write_bytes(const void *p, size_t nb) {
+        if(nb && std::fwrite(p, 1, nb, fp_) != nb) {
+            char buf[128];
+            std::sprintf(buf, "Failed to write %zu bytes at offset %zu", nb, offset_);
+            throw std::runtime_error(buf);
+        }
+        offset_ += nb;
+    }
+    void align() {
+        static const char zeros[ALIGNMENT] {0};
+        if(offset_ % ALIGNMENT) write_bytes(zeros, ALIGNMENT - offset_ % ALIGNMENT);
+    }
+    template<typename T>
+    void write(const T &val) {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be written directly.");
+        write_bytes(&val, sizeof(val));
+    }
+    template<typename T>
+    void write_array(const T *p, size_t n) {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be written directly.");
+        write<uint64_t>(n);
+        align();
+        write_bytes(p, n * sizeof(T));
+    }
+    template<typename T>
+    void write_array(const std::vector<T> &v) {write_array(v.data(), v.size());}
+    void write_header(ObjectTag tag, uint32_t float_size) {
+        write<uint32_t>(tag);
+        write<uint32_t>(float_size);
+    }
+    // Writes rows/columns/spacing, then the padded, aligned elements.
+    template<typename MT, bool SO>
+    void write_matrix(const blaze::DenseMatrix<MT, SO> &mat) {
+        using FT = typename MT::ElementType;
+        const auto &m = ~mat;
+        const size_t nr = m.rows(), nc = m.columns(), spacing = m.spacing(), major = SO == blaze::rowMajor ? nr: nc;
+        write_matrix_header<FT>(nr, nc, spacing, SO);
+        for(size_t i = 0; i < major; ++i) {
+            const FT *p = SO == blaze::rowMajor ? &m(i, 0): &m(0, i);
+            write_bytes(p, spacing * sizeof(FT));
+        }
+    }
+    // For contiguous storage: (SO == rowMajor ? nr: nc) runs of `spacing` elements.
+    template<typename FT>
+    void write_matrix(const FT *data, size_t nr, size_t nc, size_t spacing, bool SO) {
+        write_matrix_header<FT>(nr, nc, spacing, SO);
+        write_bytes(data, (SO == blaze::rowMajor ? nr: nc) * spacing * sizeof(FT));
+    }
+private:
+    template<typename FT>
+    void write_matrix_header(size_t nr, size_t nc, size_t spacing, bool SO) {
+        write_header(DENSE_MATRIX, sizeof(FT));
+        write<uint64_t>(nr); write<uint64_t>(nc); write<uint64_t>(spacing); write<uint32_t>(SO);
+        align();
+    }
+    void write_file_header() {
+        write_bytes(MAGIC, sizeof(MAGIC));
+        write<uint32_t>(FORMAT_VERSION);
+        write<uint32_t>(BYTE_ORDER_MARK);
+    }
+};
+
+class Reader {
+    std::shared_ptr<const MappedFile> file_;
+    size_t offset_;
+    uint32_t version_;
+public:
+    Reader(const std::string &path, bool populate=true):
+        file_(std::make_shared<const MappedFile>(path, populate)), offset_(0), version_(0)
+    {
+        char magic[sizeof(MAGIC)];
+        read_bytes(magic, sizeof(magic));
+        if(std::memcmp(magic, MAGIC, sizeof(MAGIC))) throw std::runtime_error(path + " is not a gfrp serialized file.");
+        version_ = read<uint32_t>();
+        const auto bom = read<uint32_t>();
+        if(bom != BYTE_ORDER_MARK) throw std::runtime_error(path + " was written with a different byte order.");
+        if(version_ > FORMAT_VERSION) {
+            char buf[256];
+            std::sprintf(buf, "File format version %u is newer than this library's (%u).", version_, FORMAT_VERSION);
+            throw std::runtime_error(buf);
+        }
+    }
+    uint32_t version() const {return version_;}
+    const std::shared_ptr<const MappedFile> &file() const {return file_;}
+    size_t offset() const {return offset_;}
+    const char *current() const {return file_->data() + offset_;}
+    void ensure(size_t nb) const {
+        if(offset_ + nb > file_->size()) {
+            char buf[128];
+            std::sprintf(buf, "Truncated file: wanted %zu bytes at offset %zu of %zu", nb, offset_, file_->size());
+            throw std::runtime_error(buf);
+        }
+    }
+    void read_bytes(void *p, size_t nb) {
+        ensure(nb);
+        std::memcpy(p, current(), nb);
+        offset_ += nb;
+    }
+    void align() {
+        if(offset_ % ALIGNMENT) offset_ += ALIGNMENT - offset_ % ALIGNMENT;
+    }
+    void skip(size_t nb) {
+        ensure(nb);
+        offset_ += nb;
+    }
+    template<typename T>
+    T read() {
+        static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be read directly.");
+        T ret;
+        read_bytes(&ret, sizeof(ret));
+        return ret;
+    }
+    // Returns a pointer into the mapping; valid while file() is alive.
+    template<typename T>
+    std::pair<const T *, size_t> read_array() {
+        const size_t n = read<uint64_t>();
+        align();
+        const T *ret = reinterpret_cast<const T *>(current());
+        skip(n * sizeof(T));
+        return {ret, n};
+    }
+    template<typename T>
+    std::vector<T> read_vector() {
+        auto p = read_array<T>();
+        return std::vector<T>(p.first, p.first + p.second);
+    }
+    Reader &expect(ObjectTag tag, uint32_t float_size) {
+        const auto t = read<uint32_t>(), fs = read<uint32_t>();
+        if(t != tag || fs != float_size) {
+            char buf[256];
+            std::sprintf(buf, "Expected %s with %u-byte floats, found %s with %u-byte floats at offset %zu.",
+                         tag_name(tag), float_size, tag_name(t), fs, offset_ - 8);
+            throw std::runtime_error(buf);
+        }
+        return *this;
+    }
+};
+
+/*
+ * Dense matrix storage which either owns a blaze::DynamicMatrix or refers to an aligned,
+ * padded region of a mapped file. Consumers use view() in both cases.
+ */
+template<typename FT, bool SO=blaze::rowMajor>
+class MatrixStore {
+    blaze::DynamicMatrix<FT, SO> owned_;
+    const FT *mapped_ = nullptr;
+    size_t rows_ = 0, columns_ = 0, spacing_ = 0;
+    std::shared_ptr<const MappedFile> keepalive_;
+public:
+    using view_type = blaze::CustomMatrix<const FT, blaze::aligned, blaze::padded, SO>;
+    MatrixStore() {}
+    MatrixStore(blaze::DynamicMatrix<FT, SO> &&mat): owned_(std::move(mat)) {}
+    MatrixStore(const blaze::DynamicMatrix<FT, SO> &mat): owned_(mat) {}
+    template<typename...Args, typename=std::enable_if_t<(sizeof...(Args) > 1)>>
+    MatrixStore(Args &&...args): owned_(std::forward<Args>(args)...) {}
+    MatrixStore(Reader &r) {
+        r.expect(DENSE_MATRIX, sizeof(FT));
+        rows_ = r.read<uint64_t>(); columns_ = r.read<uint64_t>(); spacing_ = r.read<uint64_t>();
+        if(r.read<uint32_t>() != SO) throw std::runtime_error("Serialized matrix has the wrong storage order.");
+        r.align();
+        const size_t nel = (SO == blaze::rowMajor ? rows_: columns_) * spacing_;
+        mapped_ = reinterpret_cast<const FT *>(r.current());
+        r.skip(nel * sizeof(FT));
+        keepalive_ = r.file();
+    }
+    bool is_mapped() const {return mapped_ != nullptr;}
+    size_t rows() const {return mapped_ ? rows_: owned_.rows();}
+    size_t columns() const {return mapped_ ? columns_: owned_.columns();}
+    view_type view() const {
+        return mapped_ ? view_type(mapped_, rows_, columns_, spacing_)
+                       : view_type(owned_.data(), owned_.rows(), owned_.columns(), owned_.spacing());
+    }
+    // Only available for matrices built in memory.
+    blaze::DynamicMatrix<FT, SO> &owned() {
+        if(mapped_) throw std::runtime_error("Cannot modify a memory-mapped matrix.");
+        return owned_;
+    }
+    const blaze::DynamicMatrix<FT, SO> &owned() const {
+        if(mapped_) throw std::runtime_error("Mapped matrix has no owned copy.");
+        return owned_;
+    }
+    void write(Writer &w) const {
+        if(mapped_) w.write_matrix(mapped_, rows_, columns_, spacing_, SO);
+        else        w.write_matrix(owned_.data(), owned_.rows(), owned_.columns(), owned_.spacing(), SO);
+    }
+};
+
+// Top-level helpers.
+template<typename T>
+void save(const T &obj, const std::string &path) {
+    Writer w(path);
+    obj.write(w);
+}
+
+template<typename T>
+T load(const std::string &path, bool populate=true) {
+    Reader r(path, populate);
+    return T(r);
+}
+
+} // namespace serial
+
+} // namespace frp
+
+#endif // #ifndef _GFRP_SERIAL_H__
@@ -131,6 +131,23 @@ struct is_instantiation_of : std::false_type {};
 template < template <typename...> class Template, typename... Args >
 struct is_instantiation_of< Template, Template<Args...> > : std::true_type {};
 
+// Allocator returning Alignment-byte-aligned storage, e.g. for rows read with aligned SIMD loads.
+template<typename T, size_t Alignment=64>
+struct AlignedAllocator {
+    using value_type = T;
+    template<typename U> struct rebind {using other = AlignedAllocator<U, Alignment>;};
+    AlignedAllocator() = default;
+    template<typename U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+    T *allocate(size_t n) {
+        void *ret;
+        if(posix_memalign(&ret, Alignment, n * sizeof(T))) throw std::bad_alloc();
+        return static_cast<T *>(ret);
+    }
+    void deallocate(T *p, size_t) {std::free(p);}
+    template<typename U> bool operator==(const AlignedAllocator<U, Alignment> &) const {return true;}
+    template<typename U> bool operator!=(const AlignedAllocator<U, Alignment> &) const {return false;}
+};
+
 class Timer {
     using TpType = std::chrono::system_clock::time_point;
     std::string name_;
@@ -169,7 +186,7 @@ template<typename T, bool SO, typename F>
 void for_each_nz(blaze::SparseVector<T, SO> &_x, const F &func) {
     auto &x = ~_x;
     for(auto it = x.begin(), e = x.end(); it != e; ++it)
-        func(it->index(), x->value());
+        func(it->index(), it->value());
 }
 template<typename T, bool SO, typename F>
 void for_each_nz(const blaze::DenseVector<T, SO> &_x, const F &func) {
@@ -183,7 +200,7 @@ template<typename T, bool SO, typename F>
 void for_each_nz(const blaze::SparseVector<T, SO> &_x, const F &func) {
     auto &x = ~_x;
     for(auto it = x.begin(), e = x.end(); it != e; ++it)
-        func(it->index(), x->value());
+        func(it->index(), it->value());
 }
 
 template<class Container>
@@ -0,0 +1,230 @@
+#include "frp/dci.h"
+#include "frp/knn.h"
+#include <fstream>
+#include <getopt.h>
+
+using namespace frp;
+
+// Recall@k, throughput, build time and memory of DCI, prioritized DCI, LSHIndex and GEMM brute force over parameter sweeps.
+
+int usage(char *arg) {
+    std::fprintf(stderr, "Usage: %s <opts>\n"
+                         "-f\tData file (.fvecs, .bvecs, or raw float32 rows of -d dimensions) [synthetic Gaussian]\n"
+                         "-Q\tQuery file, same formats [first -q rows of the data, perturbed]\n"
+                         "-d\tDimension [64]\n-n\tNumber of points [100000]\n-q\tNumber of queries [1000]\n-k\tNeighbors [10]\n"
+                         "-a\tAlgorithms: comma-separated of dci, pdci, lsh, brute [dci,pdci,lsh,brute]\n"
+                         "-m\tDCI simple indices per level [10]\n-l\tDCI levels [2]\n-g\tDCI gamma [1]\n-1\tPrioritized DCI k1 [100]\n"
+                         "-L\tLSH tables [16]\n-K\tLSH bits per table [12]\n-P\tLSH probes per table [1,4,16]\n"
+                         "-o\tOutput path [stdout]\n-J\tEmit JSON instead of CSV\n"
+                         "Every parameter flag takes a comma-separated list, and all combinations are run.\n", arg);
+    return EXIT_FAILURE;
+}
+
+template<typename T>
+std::vector<T> parse_list(const char *s) {
+    std::vector<T> ret;
+    for(char *end; *s; s = *end ? end + 1: end) {
+        ret.push_back(static_cast<T>(std::strtod(s, &end)));
+        if(end == s) throw std::runtime_error(std::string("Could not parse list ") + s);
+    }
+    return ret;
+}
+
+// .fvecs/.bvecs: each row is an int32 dimension followed by that many float32/uint8 values. Anything else is raw float32.
+blaze::DynamicMatrix<float> load_matrix(const std::string &path, size_t d, size_t maxrows) {
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs) throw std::runtime_error(std::string("Could not open ") + path);
+    const auto ends_with = [&path](const char *ext) {
+        const size_t n = std::strlen(ext);
+        return path.size() >= n && path.compare(path.size() - n, n, ext) == 0;
+    };
+    const bool fvecs = ends_with(".fvecs"), bvecs = ends_with(".bvecs");
+    if(fvecs || bvecs) {
+        int32_t dim;
+        if(!ifs.read(reinterpret_cast<char *>(&dim), sizeof(dim)) || dim <= 0) throw std::runtime_error("Bad header in " + path);
+        d = dim;
+        ifs.seekg(0);
+    }
+    if(d == 0) throw std::runtime_error("Raw matrices need a dimension (-d)");
+    std::vector<float> vals;
+    std::vector<uint8_t> bytes(d);
+    std::vector<float> frow(d);
+    for(size_t n = 0; n < maxrows; ++n) {
+        if(fvecs || bvecs) {
+            int32_t dim;
+            if(!ifs.read(reinterpret_cast<char *>(&dim), sizeof(dim))) break;
+            if(size_t(dim) != d) throw std::runtime_error("Inconsistent row dimensions in " + path);
+        }
+        if(bvecs) {
+            if(!ifs.read(reinterpret_cast<char *>(bytes.data()), d)) break;
+            std::copy(bytes.begin(), bytes.end(), frow.begin());
+        } else if(!ifs.read(reinterpret_cast<char *>(frow.data()), d * sizeof(float))) {
+            break;
+        }
+        vals.insert(vals.end(), frow.begin(), frow.end());
+    }
+    blaze::DynamicMatrix<float> ret(vals.size() / d, d);
+    for(size_t i = 0; i < ret.rows(); ++i)
+        std::copy(&vals[i * d], &vals[(i + 1) * d], &ret(i, 0));
+    return ret;
+}
+
+struct Row {
+    std::string algorithm, params;
+    double build_ms;
+    size_t memory;
+    double qps, recall;
+};
+
+int main(int argc, char *argv[]) {
+    int c;
+    size_t d = 64, n = 100000, nq = 1000;
+    unsigned k = 10;
+    std::string datapath, querypath, outpath, algos = "dci,pdci,lsh,brute";
+    std::vector<unsigned> ms{10}, ls{2}, k1s{100}, Ls{16}, Ks{12}, probes{1, 4, 16};
+    std::vector<double> gammas{1.};
+    bool json = false;
+    while((c = getopt(argc, argv, "f:Q:d:n:q:k:a:m:l:g:1:L:K:P:o:Jh?")) >= 0) {
+        switch(c) {
+            case 'f': datapath = optarg; break;
+            case 'Q': querypath = optarg; break;
+            case 'd': d = std::strtoull(optarg, nullptr, 10); break;
+            case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+            case 'q': nq = std::strtoull(optarg, nullptr, 10); break;
+            case 'k': k = std::atoi(optarg); break;
+            case 'a': algos = optarg; break;
+            case 'm': ms = parse_list<unsigned>(optarg); break;
+            case 'l': ls = parse_list<unsigned>(optarg); break;
+            case 'g': gammas = parse_list<double>(optarg); break;
+            case '1': k1s = parse_list<unsigned>(optarg); break;
+            case 'L': Ls = parse_list<unsigned>(optarg); break;
+            case 'K': Ks = parse_list<unsigned>(optarg); break;
+            case 'P': probes = parse_list<unsigned>(optarg); break;
+            case 'o': outpath = optarg; break;
+            case 'J': json = true; break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    const auto run = [&algos](const char *name) {
+        for(size_t pos = 0, end; pos <= algos.size(); pos = end + 1) {
+            end = std::min(algos.find(',', pos), algos.size());
+            if(algos.compare(pos, end - pos, name) == 0) return true;
+        }
+        return false;
+    };
+    blaze::DynamicMatrix<float> data, queries;
+    if(datapath.size()) {
+        data = load_matrix(datapath, d, n);
+        d = data.columns();
+    } else {
+        data.resize(n, d);
+        unit_gaussian_fill(data, 13);
+    }
+    n = data.rows();
+    if(querypath.size()) {
+        queries = load_matrix(querypath, d, nq);
+    } else {
+        // Perturbed copies of indexed points, so each query has a clear set of near neighbors.
+        nq = std::min(nq, n);
+        queries.resize(nq, d);
+        unit_gaussian_fill(queries, 17);
+        const float scale = .1f * std::sqrt(blaze::sqrNorm(data) / (n * d));
+        for(size_t i = 0; i < nq; ++i) row(queries, i) = row(data, i * (n / nq)) + scale * row(queries, i);
+    }
+    nq = queries.rows();
+    if(queries.columns() != d || n < k) {
+        std::fprintf(stderr, "Queries have %zu columns, data %zu; %zu points for k = %u\n", queries.columns(), d, n, k);
+        return EXIT_FAILURE;
+    }
+    std::fprintf(stderr, "%zu points, %zu queries, %zu dimensions\n", n, nq, d);
+
+    std::vector<std::vector<uint32_t>> exact(nq);
+    std::vector<Row> rows;
+    const auto elapsed_ms = [](auto start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    };
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        ExactKNN<float> brute(data);
+        const double build_ms = elapsed_ms(start);
+        const size_t memory = brute.memory_bytes();
+        start = std::chrono::high_resolution_clock::now();
+        const auto res = brute.query_batch(queries, k);
+        const double ms = elapsed_ms(start);
+        for(size_t i = 0; i < nq; ++i)
+            for(const auto &r: res[i]) exact[i].push_back(r.second);
+        if(run("brute")) rows.push_back(Row{"brute", "", build_ms, memory, nq / ms * 1e3, 1.});
+    }
+    const auto recall = [&](size_t i, uint32_t id) -> size_t {return std::find(exact[i].begin(), exact[i].end(), id) != exact[i].end();};
+    char buf[256];
+
+    if(run("dci") || run("pdci")) {
+        for(const unsigned m: ms) for(const unsigned l: ls) for(const double gamma: gammas) {
+            auto start = std::chrono::high_resolution_clock::now();
+            dci::DCI<float, uint32_t, sorted::vector> index(m, l, d, 1e-5, true, gamma);
+            index.build(data);
+            const double build_ms = elapsed_ms(start);
+            const size_t memory = index.memory_bytes();
+            if(run("dci")) {
+                start = std::chrono::high_resolution_clock::now();
+                const auto res = index.query_batch(queries, k);
+                const double ms = elapsed_ms(start);
+                size_t found = 0;
+                for(size_t i = 0; i < nq; ++i)
+                    for(size_t j = 0; j < k; ++j) found += recall(i, res.ids(i, j));
+                std::sprintf(buf, "m=%u;l=%u;gamma=%g", m, l, gamma);
+                rows.push_back(Row{"dci", buf, build_ms, memory, nq / ms * 1e3, double(found) / (nq * k)});
+            }
+            if(run("pdci")) {
+                for(const unsigned k1: k1s) {
+                    size_t found = 0;
+                    start = std::chrono::high_resolution_clock::now();
+                    OMP_PRAGMA("omp parallel for schedule(dynamic) reduction(+:found)")
+                    for(size_t i = 0; i < nq; ++i)
+                        for(const auto &r: index.prioritized_query(&queries(i, 0), k, k1)) found += recall(i, r.id());
+                    const double ms = elapsed_ms(start);
+                    std::sprintf(buf, "m=%u;l=%u;gamma=%g;k1=%u", m, l, gamma, k1);
+                    rows.push_back(Row{"pdci", buf, build_ms, memory, nq / ms * 1e3, double(found) / (nq * k)});
+                }
+            }
+        }
+    }
+    if(run("lsh")) {
+        for(const unsigned L: Ls) for(const unsigned K: Ks) {
+            auto start = std::chrono::high_resolution_clock::now();
+            LSHIndex<float> index(d, L, K, 1337);
+            index.add_batch(data);
+            index.freeze();
+            const double build_ms = elapsed_ms(start);
+            const size_t memory = index.memory_bytes();
+            for(const unsigned nprobes: probes) {
+                start = std::chrono::high_resolution_clock::now();
+                const auto res = index.query_batch(queries, k, nprobes);
+                const double ms = elapsed_ms(start);
+                size_t found = 0;
+                for(size_t i = 0; i < nq; ++i)
+                    for(const auto &r: res[i]) found += recall(i, r.second);
+                std::sprintf(buf, "L=%u;K=%u;probes=%u", L, K, nprobes);
+                rows.push_back(Row{"lsh", buf, build_ms, memory, nq / ms * 1e3, double(found) / (nq * k)});
+            }
+        }
+    }
+
+    std::FILE *ofp = outpath.empty() ? stdout: std::fopen(outpath.data(), "w");
+    if(!ofp) throw std::runtime_error("Could not open " + outpath);
+    if(json) {
+        std::fprintf(ofp, "[\n");
+        for(size_t i = 0; i < rows.size(); ++i) {
+            const auto &r = rows[i];
+            std::fprintf(ofp, "  {\"algorithm\": \"%s\", \"params\": \"%s\", \"k\": %u, \"recall\": %lf, \"qps\": %lf, "
+                              "\"build_ms\": %lf, \"memory_bytes\": %zu}%s\n",
+                         r.algorithm.data(), r.params.data(), k, r.recall, r.qps, r.build_ms, r.memory, i + 1 < rows.size() ? ",": "");
+        }
+        std::fprintf(ofp, "]\n");
+    } else {
+        std::fprintf(ofp, "algorithm,params,k,recall,qps,build_ms,memory_bytes\n");
+        for(const auto &r: rows)
+            std::fprintf(ofp, "%s,%s,%u,%lf,%lf,%lf,%zu\n", r.algorithm.data(), r.params.data(), k, r.recall, r.qps, r.build_ms, r.memory);
+    }
+    if(ofp != stdout) std::fclose(ofp);
+}
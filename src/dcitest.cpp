@@ -4,6 +4,7 @@
 #include "omp.h"
 #include "aesctr/wy.h"
 #include "include/frp/dci.h"
+#include "include/frp/knn.h"
 #include <getopt.h>
 
 using namespace frp;
@@ -185,10 +186,146 @@ int main(int argc, char *argv[]) {
     size_t lshash = d2.hash(ls[0]);
     LSHTable<E2LSHasher<>> lshasher(std::move(d2));
     std::fprintf(stderr, "lshash for first item: %zu\n", lshash);
-    //OMP_PRAGMA("omp parallel for")
-    for(size_t i = 0; i < ls.size(); ++i) {
-        dci.add(ls[i]);
-        fhtdci.add(ls[i]);
+    {
+        Timer t("incremental add");
+        for(size_t i = 0; i < ls.size(); ++i) {
+            dci.add(ls[i]);
+            fhtdci.add(ls[i]);
+        }
+    }
+    // Bulk build over the same points and projections must return the same neighbors.
+    blaze::DynamicMatrix<FLOAT_TYPE> lsmat(npoints, nd);
+    for(size_t i = 0; i < ls.size(); ++i) row(lsmat, i) = trans(ls[i]);
+    DCI<FLOAT_TYPE, uint32_t, sorted::vector> bulkdci(m, l, nd, 1e-5, true, gamma);
+    {
+        Timer t("bulk build");
+        bulkdci.build(lsmat);
+    }
+    {
+        auto inc = dci.query(ls[0], k), bulk = bulkdci.query(ls[0], k);
+        size_t agree = inc.size() == bulk.size();
+        for(size_t i = 0; agree && i < inc.size(); ++i) agree = inc[i].id() == bulk[i].id();
+        std::fprintf(stderr, "Bulk-built index %s the incrementally built one\n", agree ? "matches": "DIFFERS FROM");
+    }
+    {
+        // Batched queries must agree with one-at-a-time queries.
+        const size_t nq = std::min(size_t(npoints), size_t(1000));
+        auto qmat = submatrix(lsmat, 0, 0, nq, nd);
+        decltype(bulkdci)::KNNResult res;
+        {
+            Timer t("batched queries");
+            res = bulkdci.query_batch(qmat, k);
+        }
+        size_t mismatches = 0;
+        {
+            Timer t("single queries");
+            for(size_t i = 0; i < nq; ++i) {
+                const auto single = bulkdci.query(ls[i], k);
+                for(size_t j = 0; j < single.size(); ++j) mismatches += single[j].id() != res.ids(i, j);
+            }
+        }
+        std::fprintf(stderr, "Batched vs single queries: %zu mismatched neighbors over %zu queries\n", mismatches, nq);
+        if(bulkdci.query(ls[0], 0).size() || bulkdci.prioritized_query(ls[0], 0, 1).size() || bulkdci.query_batch(qmat, 0).ids.columns())
+            throw std::runtime_error("DCI k-NN with k = 0 must return no neighbors");
+        // Owned, aligned storage with cached norms re-ranks with the norm trick; neighbors should not change.
+        auto owned = bulkdci;
+        owned.own_points(true);
+        decltype(bulkdci)::KNNResult ores;
+        {
+            Timer t("batched queries, owned points");
+            ores = owned.query_batch(qmat, k);
+        }
+        mismatches = 0;
+        for(size_t i = 0; i < nq; ++i)
+            for(size_t j = 0; j < k; ++j) mismatches += ores.ids(i, j) != res.ids(i, j);
+        std::fprintf(stderr, "Owned vs borrowed points: %zu mismatched neighbors over %zu queries\n", mismatches, nq);
+        // int8 codes with exact re-ranking of the best 4k should mostly agree with full-precision re-ranking.
+        QuantizedStore<FLOAT_TYPE> store(nd, quant::SCALAR_INT8);
+        store.train(lsmat);
+        auto quantized = bulkdci;
+        quantized.quantize(store, 4 * k);
+        const auto qres = quantized.query_batch(qmat, k);
+        size_t agree = 0;
+        for(size_t i = 0; i < nq; ++i)
+            for(size_t j = 0; j < k; ++j)
+                for(size_t jj = 0; jj < k; ++jj) agree += qres.ids(i, j) == res.ids(i, jj);
+        std::fprintf(stderr, "int8 codes (%zu bytes) with exact re-rank of %u: overlap@%u %lf\n",
+                     quantized.codes().bytes(), 4 * k, k, double(agree) / (nq * k));
+    }
+    {
+        // Anisotropic data (dimension j scaled by 0.9^j): directions fitted by PCA should find more true neighbors than random ones.
+        blaze::DynamicMatrix<FLOAT_TYPE> aniso = lsmat;
+        for(int j = 0; j < nd; ++j) column(aniso, j) *= std::pow(.9, j);
+        const size_t nq = std::min(size_t(npoints), size_t(50));
+        auto qmat = submatrix(aniso, 0, 0, nq, nd);
+        DCI<FLOAT_TYPE, uint32_t, sorted::vector> rnd(m, l, nd, 1e-5, true, gamma), fitted(m, l, nd, 1e-5, true, gamma, true);
+        rnd.build(aniso);
+        {
+            Timer t("data-dependent build");
+            fitted.build(aniso);
+        }
+        const auto rres = rnd.query_batch(qmat, k);
+        const auto fres = fitted.query_batch(qmat, k);
+        const auto exact = ExactKNN<FLOAT_TYPE>::search(aniso, qmat, k);
+        size_t rfound = 0, ffound = 0;
+        for(size_t i = 0; i < nq; ++i)
+            for(const auto &e: exact[i])
+                for(int jj = 0; jj < k; ++jj)
+                    rfound += rres.ids(i, jj) == e.second, ffound += fres.ids(i, jj) == e.second;
+        std::fprintf(stderr, "Anisotropic data recall@%d: random directions %lf, data-dependent %lf\n",
+                     k, double(rfound) / (nq * k), double(ffound) / (nq * k));
+    }
+    {
+        // A cosine index normalizes into its own storage and re-ranks by dot product; compare with exact cosine neighbors.
+        DCI<FLOAT_TYPE, uint32_t, sorted::vector, ska::flat_hash_set, blaze::rowMajor, MatrixLSHasher<FLOAT_TYPE, blaze::rowMajor>,
+            std::uint16_t, MetricSpace::CosineDistance> cosdci(m, l, nd, 1e-5, true, gamma);
+        {
+            Timer t("cosine build");
+            cosdci.build(lsmat);
+        }
+        const size_t nq = std::min(size_t(npoints), size_t(100));
+        auto qmat = submatrix(lsmat, 0, 0, nq, nd);
+        const auto res = cosdci.query_batch(qmat, k);
+        const auto exact = ExactKNN<FLOAT_TYPE>::search(lsmat, qmat, k, knn::COSINE);
+        size_t found = 0;
+        double maxerr = 0.;
+        for(size_t i = 0; i < nq; ++i) {
+            for(const auto &e: exact[i])
+                for(int j = 0; j < k; ++j) found += res.ids(i, j) == e.second;
+            if(res.ids(i, 0) == exact[i][0].second) maxerr = std::max(maxerr, std::abs(double(res.distances(i, 0) - exact[i][0].first)));
+        }
+        std::fprintf(stderr, "Cosine DCI recall@%d: %lf; largest cosine distance error %le\n", k, double(found) / (nq * k), maxerr);
+    }
+    {
+        // Deleted points must never be returned, including while a background compaction purges them.
+        auto dyn = bulkdci;
+        dyn.own_points();
+        dyn.set_compaction_threshold(0.);
+        const size_t nq = std::min(size_t(npoints), size_t(100));
+        auto qmat = submatrix(lsmat, 0, 0, nq, nd);
+        for(size_t i = 0; i < size_t(npoints); i += 4) dyn.remove(i);
+        const auto before = dyn.query_batch(qmat, k);
+        dyn.compact_async();
+        const auto during = dyn.query_batch(qmat, k);
+        dyn.wait_for_compaction();
+        const auto after = dyn.query_batch(qmat, k);
+        size_t returned = 0, changed = 0;
+        for(size_t i = 0; i < nq; ++i) {
+            for(size_t j = 0; j < size_t(k); ++j) {
+                for(const uint32_t id: {before.ids(i, j), during.ids(i, j), after.ids(i, j)})
+                    returned += id != uint32_t(-1) && dyn.is_deleted(id);
+                changed += before.ids(i, j) != after.ids(i, j);
+            }
+        }
+        std::fprintf(stderr, "Removed %zu/%d points: %zu deleted neighbors returned, %zu neighbors changed by compaction\n",
+                     dyn.ndeleted(), npoints, returned, changed);
+        // Moving point 1 onto point 2 must make it an exact neighbor of point 2.
+        if(npoints > 2) {
+            dyn.update(1, &lsmat(2, 0));
+            const auto res = dyn.query(ls[2], k);
+            const bool found = std::any_of(res.begin(), res.end(), [](const auto &x) {return x.id() == 1 && x.f() == 0;});
+            std::fprintf(stderr, "Updated point %s found at its new position\n", found ? "is": "is NOT");
+        }
     }
 #if 0
     blaze::DynamicMatrix<FLOAT_TYPE> mat_to_insert(nd, 100);
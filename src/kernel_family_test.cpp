@@ -0,0 +1,117 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include "frp/frp.h"
+
+using namespace frp;
+using namespace blaze;
+
+using ArcCosKernelType = kernel::ArcCosineKernel<FLOAT_TYPE, 1>;
+using LaplacianKernelType = kernel::LaplacianKernel<FLOAT_TYPE>;
+using PolyKernelType = kernel::PolynomialKernel<FLOAT_TYPE>;
+using SORFGaussianKernelType = kernel::Kernel<kernel::SORFKernelBlock<FLOAT_TYPE, PRNRademacher>, kernel::GaussianFinalizer>;
+using QMCGaussianKernelType = kernel::Kernel<kernel::QMCSORFKernelBlock<FLOAT_TYPE>, kernel::GaussianFinalizer>;
+
+struct ArcCos1Kernel {
+    template<typename V1, typename V2>
+    double operator()(const V1 &v1, const V2 &v2) const {
+        const double n1 = norm(v1), n2 = norm(v2);
+        const double theta = std::acos(std::clamp(double(dot(v1, v2)) / (n1 * n2), -1., 1.));
+        return n1 * n2 / M_PI * (std::sin(theta) + (M_PI - theta) * std::cos(theta));
+    }
+};
+struct ExponentialKernel {
+    template<typename V1, typename V2>
+    double operator()(const V1 &v1, const V2 &v2, double sigma) const {
+        return std::exp(-norm(v1 - v2) / sigma);
+    }
+};
+
+int usage(char *arg) {
+    std::fprintf(stderr, "Usage: %s <opts>\n"
+                         "-i\tInput size [64]\n-s:sigma [1.0]\n-S:Output size [4096]\n-n: nsample points [100]\n"
+                         "-d: polynomial degree [2]\n-c: polynomial offset [1.0]\n", arg);
+    return EXIT_FAILURE;
+}
+
+template<typename Mat, typename F>
+double mean_abs_err(const Mat &out, const F &exact) {
+    double err = 0.;
+    size_t n = 0;
+    for(size_t i = 0; i < out.rows(); ++i)
+        for(size_t j = i + 1; j < out.rows(); ++j, ++n)
+            err += std::abs(dot(row(out, i), row(out, j)) - exact(i, j));
+    return err / n;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    size_t insize(1 << 6), outsize(1 << 12), nrows(100);
+    unsigned degree = 2;
+    double sigma(1.), offset(1.);
+    while((c = getopt(argc, argv, "n:i:S:s:d:c:h?")) >= 0) {
+        switch(c) {
+            case 'i': insize = std::strtoull(optarg, 0, 10); break;
+            case 's': sigma = std::atof(optarg); break;
+            case 'S': outsize = std::strtoull(optarg, 0, 10); break;
+            case 'n': nrows = std::strtoull(optarg, 0, 10); break;
+            case 'd': degree = std::atoi(optarg); break;
+            case 'c': offset = std::atof(optarg); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    insize = roundup(insize);
+    outsize = roundup(outsize);
+    blaze::DynamicMatrix<FLOAT_TYPE> in(nrows, insize);
+    for(size_t i(0); i < nrows; ++i) {
+        auto inrow(row(in, i));
+        unit_gaussian_fill(inrow, i);
+        inrow *= 1./norm(inrow);
+    }
+    ArcCosKernelType arccos(outsize, insize, 1337);
+    LaplacianKernelType laplacian(outsize, insize, 1337 * 2, sigma);
+    PolyKernelType poly(outsize, insize, 1337 * 3, degree, offset);
+    SORFGaussianKernelType sorfg(outsize, insize, 1337 * 4, sigma);
+    QMCGaussianKernelType sobolg(outsize, insize, 1337 * 4, sigma, 3, qmc::SOBOL), haltong(outsize, insize, 1337 * 4, sigma, 3, qmc::HALTON);
+    blaze::DynamicMatrix<FLOAT_TYPE> outac, outlap(nrows, laplacian.outdim() << 1, 0.), outpoly(nrows, poly.outdim());
+    blaze::DynamicMatrix<FLOAT_TYPE> outsorf(nrows, sorfg.outdim() << 1, 0.), outsobol(nrows, sobolg.outdim() << 1, 0.), outhalton(nrows, haltong.outdim() << 1, 0.);
+    {
+        Timer t("arc-cosine");
+        arccos.apply_batch(outac, in);
+    }
+    {
+        // Outputs start unsized, so any feature the kernel fails to write would show up here.
+        size_t mismatches = outac.columns() != arccos.outsize();
+        for(size_t i = 0; i < nrows; ++i) {
+            blaze::DynamicVector<FLOAT_TYPE> v;
+            arccos.apply(v, row(in, i));
+            mismatches += v.size() != outac.columns() || blaze::max(blaze::abs(v - trans(row(outac, i)))) > 1e-4;
+        }
+        std::fprintf(stderr, "arc-cosine: %zu features per row, %zu rows differ between apply and apply_batch\n", outac.columns(), mismatches);
+    }
+    {
+        Timer t("laplacian");
+        for(size_t i = 0; i < nrows; ++i) {auto r(row(outlap, i)); laplacian.apply(r, row(in, i));}
+    }
+    {
+        Timer t("tensorsketch");
+        poly.apply_batch(outpoly, in);
+    }
+    {
+        Timer t("sorf/qmc-sorf gaussian");
+        sorfg.apply_batch(outsorf, in);
+        sobolg.apply_batch(outsobol, in);
+        haltong.apply_batch(outhalton, in);
+    }
+    ArcCos1Kernel ack;
+    ExponentialKernel ek;
+    std::fprintf(stdout, "#Kernel\tMeanAbsErr\n");
+    std::fprintf(stdout, "arccos1\t%le\n", mean_abs_err(outac, [&](size_t i, size_t j) {return ack(row(in, i), row(in, j));}));
+    std::fprintf(stdout, "laplacian\t%le\n", mean_abs_err(outlap, [&](size_t i, size_t j) {return ek(row(in, i), row(in, j), sigma);}));
+    auto gk = [&](size_t i, size_t j) {return std::exp(-sqrNorm(row(in, i) - row(in, j)) / (2. * sigma * sigma));};
+    std::fprintf(stdout, "gaussian-sorf\t%le\n", mean_abs_err(outsorf, gk));
+    std::fprintf(stdout, "gaussian-sorf-sobol\t%le\n", mean_abs_err(outsobol, gk));
+    std::fprintf(stdout, "gaussian-sorf-halton\t%le\n", mean_abs_err(outhalton, gk));
+    std::fprintf(stdout, "poly\t%le\n", mean_abs_err(outpoly, [&](size_t i, size_t j) {return std::pow(double(dot(row(in, i), row(in, j))) + offset, degree);}));
+}
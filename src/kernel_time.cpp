@@ -20,6 +20,10 @@ using SORFKernelBase = kernel::sorf::KernelBlock<FLOAT_TYPE>;
 using SORFKernelType = kernel::Kernel<SORFKernelBase, kernel::GaussianFinalizer>;
 using FFKernelBase = kernel::ff::KernelBlock<FLOAT_TYPE>;
 using FFKernelType = kernel::Kernel<FFKernelBase, kernel::GaussianFinalizer>;
+using StreamedKernelBase = kernel::rf::StreamedKernelBlock<FLOAT_TYPE>;
+using StreamedKernelType = kernel::Kernel<StreamedKernelBase, kernel::GaussianFinalizer>;
+using HalfKernelBase = kernel::rf::ReducedPrecisionKernelBlock<FLOAT_TYPE, half::Float16>;
+using HalfKernelType = kernel::Kernel<HalfKernelBase, kernel::GaussianFinalizer>;
 
 struct GaussianKernel {
     template<typename V1, typename V2>
@@ -33,12 +37,13 @@ struct GaussianKernel {
 
 int usage(char *arg) {
     std::fprintf(stderr, "Usage: %s <opts>\n"
-                         "-i\tInput size [128]\n-s:sigma [1.0]\n-SOutput size [4096]\n-n: nsample points\n", arg);
+                         "-i\tInput size [128]\n-s:sigma [1.0]\n-SOutput size [4096]\n-n: nsample points\n"
+                         "-O: Run dense rf/orf even for large sizes\n-B: Apply kernels to the whole input matrix at once (GEMM for rf blocks)\n", arg);
     return EXIT_FAILURE;
 }
 
 template<typename Mat1, typename Mat2, typename KernelType>
-double time_stuff(Mat1 &outm, const Mat2 &in, const char *taskname, const KernelType &kernel, double sigma) {
+double time_stuff(Mat1 &outm, const Mat2 &in, const char *taskname, const KernelType &kernel, double sigma, bool batch=false) {
     const size_t nrows(in.rows()), insize(in.columns()), outsize(outm.columns());
     {
         char buf[1 << 10];
@@ -46,9 +51,13 @@ double time_stuff(Mat1 &outm, const Mat2 &in, const char *taskname, const Kernel
         ::std::cerr << buf;
     }
     Timer time(std::string(taskname) + " " + std::to_string(nrows) + " times on dimensions " + std::to_string(insize) + ", " + std::to_string(outsize) + " and sigma = " + std::to_string(sigma) + ".");
-    for(size_t i(0); i < nrows; ++i) {
-        auto orow(row(outm, i));
-        kernel.apply(orow, row(in, i));
+    if(batch) {
+        kernel.apply_batch(outm, in);
+    } else {
+        for(size_t i(0); i < nrows; ++i) {
+            auto orow(row(outm, i));
+            kernel.apply(orow, row(in, i));
+        }
     }
     return time.time();
 }
@@ -57,7 +66,7 @@ int main(int argc, char *argv[]) {
     int c;
     size_t insize(1 << 6), outsize(1 << 14), nrows(250);
     double sigma(1.);
-    bool force(false);
+    bool force(false), batch(false);
     while((c = getopt(argc, argv, "n:i:S:e:M:s:p:b:l:o:5OBrh?")) >= 0) {
         switch(c) {
             case 'i': insize = std::strtoull(optarg, 0, 10); break;
@@ -65,6 +74,7 @@ int main(int argc, char *argv[]) {
             case 'S': outsize = std::strtoull(optarg, 0, 10); break;
             case 'n': nrows = std::strtoull(optarg, 0, 10); break;
             case 'O': force = true; break;
+            case 'B': batch = true; break;
             case 'h': case '?': usage: return usage(*argv);
         }
     }
@@ -92,20 +102,29 @@ int main(int argc, char *argv[]) {
         for(indists(i, i) = 1e-300, j = i + 1; j < nrows; ++j)
              indists(i, j) = indists(j, i) = gk(row(in, i), row(in, j), sigma);
 #endif
-    double times[4]{0};
+    double times[6]{0};
     {
         if((insize * outsize) < (5000 * 32000) || force) {
             {
             KernelType kernel(outsize, insize, 1337, sigma);
-            times[0] = time_stuff(outm, in, "rf", kernel, sigma);
+            times[0] = time_stuff(outm, in, "rf", kernel, sigma, batch);
             }
             ORFKernelType orfkernel(outsize, insize, 1337 * 2, sigma);
-            times[1] = time_stuff(outm, in, "orf", orfkernel, sigma);
+            times[1] = time_stuff(outm, in, "orf", orfkernel, sigma, batch);
+        }
+        times[2] = time_stuff(outm, in, "sorf", sorfkernel, sigma, batch);
+        times[3] = time_stuff(outm, in, "ff", ffkernel, sigma, batch);
+        // The streamed and 16-bit rf variants provide the plain RF accuracy baseline at sizes where the dense matrix does not fit.
+        {
+            StreamedKernelType skernel(outsize, insize, 1337, sigma);
+            times[4] = time_stuff(outm, in, "rfstream", skernel, sigma, batch);
+        }
+        {
+            HalfKernelType hkernel(outsize, insize, 1337, sigma);
+            times[5] = time_stuff(outm, in, "rf16", hkernel, sigma, batch);
         }
-        times[2] = time_stuff(outm, in, "sorf", sorfkernel, sigma);
-        times[3] = time_stuff(outm, in, "ff", ffkernel, sigma);
     }
-    static constexpr const char * names[]{"rf", "orf", "sorf", "ff"};
+    static constexpr const char * names[]{"rf", "orf", "sorf", "ff", "rfstream", "rf16"};
     for(const auto name: names) std::fprintf(stdout, "%s\t", name);
     std::fputc('\n', stdout);
     for(const auto time: times) std::fprintf(stdout, "%lf\t", time);
@@ -0,0 +1,61 @@
+#include "frp/lsh.h"
+#include <thread>
+#include <getopt.h>
+
+using namespace frp;
+
+// Mixed insert/query throughput of ConcurrentLSHIndex at several write fractions.
+
+int usage(char *arg) {
+    std::fprintf(stderr, "Usage: %s <opts>\n-d\tDimension [64]\n-n\tNumber of points [200000]\n-t\tThreads [4]\n"
+                         "-o\tOperations per run [100000]\n-L\tNumber of tables [8]\n-K\tBits per table [14]\n-k\tNeighbors [10]\n", arg);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    size_t d = 64, n = 200000, nops = 100000;
+    unsigned nthreads = 4, L = 8, K = 14, k = 10;
+    while((c = getopt(argc, argv, "d:n:t:o:L:K:k:h?")) >= 0) {
+        switch(c) {
+            case 'd': d = std::strtoull(optarg, nullptr, 10); break;
+            case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+            case 't': nthreads = std::atoi(optarg); break;
+            case 'o': nops = std::strtoull(optarg, nullptr, 10); break;
+            case 'L': L = std::atoi(optarg); break;
+            case 'K': K = std::atoi(optarg); break;
+            case 'k': k = std::atoi(optarg); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    blaze::DynamicMatrix<float> data(n + nops, d);
+    unit_gaussian_fill(data, 13);
+    std::fprintf(stdout, "#WriteFraction\tThreads\tInserts/s\tQueries/s\tTotalOps/s\n");
+    for(const double wfrac: {0., .1, .5, .9, 1.}) {
+        ConcurrentLSHIndex<float> index(d, L, K, 1337, n + nops, n + nops);
+        // Prefill with a single writer so queries have something to find.
+        for(size_t i = 0; i < n; ++i) index.add(row(data, i));
+        std::atomic<size_t> next_insert(n), ninserts(0), nqueries(0);
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<std::thread> threads;
+        for(unsigned t = 0; t < nthreads; ++t) {
+            threads.emplace_back([&,t]() {
+                std::mt19937_64 mt(t);
+                std::uniform_real_distribution<double> urd;
+                for(size_t i = t; i < nops; i += nthreads) {
+                    if(urd(mt) < wfrac) {
+                        index.add(row(data, next_insert++));
+                        ++ninserts;
+                    } else {
+                        blaze::DynamicVector<float, blaze::rowVector> q = row(data, mt() % n);
+                        index.query(q, k);
+                        ++nqueries;
+                    }
+                }
+            });
+        }
+        for(auto &t: threads) t.join();
+        const double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        std::fprintf(stdout, "%lf\t%u\t%lf\t%lf\t%lf\n", wfrac, nthreads, ninserts / secs, nqueries / secs, nops / secs);
+    }
+}
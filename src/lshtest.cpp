@@ -1,8 +1,17 @@
 #include "frp/lsh.h"
+#include "frp/hamming.h"
+#include "frp/knn.h"
+#include <getopt.h>
 
 using namespace frp;
 
-int main() {
+int usage(char *arg) {
+    std::fprintf(stderr, "Usage: %s <opts>\n-d\tDimension [64]\n-n\tNumber of points [10000]\n-q\tNumber of queries [100]\n"
+                         "-L\tNumber of tables [16]\n-K\tBits per table [12]\n-k\tNeighbors [10]\n-P\tMaximum probes per table [16]\n", arg);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
     MatrixLSHasher<> mat(12, 16);
     std::vector<blaze::DynamicVector<float>> tmp;
     while(tmp.size() < 500) {
@@ -12,5 +21,175 @@ int main() {
     for(const auto &v: tmp) {
         std::fprintf(stderr, "hash: %zu\n", mat(v));
     }
-    
+    int c;
+    size_t d = 64, n = 10000, nq = 100;
+    unsigned L = 16, K = 12, k = 10, maxprobes = 16;
+    while((c = getopt(argc, argv, "d:n:q:L:K:k:P:h?")) >= 0) {
+        switch(c) {
+            case 'd': d = std::strtoull(optarg, nullptr, 10); break;
+            case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+            case 'q': nq = std::strtoull(optarg, nullptr, 10); break;
+            case 'L': L = std::atoi(optarg); break;
+            case 'K': K = std::atoi(optarg); break;
+            case 'k': k = std::atoi(optarg); break;
+            case 'P': maxprobes = std::atoi(optarg); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    // Queries are perturbed copies of indexed points, so each has a clear set of near neighbors.
+    blaze::DynamicMatrix<float> data(n, d), queries(nq, d);
+    unit_gaussian_fill(data, 13);
+    unit_gaussian_fill(queries, 17);
+    for(size_t i = 0; i < nq; ++i)
+        row(queries, i) = row(data, i * (n / nq)) + .1f * row(queries, i);
+    LSHIndex<float> index(d, L, K, 1337);
+    {
+        Timer t("LSHIndex build");
+        index.add_batch(data);
+        index.freeze();
+    }
+    // Ground truth by tiled GEMM, checked against pairwise distances; cosine and inner product are checked on their top 1.
+    std::vector<std::vector<ExactKNN<float>::result_type>> gemm;
+    {
+        Timer t("GEMM exact k-NN");
+        gemm = ExactKNN<float>::search(data, queries, k);
+    }
+    const auto cosres = ExactKNN<float>::search(data, queries, 1, knn::COSINE), ipres = ExactKNN<float>::search(data, queries, 1, knn::INNER_PRODUCT);
+    std::vector<std::vector<uint32_t>> exact(nq);
+    size_t gemm_mismatches = 0;
+    {
+        Timer t("Pairwise exact k-NN");
+        for(size_t i = 0; i < nq; ++i) {
+            std::vector<std::pair<float, uint32_t>> dists(n);
+            for(size_t j = 0; j < n; ++j)
+                dists[j] = {blaze::norm(row(data, j) - row(queries, i)), uint32_t(j)};
+            std::partial_sort(dists.begin(), dists.begin() + k, dists.end());
+            for(size_t j = 0; j < k; ++j) exact[i].push_back(dists[j].second);
+            for(size_t j = 0; j < k; ++j) gemm_mismatches += gemm[i][j].second != exact[i][j];
+            float bestcos = -2, bestip = -std::numeric_limits<float>::max();
+            uint32_t cosid = 0, ipid = 0;
+            for(size_t j = 0; j < n; ++j) {
+                const float ip = dot(row(data, j), row(queries, i)), c = ip / (blaze::norm(row(data, j)) * blaze::norm(row(queries, i)));
+                if(c > bestcos) bestcos = c, cosid = j;
+                if(ip > bestip) bestip = ip, ipid = j;
+            }
+            gemm_mismatches += (cosres[i][0].second != cosid) + (ipres[i][0].second != ipid);
+        }
+    }
+    std::fprintf(stderr, "GEMM exact k-NN: %zu mismatches with pairwise L2, cosine and inner product over %zu queries\n", gemm_mismatches, nq);
+    for(unsigned nprobes = 1; nprobes <= maxprobes; nprobes <<= 1) {
+        std::vector<std::vector<LSHIndex<float>::result_type>> results;
+        auto start = std::chrono::high_resolution_clock::now();
+        results = index.query_batch(queries, k, nprobes);
+        auto stop = std::chrono::high_resolution_clock::now();
+        size_t found = 0;
+        for(size_t i = 0; i < nq; ++i)
+            for(const auto &r: results[i])
+                found += std::find(exact[i].begin(), exact[i].end(), r.second) != exact[i].end();
+        std::fprintf(stderr, "LSHIndex with %u tables of %u bits, %u probes/table: recall@%u = %lf in %lf ms\n",
+                     L, K, nprobes, k, double(found) / (nq * k), std::chrono::duration<double, std::milli>(stop - start).count());
+    }
+    // Compressed re-ranking: int8 or PQ codes alone, and with exact re-ranking of the best 4k on full vectors.
+    const auto train = submatrix(data, 0, 0, std::min(n, size_t(20000)), d);
+    for(const auto type: {quant::SCALAR_INT8, quant::PRODUCT}) {
+        QuantizedStore<float> store(d, type);
+        {
+            Timer t(type == quant::PRODUCT ? "PQ training": "int8 training");
+            store.train(train);
+        }
+        for(const unsigned kprime: {0u, 4 * k}) {
+            LSHIndex<float> qindex = index;
+            qindex.quantize(store, kprime);
+            auto start = std::chrono::high_resolution_clock::now();
+            const auto results = qindex.query_batch(queries, k, maxprobes);
+            auto stop = std::chrono::high_resolution_clock::now();
+            size_t found = 0;
+            for(size_t i = 0; i < nq; ++i)
+                for(const auto &r: results[i])
+                    found += std::find(exact[i].begin(), exact[i].end(), r.second) != exact[i].end();
+            std::fprintf(stderr, "%s codes, %zu bytes/point, exact re-rank of %u: recall@%u = %lf in %lf ms\n",
+                         type == quant::PRODUCT ? "PQ": "int8", qindex.codes().code_size(), kprime, k, double(found) / (nq * k),
+                         std::chrono::duration<double, std::milli>(stop - start).count());
+        }
+    }
+    // Structured SRP sketches with more bits than input dimensions.
+    FHTLSHasher<float> sketcher(8 * d, d, 1337, 3);
+    std::vector<uint64_t> sketches(n * sketcher.nwords());
+    {
+        Timer t("FHTLSHasher 8d-bit sketches");
+        sketcher.sketch_batch(data, sketches.data());
+    }
+    {
+        MatrixLSHasher<float> dense(8 * d, d, false, 1337);
+        Timer t("Dense 8d-bit projections");
+        blaze::DynamicMatrix<float> proj = data * trans(dense.matrix());
+    }
+    // Hamming-space k-NN over the sketches: brute force vs multi-index hashing.
+    HammingIndex<> hindex(sketcher.nbits());
+    hindex.add_batch(sketches.data(), n);
+    std::vector<uint64_t> qsketches(nq * sketcher.nwords());
+    sketcher.sketch_batch(queries, qsketches.data());
+    std::vector<std::vector<HammingIndex<>::result_type>> bf, mih(nq);
+    {
+        Timer t("Hamming brute force");
+        bf = hindex.query_batch(qsketches.data(), nq, k);
+    }
+    hindex.build_multi_index((sketcher.nbits() + 31) / 32);
+    {
+        Timer t("Hamming multi-index hashing");
+        for(size_t i = 0; i < nq; ++i) mih[i] = hindex.query_mih(&qsketches[i * sketcher.nwords()], k);
+    }
+    size_t found = 0, agree = 0;
+    for(size_t i = 0; i < nq; ++i) {
+        for(const auto &r: bf[i])
+            found += std::find(exact[i].begin(), exact[i].end(), r.second) != exact[i].end();
+        agree += bf[i].size() == mih[i].size() && bf[i].back().first == mih[i].back().first;
+    }
+    std::fprintf(stderr, "%zu-bit Hamming recall@%u = %lf; multi-index matches brute force on %zu/%zu queries\n",
+                 sketcher.nbits(), k, double(found) / (nq * k), agree, nq);
+    if(hindex.query(qsketches.data(), 0).size() || hindex.query_mih(qsketches.data(), 0).size()
+       || hindex.query_batch(qsketches.data(), nq, 0)[0].size())
+        throw std::runtime_error("Hamming k-NN with k = 0 must return no neighbors");
+    // p-stable hashing: batched hashes must agree with per-row hashes, and near points should collide more often.
+    E2LSHasher<float> e2(d, 8, 4., 1337);
+    L1E2LSHasher<float> l1(d, 8, 16., 1337);
+    std::vector<uint64_t> e2hashes(n), l1hashes(n);
+    {
+        Timer t("E2LSH batched hashing");
+        e2.hash_batch(data, e2hashes.data());
+        l1.hash_batch(data, l1hashes.data());
+    }
+    size_t mismatches = 0, e2coll = 0, l1coll = 0;
+    for(size_t i = 0; i < nq; ++i) {
+        const size_t j = i * (n / nq);
+        mismatches += e2.hash(row(data, j)) != e2hashes[j];
+        e2coll += e2.hash(row(queries, i)) == e2hashes[j];
+        l1coll += l1.hash(row(queries, i)) == l1hashes[j];
+    }
+    std::fprintf(stderr, "E2LSH: %zu batch/single mismatches; near-duplicate collision rate L2 %lf, L1 %lf\n",
+                 mismatches, double(e2coll) / nq, double(l1coll) / nq);
+    // Cross-polytope vs SRP at equal key width: near duplicates should collide more often, random pairs no more often.
+    CrossPolytopeLSHasher<float> cp(d, 2, 1337);
+    const unsigned cpbits = 2 * std::log2(2. * cp.cp_dim());
+    MatrixLSHasher<float> srp(cpbits, d, false, 1337);
+    std::vector<uint64_t> cphashes(n);
+    {
+        Timer t("Cross-polytope batched hashing");
+        cp.hash_batch(data, cphashes.data());
+    }
+    size_t cpnear = 0, cprand = 0, srpnear = 0, srprand = 0, cpprobed = 0;
+    std::vector<uint64_t> cpprobes;
+    for(size_t i = 0; i < nq; ++i) {
+        const size_t j = i * (n / nq), o = (j + n / 2) % n;
+        blaze::DynamicVector<float> x(trans(row(data, j))), q(trans(row(queries, i))), other(trans(row(data, o)));
+        cpnear += cp.hash(q) == cphashes[j];
+        cprand += cphashes[o] == cphashes[j];
+        srpnear += srp(q) == srp(x);
+        srprand += srp(other) == srp(x);
+        cp.probes(q, maxprobes, cpprobes);
+        cpprobed += std::find(cpprobes.begin(), cpprobes.end(), cphashes[j]) != cpprobes.end();
+    }
+    std::fprintf(stderr, "%u-bit keys: near-duplicate collision rate cross-polytope %lf (%lf with %u probes), SRP %lf; "
+                         "random-pair collision rate cross-polytope %lf, SRP %lf\n",
+                 cpbits, double(cpnear) / nq, double(cpprobed) / nq, maxprobes, double(srpnear) / nq, double(cprand) / nq, double(srprand) / nq);
 }
@@ -0,0 +1,95 @@
+#include "frp/minhash.h"
+#include <getopt.h>
+
+using namespace frp;
+using namespace minhash;
+
+// Compares set-similarity sketch estimates with exact (weighted) Jaccard and checks banded candidate generation.
+
+int usage(char *arg) {
+    std::fprintf(stderr, "Usage: %s <opts>\n-k\tRegisters per signature [1024]\n-n\tSets in the banding test [10000]\n", arg);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    unsigned k = 1024;
+    size_t nsets = 10000;
+    while((c = getopt(argc, argv, "k:n:h?")) >= 0) {
+        switch(c) {
+            case 'k': k = std::atoi(optarg); break;
+            case 'n': nsets = std::strtoull(optarg, nullptr, 10); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    std::mt19937_64 gen(1337);
+    // |A & B| = 600, |A | B| = 1000
+    std::vector<uint64_t> a, b;
+    while(a.size() < 800) a.push_back(gen());
+    b.assign(a.begin() + 200, a.end());
+    while(b.size() < 800) b.push_back(gen());
+    std::vector<uint64_t> sa(k), sb(k);
+    std::fprintf(stdout, "#Sketch\tEstimate\tExact\n");
+    OnePermutationMinHash oph(k, 13);
+    oph.sketch(a.begin(), a.end(), sa.data());
+    oph.sketch(b.begin(), b.end(), sb.data());
+    std::fprintf(stdout, "oph\t%lf\t%lf\n", similarity(sa.data(), sb.data(), k), .6);
+    // Sets much smaller than k leave most bins empty, exercising densification.
+    std::vector<uint64_t> sa2(k), sb2(k);
+    oph.sketch(a.begin(), a.begin() + 50, sa2.data());
+    oph.sketch(a.begin() + 20, a.begin() + 70, sb2.data());
+    std::fprintf(stdout, "oph-densified\t%lf\t%lf\n", similarity(sa2.data(), sb2.data(), k), 30. / 70.);
+    KMinHash kmh(k, 13);
+    {
+        Timer t("k-permutation minhash");
+        kmh.sketch(a.begin(), a.end(), sa.data());
+        kmh.sketch(b.begin(), b.end(), sb.data());
+    }
+    std::fprintf(stdout, "kminhash\t%lf\t%lf\n", similarity(sa.data(), sb.data(), k), .6);
+    for(const unsigned bits: {1u, 2u, 4u, 8u}) {
+        std::vector<uint64_t> pa(bbit_words(k, bits)), pb(bbit_words(k, bits));
+        pack_bbit(sa.data(), k, bits, pa.data());
+        pack_bbit(sb.data(), k, bits, pb.data());
+        std::fprintf(stdout, "%u-bit\t%lf\t%lf\n", bits, bbit_similarity(pa.data(), pb.data(), k, bits), .6);
+    }
+    // Weighted sets, as read by LineIterator::sparse_set.
+    blaze::CompressedVector<double> wa(1000), wb(1000);
+    std::uniform_real_distribution<double> urd(.1, 2.);
+    double minsum = 0., maxsum = 0.;
+    for(size_t i = 0; i < 300; ++i) {
+        const double x = urd(gen), y = i % 3 ? urd(gen): 0.;
+        wa[i] = x;
+        if(y) wb[i] = y;
+        minsum += std::min(x, y), maxsum += std::max(x, y);
+    }
+    ICWS icws(k, 13);
+    icws.sketch_nz(wa, sa.data());
+    icws.sketch_nz(wb, sb.data());
+    std::fprintf(stdout, "icws\t%lf\t%lf\n", similarity(sa.data(), sb.data(), k), minsum / maxsum);
+
+    // Banding: near-duplicates (90% shared elements) of indexed sets should be found, others not.
+    const unsigned nbands = 32, rows = 4;
+    OnePermutationMinHash bander(nbands * rows, 17);
+    MinHashLSH<> index(nbands, rows);
+    std::vector<std::vector<uint64_t>> sets(nsets);
+    std::vector<uint64_t> sig(nbands * rows);
+    {
+        Timer t("banded index build");
+        for(auto &set: sets) {
+            while(set.size() < 100) set.push_back(gen());
+            bander.sketch(set.begin(), set.end(), sig.data());
+            index.add(sig.data());
+        }
+        index.freeze();
+    }
+    size_t found = 0, ncand = 0;
+    for(size_t i = 0; i < nsets; i += nsets / 100) {
+        auto q = sets[i];
+        for(size_t j = 0; j < 10; ++j) q[j] = gen();
+        bander.sketch(q.begin(), q.end(), sig.data());
+        const auto res = index.query(sig.data());
+        ncand += res.size();
+        found += res.size() && res[0].second == i;
+    }
+    std::fprintf(stdout, "banding\tfound %zu/100 near-duplicates, %lf candidates/query\n", found, ncand / 100.);
+}
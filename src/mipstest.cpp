@@ -0,0 +1,85 @@
+#include "frp/mips.h"
+#include "frp/dci.h"
+#include <getopt.h>
+
+using namespace frp;
+
+// Top-k inner product retrieval through the asymmetric MIPS transform, served by LSHIndex (SRP) and DCI.
+
+int usage(char *arg) {
+    std::fprintf(stderr, "Usage: %s <opts>\n-d\tDimension [64]\n-n\tNumber of points [20000]\n-q\tNumber of queries [100]\n"
+                         "-L\tNumber of tables [16]\n-K\tBits per table [10]\n-k\tNeighbors [10]\n-P\tProbes per table [8]\n", arg);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    size_t d = 64, n = 20000, nq = 100;
+    unsigned L = 16, K = 10, k = 10, nprobes = 8;
+    while((c = getopt(argc, argv, "d:n:q:L:K:k:P:h?")) >= 0) {
+        switch(c) {
+            case 'd': d = std::strtoull(optarg, nullptr, 10); break;
+            case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+            case 'q': nq = std::strtoull(optarg, nullptr, 10); break;
+            case 'L': L = std::atoi(optarg); break;
+            case 'K': K = std::atoi(optarg); break;
+            case 'k': k = std::atoi(optarg); break;
+            case 'P': nprobes = std::atoi(optarg); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    // Norms vary across points, so the inner product ranking differs from the Euclidean and angular ones.
+    blaze::DynamicMatrix<float> data(n, d), queries(nq, d);
+    unit_gaussian_fill(data, 13);
+    unit_gaussian_fill(queries, 17);
+    std::mt19937_64 mt(1337);
+    std::uniform_real_distribution<float> scale(.25, 2.);
+    for(size_t i = 0; i < n; ++i) row(data, i) *= scale(mt);
+    std::vector<std::vector<uint32_t>> exact(nq);
+    for(size_t i = 0; i < nq; ++i) {
+        std::vector<std::pair<float, uint32_t>> ips(n);
+        for(size_t j = 0; j < n; ++j) ips[j] = {-blaze::dot(row(data, j), row(queries, i)), uint32_t(j)};
+        std::partial_sort(ips.begin(), ips.begin() + k, ips.end());
+        for(size_t j = 0; j < k; ++j) exact[i].push_back(ips[j].second);
+    }
+    auto recall = [&](size_t i, uint32_t id) -> size_t {return std::find(exact[i].begin(), exact[i].end(), id) != exact[i].end();};
+
+    MIPSTransform<float> tx(d);
+    tx.fit(data);
+    blaze::DynamicMatrix<float> tdata, tqueries;
+    {
+        Timer t("MIPS transform");
+        tx.transform_data_batch(data, tdata);
+        tx.transform_query_batch(queries, tqueries);
+    }
+    // Reranking by distance in the transformed space is reranking by inner product.
+    LSHIndex<float> index(tx.dim(), L, K, 1337);
+    index.add_batch(tdata);
+    index.freeze();
+    auto results = index.query_batch(tqueries, k, nprobes);
+    size_t found = 0;
+    double maxerr = 0.;
+    for(size_t i = 0; i < nq; ++i) {
+        for(const auto &r: results[i]) {
+            found += recall(i, r.second);
+            const double ip = tx.inner_product(r.first, blaze::sqrNorm(row(queries, i)));
+            maxerr = std::max(maxerr, std::abs(ip - blaze::dot(row(data, r.second), row(queries, i))) / (1. + std::abs(ip)));
+        }
+    }
+    std::fprintf(stderr, "LSHIndex (SRP) MIPS recall@%u with %u probes: %lf; max relative inner product error %le\n",
+                 k, nprobes, double(found) / (nq * k), maxerr);
+
+    dci::DCI<float> dindex(4, 8, tx.dim());
+    dci::DCI<float, uint32_t, std::set, ska::flat_hash_set, blaze::rowMajor, FHTLSHasher<float>> findex(4, 8, tx.dim());
+    for(size_t i = 0; i < n; ++i) {
+        dindex.add(row(tdata, i));
+        findex.add(row(tdata, i));
+    }
+    size_t dfound = 0, ffound = 0;
+    for(size_t i = 0; i < nq; ++i) {
+        for(const auto &r: dindex.query(&tqueries(i, 0), k)) dfound += recall(i, r.id());
+        for(const auto &r: findex.query(&tqueries(i, 0), k)) ffound += recall(i, r.id());
+    }
+    std::fprintf(stderr, "DCI MIPS recall@%u: %lf (dense projections), %lf (FHT projections)\n",
+                 k, double(dfound) / (nq * k), double(ffound) / (nq * k));
+}
@@ -0,0 +1,85 @@
+#include <cstdio>
+#include <cassert>
+#include <getopt.h>
+#include "frp/frp.h"
+#include "frp/dci.h"
+
+using namespace frp;
+
+// Saves each serializable type, reloads it through mmap and checks the reloaded object reproduces the original's output.
+
+using ORFKernelType = kernel::Kernel<kernel::orf::KernelBlock<FLOAT_TYPE>, kernel::GaussianFinalizer>;
+using SORFKernelType = kernel::Kernel<kernel::sorf::KernelBlock<FLOAT_TYPE>, kernel::GaussianFinalizer>;
+using DCIType = dci::DCI<FLOAT_TYPE>;
+
+template<typename T, typename F>
+double compare(const T &orig, const char *path, const char *name, const F &func) {
+    Timer *t = new Timer(std::string("save ") + name);
+    serial::save(orig, path);
+    delete t;
+    auto start = std::chrono::high_resolution_clock::now();
+    T loaded = serial::load<T>(path);
+    auto stop = std::chrono::high_resolution_clock::now();
+    const double err = func(orig, loaded);
+    std::fprintf(stderr, "%s: reloaded in %lf ms, max abs difference %le\n", name,
+                 std::chrono::duration<double, std::milli>(stop - start).count(), err);
+    return err;
+}
+
+int usage(char *arg) {
+    std::fprintf(stderr, "Usage: %s <opts>\n-i\tInput size [256]\n-S\tOutput size [1024]\n-n\tNumber of points [1000]\n-p\tTemporary path [/tmp/frp_serialtest.bin]\n", arg);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    size_t insize(256), outsize(1024), npoints(1000);
+    std::string path("/tmp/frp_serialtest.bin");
+    while((c = getopt(argc, argv, "i:S:n:p:h?")) >= 0) {
+        switch(c) {
+            case 'i': insize = std::strtoull(optarg, nullptr, 10); break;
+            case 'S': outsize = std::strtoull(optarg, nullptr, 10); break;
+            case 'n': npoints = std::strtoull(optarg, nullptr, 10); break;
+            case 'p': path = optarg; break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    insize = roundup(insize);
+    blaze::DynamicMatrix<FLOAT_TYPE> data(npoints, insize);
+    unit_gaussian_fill(data, 13);
+    blaze::DynamicVector<FLOAT_TYPE> query(trans(row(data, 0)));
+    double maxerr = 0.;
+
+    OrthogonalJLTransform<FLOAT_TYPE> ojlt(insize, insize / 4, 1337);
+    maxerr = std::max(maxerr, compare(ojlt, path.data(), "ojlt", [&](const auto &a, const auto &b) {
+        blaze::DynamicVector<FLOAT_TYPE> x(query), y(query);
+        a.transform_inplace(x); b.transform_inplace(y);
+        return double(max(abs(x - y)));
+    }));
+    auto kernel_diff = [&](const auto &a, const auto &b) {
+        blaze::DynamicMatrix<FLOAT_TYPE> x, y;
+        a.apply_batch(x, data); b.apply_batch(y, data);
+        return double(max(abs(x - y)));
+    };
+    maxerr = std::max(maxerr, compare(ORFKernelType(outsize, insize, 1337), path.data(), "orf kernel", kernel_diff));
+    maxerr = std::max(maxerr, compare(SORFKernelType(outsize, insize, 1337), path.data(), "sorf kernel", kernel_diff));
+    maxerr = std::max(maxerr, compare(MatrixLSHasher<FLOAT_TYPE>(64, insize, true, 1337), path.data(), "matrix lsh", [&](const auto &a, const auto &b) {
+        return double(max(abs(a.project(query) - b.project(query))));
+    }));
+    DCIType index(4, 8, insize);
+    for(size_t i = 0; i < npoints; ++i) index.add(row(data, i));
+    maxerr = std::max(maxerr, compare(index, path.data(), "dci", [&](const auto &a, auto &b) {
+        const_cast<DCIType &>(b).rebind(data.data(), data.spacing());
+        auto ra = a.query(query, 10), rb = b.query(query, 10);
+        double ret = ra.size() != rb.size() ? 1.: 0.;
+        for(size_t i = 0; i < std::min(ra.size(), rb.size()); ++i)
+            ret = std::max(ret, ra[i].id() != rb[i].id() ? 1.: 0.);
+        return ret;
+    }));
+    std::remove(path.data());
+    if(maxerr != 0.) {
+        std::fprintf(stderr, "Reloaded objects differ from the originals.\n");
+        return EXIT_FAILURE;
+    }
+    std::fprintf(stderr, "All reloaded objects match.\n");
+}